@@ -2,7 +2,8 @@
 // This script converts the CIFAR dataset to the leveldb format used
 // by caffe to perform classification.
 // Usage:
-//    convert_cifar_data input_folder output_db_file
+//    convert_cifar_data input_folder output_folder db_type
+// where db_type is leveldb, lmdb or packed.
 // The CIFAR dataset could be downloaded at
 //    http://www.cs.toronto.edu/~kriz/cifar.html
 
@@ -98,7 +99,8 @@ int main(int argc, char** argv) {
            "by caffe to perform classification.\n"
            "Usage:\n"
            "    convert_cifar_data input_folder output_folder db_type\n"
-           "Where the input folder should contain the binary batch files.\n"
+           "Where the input folder should contain the binary batch files,\n"
+           "and db_type is leveldb, lmdb or packed.\n"
            "The CIFAR dataset could be downloaded at\n"
            "    http://www.cs.toronto.edu/~kriz/cifar.html\n"
            "You should gunzip them after downloading.\n");
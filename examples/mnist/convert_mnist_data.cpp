@@ -1,5 +1,6 @@
-// This script converts the MNIST dataset to a lmdb (default) or
-// leveldb (--backend=leveldb) format used by caffe to load data.
+// This script converts the MNIST dataset to a lmdb (default), leveldb
+// (--backend=leveldb) or packed (--backend=packed) format used by caffe to
+// load data.
 // Usage:
 //    convert_mnist_data [FLAGS] input_image_file input_label_file
 //                        output_db_file
@@ -33,7 +34,8 @@ using namespace caffe;  // NOLINT(build/namespaces)
 using boost::scoped_ptr;
 using std::string;
 
-DEFINE_string(backend, "lmdb", "The backend for storing the result");
+DEFINE_string(backend, "lmdb",
+    "The backend {lmdb, leveldb, packed} for storing the result");
 
 uint32_t swap_endian(uint32_t val) {
     val = ((val << 8) & 0xFF00FF00) | ((val >> 8) & 0xFF00FF);
@@ -118,7 +120,7 @@ int main(int argc, char** argv) {
   FLAGS_alsologtostderr = 1;
 
   gflags::SetUsageMessage("This script converts the MNIST dataset to\n"
-        "the lmdb/leveldb format used by Caffe to load data.\n"
+        "the lmdb/leveldb/packed format used by Caffe to load data.\n"
         "Usage:\n"
         "    convert_mnist_data [FLAGS] input_image_file input_label_file "
         "output_db_file\n"
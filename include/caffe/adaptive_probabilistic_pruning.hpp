@@ -16,6 +16,10 @@ public:
      APP() {};
     ~APP() {};
 
+    /// Clears the state of the layers registered for pruning and sets pruning
+    /// off, e.g. before building other nets in the same process
+    static void Reset();
+
     /// --------------------------------
     /// pass params from solver.prototxt to layer
     static string prune_method;
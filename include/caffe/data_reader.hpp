@@ -19,19 +19,56 @@ namespace caffe {
  * databases are read sequentially, and that each solver accesses a different
  * subset of the database. Data is distributed to solvers in a round-robin
  * way to keep parallel training deterministic.
+ *
+ * If the source can pin its values in memory (e.g. LMDB read transactions),
+ * records are not copied: only the Datum header fields are parsed, and the
+ * payload is read in place from the database pages.
+ *
+ * Databases are read through a sequential cursor, so records come out in
+ * storage order. If data_param.shuffle_buffer is set, records first go
+ * through a buffer of that many entries, from which they are sampled at
+ * random while the cursor refills it. This gives a near-random order while
+ * keeping I/O sequential. Backends with random access (e.g. packed files)
+ * can instead be read in a truly random order, with data_param.shuffle.
+ *
+ * A source can also be sharded, when a single cursor cannot keep up with the
+ * storage: data_param.shard_source lists more databases, and
+ * data_param.partitions splits each database into contiguous key ranges.
+ * Every range is read by its own thread, and the body interleaves their
+ * records, in a fixed order unless data_param.ordered_shards is false.
  */
 class DataReader {
  public:
   explicit DataReader(const LayerParameter& param);
   ~DataReader();
 
-  inline BlockingQueue<Datum*>& free() const {
+  // A record read from the source. datum_ holds the header fields, and data_
+  // points at the payload, either in datum_ itself or in pinned pages that
+  // stay valid as long as the reader exists.
+  class Item {
+   public:
+    Item() : data_(NULL), data_size_(0) {}
+
+    Datum datum_;
+    const char* data_;
+    size_t data_size_;
+
+  DISABLE_COPY_AND_ASSIGN(Item);
+  };
+
+  inline BlockingQueue<Item*>& free() const {
     return queue_pair_->free_;
   }
-  inline BlockingQueue<Datum*>& full() const {
+  inline BlockingQueue<Item*>& full() const {
     return queue_pair_->full_;
   }
 
+  // Adds count items of read-ahead capacity
+  void Grow(int count);
+  // Releases up to count items of read-ahead capacity, among those not
+  // currently filled or in use, and returns how many were released.
+  int Shrink(int count);
+
  protected:
   // Queue pairs are shared between a body and its readers
   class QueuePair {
@@ -39,12 +76,85 @@ class DataReader {
     explicit QueuePair(int size);
     ~QueuePair();
 
-    BlockingQueue<Datum*> free_;
-    BlockingQueue<Datum*> full_;
+    BlockingQueue<Item*> free_;
+    BlockingQueue<Item*> full_;
 
   DISABLE_COPY_AND_ASSIGN(QueuePair);
   };
 
+  // Fixed number of records kept for random sampling. Pinned records are
+  // referenced in place, others are copied to a single arena, in slots of
+  // equal stride sized for the largest record seen so far.
+  class ShuffleBuffer {
+   public:
+    explicit ShuffleBuffer(int capacity);
+
+    inline int capacity() const { return sizes_.size(); }
+    inline int size() const { return size_; }
+
+    // Stores a record in slot, which must be below size() + 1
+    void Put(int slot, const char* data, size_t size, bool pinned);
+    // Returns the record in slot, valid until the slot is overwritten
+    const char* Get(int slot, size_t* size, bool* pinned) const;
+
+   protected:
+    vector<char> arena_;
+    size_t stride_;
+    vector<const char*> pinned_;
+    vector<size_t> sizes_;
+    int size_;
+
+  DISABLE_COPY_AND_ASSIGN(ShuffleBuffer);
+  };
+
+  // Reads a contiguous range of records of one database, in order, through
+  // a shuffle buffer, or in a random permutation of the range, and wraps
+  // around at the end of the range.
+  class Source {
+   public:
+    // Reads size records from begin, or the whole database if size is 0.
+    // The partitions of a database share it, each through its own cursor.
+    Source(const LayerParameter& param, const shared_ptr<db::DB>& db,
+        const string& path, const string& begin, size_t size);
+
+    void read_one(QueuePair* qp);
+
+   protected:
+    void next();
+    void buffer_one(int slot);
+    // Fills item with the record at the cursor
+    void fill_current(Item* item);
+
+    shared_ptr<db::DB> db_;
+    shared_ptr<db::Cursor> cursor_;
+    shared_ptr<ShuffleBuffer> shuffle_;
+    const string begin_;
+    const size_t size_;
+    size_t position_;
+    // For random order reads, index of the first record and permutation of
+    // the range
+    size_t first_;
+    vector<size_t> order_;
+
+  DISABLE_COPY_AND_ASSIGN(Source);
+  };
+
+  // Reads a source on its own thread, into a queue pair private to the
+  // shard, or shared by all shards if their order does not matter.
+  class Shard : public InternalThread {
+   public:
+    Shard(const shared_ptr<Source>& source, const shared_ptr<QueuePair>& qp);
+    virtual ~Shard();
+
+   protected:
+    void InternalThreadEntry();
+
+    shared_ptr<Source> source_;
+    shared_ptr<QueuePair> qp_;
+
+  DISABLE_COPY_AND_ASSIGN(Shard);
+  };
+
   // A single body is created per source
   class Body : public InternalThread {
    public:
@@ -53,16 +163,25 @@ class DataReader {
 
    protected:
     void InternalThreadEntry();
-    void read_one(db::Cursor* cursor, QueuePair* qp);
+    void read_one(QueuePair* qp);
+    void make_sources(vector<shared_ptr<Source> >* sources);
 
     const LayerParameter param_;
     BlockingQueue<shared_ptr<QueuePair> > new_queue_pairs_;
+    // Set if there is a single source, read on the body thread
+    shared_ptr<Source> source_;
+    // Otherwise, queue pairs the shards read into, in interleaving order
+    vector<shared_ptr<QueuePair> > shard_queue_pairs_;
+    int next_shard_;
 
     friend class DataReader;
 
   DISABLE_COPY_AND_ASSIGN(Body);
   };
 
+  // Deserializes a record into item, in place if the record is pinned
+  static void fill(Item* item, const char* data, size_t size, bool pinned);
+
   // A source is uniquely identified by its layer name + path, in case
   // the same database is read from two different locations in the net.
   static inline string source_key(const LayerParameter& param) {
@@ -37,6 +37,51 @@ class DataTransformer {
    */
   void Transform(const Datum& datum, Blob<Dtype>* transformed_blob);
 
+  /**
+   * @brief Same as above, but reads the datum payload from data instead of
+   * datum.data(), e.g. bytes left in place by ParseDatumHeader.
+   *
+   * @param datum
+   *    Datum holding the header fields (shape, encoded, float_data).
+   * @param data
+   *    The uint8 or encoded payload, data_size bytes long.
+   */
+  void Transform(const Datum& datum, const char* data, size_t data_size,
+                Blob<Dtype>* transformed_blob);
+
+  /**
+   * @brief Crops and mirrors the uint8 payload of a non-encoded Datum like
+   * Transform, but leaves the pixels as uint8, without mean subtraction and
+   * scaling. Normalize finishes the transformation later, typically on the
+   * compute device, so that 4x fewer bytes are stored and copied.
+   *
+   * @param pixels
+   *    Destination of the cropped item, channels x crop height x crop width.
+   * @param crop
+   *    Receives {h_off, w_off, mirror}, needed to subtract a mean file.
+   */
+  void TransformPixels(const Datum& datum, const char* data, size_t data_size,
+                       uint8_t* pixels, int* crop);
+
+  /**
+   * @brief Subtracts the mean and scales items prepared by TransformPixels.
+   *
+   * @param pixels
+   *    uint8 items, as many as normalized_blob->num().
+   * @param crops
+   *    The {h_off, w_off, mirror} triplet of each item.
+   * @param normalized_blob
+   *    Destination blob, shaped like the items.
+   */
+  void Normalize(const uint8_t* pixels, const int* crops,
+                 Blob<Dtype>* normalized_blob);
+  /**
+   * @brief Same as Normalize, with pixels and crops in device memory, and
+   * writes the GPU data of normalized_blob.
+   */
+  void Normalize_gpu(const uint8_t* pixels, const int* crops,
+                     Blob<Dtype>* normalized_blob);
+
   /**
    * @brief Applies the transformation defined in the data layer's
    * transform_param block to a vector of Datum.
@@ -98,6 +143,12 @@ class DataTransformer {
    *    Datum containing the data to be transformed.
    */
   vector<int> InferBlobShape(const Datum& datum);
+  /**
+   * @brief Infers the shape of a datum whose payload is stored outside of
+   *    it, see Transform(const Datum&, const char*, size_t, Blob<Dtype>*).
+   */
+  vector<int> InferBlobShape(const Datum& datum, const char* data,
+      size_t data_size);
   /**
    * @brief Infers the shape of transformed_blob will have when
    *    the transformation is applied to the data.
@@ -138,7 +189,10 @@ class DataTransformer {
    */
   virtual int Rand(int n);
 
-  void Transform(const Datum& datum, Dtype* transformed_data);
+  void Transform(const Datum& datum, const char* data, size_t data_size,
+                 Dtype* transformed_data);
+  // Mean of each channel from mean_value, or zeros, for Normalize
+  const Blob<Dtype>& channel_mean(int channels);
   // Tranformation parameters
   TransformationParameter param_;
 
@@ -147,6 +201,7 @@ class DataTransformer {
   Phase phase_;
   Blob<Dtype> data_mean_;
   vector<Dtype> mean_values_;
+  Blob<Dtype> channel_mean_;
 };
 
 }  // namespace caffe
@@ -49,6 +49,23 @@ template <typename Dtype>
 class Batch {
  public:
   Blob<Dtype> data_, label_;
+  // Further tops, for layers with more than data and labels
+  vector<shared_ptr<Blob<Dtype> > > extra_;
+  // With deferred normalization, items are prefetched as uint8 pixels,
+  // cropped and mirrored, along with their {h_off, w_off, mirror} triplets.
+  // data_ then only holds the shape, and is filled in the forward pass.
+  shared_ptr<SyncedMemory> pixels_;
+  Blob<int> crops_;
+
+  // Sizes pixels_ and crops_ for the shape of data_
+  void ReshapePixels() {
+    if (!pixels_ || pixels_->size() != data_.count()) {
+      pixels_.reset(new SyncedMemory(data_.count()));
+    }
+    vector<int> crops_shape(2, 3);
+    crops_shape[0] = data_.shape(0);
+    crops_.Reshape(crops_shape);
+  }
 };
 
 template <typename Dtype>
@@ -67,18 +84,53 @@ class BasePrefetchingDataLayer :
   virtual void Forward_gpu(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top);
 
-  // Prefetches batches (asynchronously if to GPU memory)
+  // Prefetches batches (asynchronously if to GPU memory), unless
+  // DataParameter.prefetch is set
   static const int PREFETCH_COUNT = 3;
+  // Number of batches currently prefetched
+  inline int prefetch_depth() const { return prefetch_.size(); }
+  // Waits of the net on prefetched batches
+  inline BlockingQueueStats prefetch_full_stats() const {
+    return prefetch_full_.stats();
+  }
+  // Waits of the prefetch thread on batches consumed by the net
+  inline BlockingQueueStats prefetch_free_stats() const {
+    return prefetch_free_.stats();
+  }
 
  protected:
   virtual void InternalThreadEntry();
   virtual void load_batch(Batch<Dtype>* batch) = 0;
+  // Called on the main thread when batches were added to or released from
+  // the prefetch queues, e.g. to resize read-ahead buffers feeding load_batch.
+  virtual void prefetch_resized(int delta) {}
+  // Allocates the host memory of a batch, and device memory in GPU mode, so
+  // that the prefetch thread does not make allocations on its own.
+  void reserve_batch(Batch<Dtype>* batch);
+
+  // Pops the next loaded batch, adding a batch to the queues if the net had
+  // to wait for it (see DataParameter.max_prefetch).
+  Batch<Dtype>* next_batch();
+  // Hands a consumed batch back to the prefetch thread, or releases it under
+  // host memory pressure.
+  void recycle_batch(Batch<Dtype>* batch);
+  void log_prefetch_stats();
 
-  Batch<Dtype> prefetch_[PREFETCH_COUNT];
+  vector<shared_ptr<Batch<Dtype> > > prefetch_;
   BlockingQueue<Batch<Dtype>*> prefetch_free_;
   BlockingQueue<Batch<Dtype>*> prefetch_full_;
 
   Blob<Dtype> transformed_data_;
+  // Set by layers that support TransformationParameter.defer_normalization
+  // for their data, to prefetch uint8 pixels (see Batch::pixels_).
+  bool defer_normalization_;
+
+  // Adaptive prefetching and statistics state, main thread only
+  int min_prefetch_;  // The initial depth, extra batches are released to it
+  int forward_count_;
+  size_t full_waits_;  // Net waits seen by the last forward pass
+  size_t free_waits_;  // Prefetch thread waits when the depth last grew
+  BlockingQueueStats last_full_stats_, last_free_stats_;
 };
 
 }  // namespace caffe
@@ -1,6 +1,8 @@
 #ifndef CAFFE_DATA_LAYER_HPP_
 #define CAFFE_DATA_LAYER_HPP_
 
+#include <stdint.h>
+
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -11,6 +13,7 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/db.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -30,8 +33,26 @@ class DataLayer : public BasePrefetchingDataLayer<Dtype> {
 
  protected:
   virtual void load_batch(Batch<Dtype>* batch);
+  virtual void prefetch_resized(int delta);
+  // Destinations of the items of the batch being loaded
+  struct Slots {
+    Dtype* data;
+    Dtype* label;
+    uint8_t* pixels;  // Set instead of data with deferred normalization
+    int* crops;
+  };
+  // Transforms an item into its slot, view being shaped like one item
+  void transform_item(DataTransformer<Dtype>* transformer,
+      const DataReader::Item& item, int item_id, const Slots& slots,
+      Blob<Dtype>* view);
+  // Transforms the batch items assigned to one worker of transform_pool_
+  void transform_items(const Slots& slots, int worker);
 
   DataReader reader_;
+  // One transformer per worker, so that random streams are not shared
+  vector<shared_ptr<DataTransformer<Dtype> > > transformers_;
+  vector<DataReader::Item*> batch_items_;
+  shared_ptr<ThreadPool> transform_pool_;
 };
 
 }  // namespace caffe
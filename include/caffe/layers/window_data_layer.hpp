@@ -14,6 +14,8 @@
 
 namespace caffe {
 
+class ImageCache;
+
 /**
  * @brief Provides data to the Net from windows of images files, specified
  *        by a window data file.
@@ -48,6 +50,8 @@ class WindowDataLayer : public BasePrefetchingDataLayer<Dtype> {
   bool has_mean_values_;
   bool cache_images_;
   vector<std::pair<std::string, Datum > > image_database_cache_;
+  // Decoded images, if window_data_param.image_cache is enabled
+  shared_ptr<ImageCache> image_cache_;
 };
 
 }  // namespace caffe
@@ -99,12 +99,25 @@ class Net {
    * called manually.
    */
   void ShareWeights();
+  /**
+   * @brief Moves the learnable params into flat_params().
+   *
+   * Note: this is called by Net::Init if contiguous_params is set, or can be
+   * called once on an initialized net, e.g. by CPUSync.
+   */
+  void FlattenParams();
 
   /**
    * @brief For an already initialized net, implicitly copies (i.e., using no
    *        additional memory) the pre-trained layers from another Net.
    */
   void ShareTrainedLayersWith(const Net* other);
+  /**
+   * @brief For an already initialized net, copies the values of the
+   *        pre-trained layers of another Net, e.g. to evaluate them while
+   *        the other trains.
+   */
+  void CopyTrainedLayersFrom(const Net* other);
   // For an already initialized net, CopyTrainedLayersFrom() copies the already
   // trained layers from another net parameter instance.
   /**
@@ -178,6 +191,18 @@ class Net {
   inline const vector<Blob<Dtype>*>& learnable_params() const {
     return learnable_params_;
   }
+  /**
+   * @brief Returns a blob holding the data and diffs of all the learnable
+   *        params, each param being a view on a range of it, or NULL unless
+   *        the net has contiguous_params.
+   *
+   * Ranges start on 64 byte boundaries, padding is zero. The CPU values of
+   * the params are always in the blob, so it is current in CPU mode only.
+   * Params must not be reshaped.
+   */
+  inline const shared_ptr<Blob<Dtype> >& flat_params() const {
+    return flat_params_;
+  }
   /// @brief returns the learnable parameter learning rate multipliers
   inline const vector<float>& params_lr() const { return params_lr_; }
   inline const vector<bool>& has_params_lr() const { return has_params_lr_; }
@@ -228,6 +253,29 @@ class Net {
   static bool StateMeetsRule(const NetState& state, const NetStateRule& rule,
       const string& layer_name);
 
+  /// @brief Hook run with the index of a layer, e.g. once it is done.
+  class Callback {
+   protected:
+    virtual void run(int layer) = 0;
+
+    template <typename T>
+    friend class Net;
+  };
+  /**
+   * @brief Callbacks run by Backward after each layer, whether it
+   *        back-propagated or not, on the thread running the net.
+   *
+   * Once layer i is done, the diffs of the params whose first user is layer i
+   * or a later one are final for this pass, e.g. to communicate them while
+   * earlier layers back-propagate.
+   */
+  const vector<Callback*>& after_backward() const { return after_backward_; }
+  void add_after_backward(Callback* value) {
+    after_backward_.push_back(value);
+  }
+  /// @brief Removes a callback, before it is destroyed
+  void remove_after_backward(Callback* value);
+
  protected:
   // Helpers for Init.
   /// @brief Append a new top blob to the net.
@@ -242,6 +290,9 @@ class Net {
   void AppendParam(const NetParameter& param, const int layer_id,
                    const int param_id);
 
+  /// @brief Helper for ShareTrainedLayersWith and CopyTrainedLayersFrom.
+  void ShareOrCopyTrainedLayers(const Net* other, bool copy);
+
   /// @brief Helper for displaying debug info in Forward.
   void ForwardDebugInfo(const int layer_id);
   /// @brief Helper for displaying debug info in Backward.
@@ -302,12 +353,15 @@ class Net {
   /// the weight decay multipliers for learnable_params_
   vector<float> params_weight_decay_;
   vector<bool> has_params_decay_;
+  /// Data and diffs of all learnable_params_ if contiguous_params
+  shared_ptr<Blob<Dtype> > flat_params_;
   /// The bytes of memory used by this net
   size_t memory_used_;
   /// Whether to compute and display debug info for the net.
   bool debug_info_;
   /// The root net that actually holds the shared layers in data parallelism
   const Net* const root_net_;
+  vector<Callback*> after_backward_;
   DISABLE_COPY_AND_ASSIGN(Net);
 };
 
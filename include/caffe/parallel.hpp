@@ -2,6 +2,7 @@
 #define CAFFE_PARALLEL_HPP_
 
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/barrier.hpp>
 
 #include <vector>
 
@@ -9,6 +10,7 @@
 #include "caffe/common.hpp"
 #include "caffe/internal_thread.hpp"
 #include "caffe/layer.hpp"
+#include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/solver.hpp"
 #include "caffe/syncedmem.hpp"
@@ -116,6 +118,76 @@ class P2PSync : public GPUParams<Dtype>, public Solver<Dtype>::Callback,
   using Params<Dtype>::diff_;
 };
 
+// Synchronous data parallelism between solvers on threads of the host. The
+// replicas compute the values of the root solver's params in place, and
+// reduce their gradients in parallel, each summing one range of all of them
+// into the root's. The root then updates alone, so there is nothing to
+// broadcast. Gradients can be reduced in buckets, on a thread of each
+// replica, as soon as the layers computing them are done with backward.
+template<typename Dtype>
+class CPUSync : public Solver<Dtype>::Callback, public Net<Dtype>::Callback,
+    public InternalThread {
+ public:
+  CPUSync(shared_ptr<Solver<Dtype> > root_solver, CPUSync<Dtype>* root,
+          int rank);
+  virtual ~CPUSync() {
+  }
+
+  inline const shared_ptr<Solver<Dtype> >& solver() const {
+    return solver_;
+  }
+
+  // Trains with replicas solvers, including this one which must be the root,
+  // Caffe::solver_count() having been set for data layers to share inputs.
+  // Gradients are reduced during backward in buckets of at least bucket_size
+  // bytes, or after it if bucket_size is 0 or iter_size is more than 1.
+  void Run(int replicas, size_t bucket_size);
+
+ protected:
+  class Reducer;
+
+  // Range of the flat gradients final once a layer is done with backward
+  struct Bucket {
+    int layer;
+    size_t begin;
+    size_t end;
+  };
+
+  void on_start();
+  void on_gradients_ready();
+  void run(int layer);
+
+  void InternalThreadEntry();
+
+  // Splits the gradients into buckets_, returns their number
+  int MakeBuckets(size_t bucket_size);
+  // Sums the part of this replica of a range of the gradients of all
+  // replicas into the root's
+  void Reduce(size_t begin, size_t end);
+
+  CPUSync<Dtype>* root_;
+  const int rank_;
+  const int initial_iter_;
+  shared_ptr<Solver<Dtype> > solver_;
+  size_t size_;   // Size of the flat params of the nets
+  Dtype* data_;   // Flat params of the root net
+  Dtype* diff_;   // Flat gradients of this replica
+  // Params that are not learned, e.g. the statistics BatchNorm updates in
+  // forward. Replicas keep their own copy, set to the root's each iteration.
+  vector<int> state_params_;
+  shared_ptr<Reducer> reducer_;  // When reducing during backward
+  int next_bucket_;
+
+  // On the root
+  vector<shared_ptr<CPUSync<Dtype> > > workers_;
+  vector<CPUSync<Dtype>*> replicas_;
+  vector<Bucket> buckets_;
+  shared_ptr<boost::barrier> barrier_;
+  shared_ptr<boost::barrier> reducer_barrier_;
+
+DISABLE_COPY_AND_ASSIGN(CPUSync);
+};
+
 }  // namespace caffe
 
 #endif
@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "caffe/solver.hpp"
+#include "caffe/util/thread_pool.hpp"
 
 namespace caffe {
 
@@ -33,7 +34,32 @@ class SGDSolver : public Solver<Dtype> {
   virtual void Regularize(int param_id);
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
   virtual void ClipGradients();
+  // Factor by which ClipGradients scales the gradients, 1 if they are not
+  // clipped
+  Dtype GetClipScale();
+  // Weight decay of the current iteration
+  Dtype GetWeightDecay();
+  // Pruning masks of the parameters, NULL for parameters without masks
+  void GetParamMasks(vector<const vector<bool>*>* masks);
+
+  // Normalizes, regularizes and clips the gradients, clears masked history,
+  // computes the update values and updates the parameters in a single pass,
+  // split over update_threads threads.
+  void FusedApplyUpdate(Dtype rate);
+  void FusedUpdateWorker(int worker);
+  // Applies the fused update to elements [begin, end) of a parameter. Each
+  // solver computes its update value as in ComputeUpdateValue, from the
+  // gradients returned by FusedGradient.
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
+  // Scaled and regularized gradient of a parameter value
+  inline Dtype FusedGradient(int param_id, Dtype data, Dtype diff) const {
+    const Dtype decay = fused_decays_[param_id];
+    return fused_grad_scale_ * diff + (fused_l1_ ?
+        decay * ((Dtype(0) < data) - (data < Dtype(0))) : decay * data);
+  }
+
   virtual void SnapshotSolverState(const string& model_filename);
+  virtual void AppendStateBlobs(vector<Blob<Dtype>*>* blobs);
   virtual void SnapshotSolverStateToBinaryProto(const string& model_filename);
   virtual void SnapshotSolverStateToHDF5(const string& model_filename);
   virtual void RestoreSolverStateFromHDF5(const string& state_file);
@@ -45,6 +71,14 @@ class SGDSolver : public Solver<Dtype> {
   vector<shared_ptr<Blob<Dtype> > > history_, update_, temp_;
   vector<vector<Dtype> > history_reg_; /// WANGHUAN
 
+  // State of the current fused update
+  Dtype fused_grad_scale_;
+  bool fused_l1_;
+  vector<Dtype> fused_rates_, fused_decays_;
+  vector<const vector<bool>*> fused_masks_;
+  vector<int64_t> fused_offsets_;  // Of each parameter in all the values
+  shared_ptr<ThreadPool> update_pool_;
+
   DISABLE_COPY_AND_ASSIGN(SGDSolver);
 };
 
@@ -59,6 +93,7 @@ class NesterovSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
 
   DISABLE_COPY_AND_ASSIGN(NesterovSolver);
 };
@@ -74,6 +109,7 @@ class AdaGradSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
         << "Momentum cannot be used with AdaGrad.";
@@ -94,6 +130,7 @@ class RMSPropSolver : public SGDSolver<Dtype> {
 
  protected:
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
   void constructor_sanity_check() {
     CHECK_EQ(0, this->param_.momentum())
         << "Momentum cannot be used with RMSProp.";
@@ -118,6 +155,7 @@ class AdaDeltaSolver : public SGDSolver<Dtype> {
  protected:
   void AdaDeltaPreSolve();
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
 
   DISABLE_COPY_AND_ASSIGN(AdaDeltaSolver);
 };
@@ -142,6 +180,7 @@ class AdamSolver : public SGDSolver<Dtype> {
  protected:
   void AdamPreSolve();
   virtual void ComputeUpdateValue(int param_id, Dtype rate);
+  virtual void FusedUpdateValue(int param_id, int begin, int end);
 
   DISABLE_COPY_AND_ASSIGN(AdamSolver);
 };
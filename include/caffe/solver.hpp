@@ -7,6 +7,9 @@
 
 #include "caffe/net.hpp"
 #include "caffe/solver_factory.hpp"
+#include "caffe/util/snapshot_writer.hpp"
+
+namespace boost { class mutex; }
 
 namespace caffe {
 
@@ -103,9 +106,31 @@ class Solver {
   string SnapshotFilename(const string extension);
   string SnapshotToBinaryProto();
   string SnapshotToHDF5();
+  // Writes the .caffemodel and the solver state, the base of the following
+  // deltas if incremental
+  void SnapshotFull();
+  // Incremental snapshots, of the blobs changed since the base ones
+  void SnapshotDelta();
+  void SetSnapshotBase(const string& state_file);
+  void RestoreDelta(const string& state_file);
+  // Gets the learnable params of the net then the blobs of the solver state
+  void SnapshotBlobs(vector<Blob<Dtype>*>* blobs);
+  // Appends the blobs of the solver state, e.g. its history
+  virtual void AppendStateBlobs(vector<Blob<Dtype>*>* blobs) {}
+  // Writes a proto of a snapshot, in the background if async_snapshot
+  void SnapshotProto(const shared_ptr<google::protobuf::Message>& proto,
+      const string& filename);
   // The test routine
   void TestAll();
   void Test(const int test_net_id = 0);
+  // Runs a test net on its params, as of iteration iter. Requests to the
+  // solver are handled unless testing in the background.
+  void Evaluate(const int test_net_id, const int iter, bool handle_requests);
+  // Blocks until background tests are done
+  void WaitForTests();
+  // Background tests read the request to stop early, guard it
+  bool requested_early_exit() const;
+  void set_requested_early_exit(bool requested);
   virtual void SnapshotSolverState(const string& model_filename) = 0;
   virtual void RestoreSolverStateFromHDF5(const string& state_file) = 0;
   virtual void RestoreSolverStateFromBinaryProto(const string& state_file) = 0;
@@ -133,6 +158,18 @@ class Solver {
 
   // True iff a request to stop early was received.
   bool requested_early_exit_;
+  shared_ptr<boost::mutex> early_exit_mutex_;
+
+  shared_ptr<SnapshotWriter> snapshot_writer_;
+  // Values of SnapshotBlobs at the last full snapshot if incremental, a copy
+  // of all the params and history held in memory for the whole training
+  vector<shared_ptr<Blob<Dtype> > > snapshot_base_;
+  string snapshot_base_file_;
+  int snapshots_since_base_;
+
+  // Runs the test nets in the background if async_test
+  class Tester;
+  shared_ptr<Tester> tester_;
 
   DISABLE_COPY_AND_ASSIGN(Solver);
 };
@@ -20,7 +20,10 @@ inline void CaffeMallocHost(void** ptr, size_t size, bool* use_cuda) {
     return;
   }
 #endif
-  *ptr = malloc(size);
+  // Aligned to cache lines, e.g. for the flat params of a net
+  if (posix_memalign(ptr, 64, size)) {
+    *ptr = NULL;
+  }
   *use_cuda = false;
   CHECK(*ptr) << "host allocation of size " << size << " failed";
 }
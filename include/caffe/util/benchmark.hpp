@@ -3,6 +3,8 @@
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <vector>
+
 #include "caffe/util/device_alternate.hpp"
 
 namespace caffe {
@@ -47,6 +49,18 @@ class CPUTimer : public Timer {
   virtual float MicroSeconds();
 };
 
+// Summary of the times of repeated runs, in the unit of the samples
+struct TimeStats {
+  double mean;
+  double stddev;
+  double median;
+  double p90;
+  double p99;
+};
+
+// Percentiles interpolate linearly between the closest ranks
+TimeStats ComputeTimeStats(const std::vector<double>& samples);
+
 }  // namespace caffe
 
 #endif   // CAFFE_UTIL_BENCHMARK_H_
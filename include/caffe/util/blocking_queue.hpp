@@ -6,6 +6,18 @@
 
 namespace caffe {
 
+// Counters accumulated by BlockingQueue::pop, to tell whether the consumer
+// of a queue starves (waits often) or its producer is ahead (high occupancy).
+class BlockingQueueStats {
+ public:
+  BlockingQueueStats() : pops_(0), waits_(0), wait_ms_(0), occupancy_(0) {}
+
+  size_t pops_;       // Number of pop calls
+  size_t waits_;      // Pops that found the queue empty and had to block
+  double wait_ms_;    // Total time spent blocked in pop
+  size_t occupancy_;  // Sum of the queue sizes seen by pops before blocking
+};
+
 template<typename T>
 class BlockingQueue {
  public:
@@ -26,6 +38,9 @@ class BlockingQueue {
 
   size_t size() const;
 
+  // Snapshot of the pop counters since construction
+  BlockingQueueStats stats() const;
+
  protected:
   /**
    Move synchronization fields out instead of including boost/thread.hpp
@@ -36,6 +51,7 @@ class BlockingQueue {
 
   std::queue<T> queue_;
   shared_ptr<sync> sync_;
+  BlockingQueueStats stats_;
 
 DISABLE_COPY_AND_ASSIGN(BlockingQueue);
 };
@@ -15,10 +15,35 @@ class Cursor {
   Cursor() { }
   virtual ~Cursor() { }
   virtual void SeekToFirst() = 0;
+  // Moves to the first key not less than the given one
+  virtual void Seek(const string& key) = 0;
   virtual void Next() = 0;
   virtual string key() = 0;
   virtual string value() = 0;
   virtual bool valid() = 0;
+  // Zero-copy access to the current value. Backends that can keep the bytes
+  // mapped until the cursor is destroyed, even across Next() and
+  // SeekToFirst(), return a pointer to them; others return NULL and values
+  // must be copied through value().
+  virtual const char* pinned_value(size_t* size) { return NULL; }
+  // Direct access to records stored raw rather than as serialized Datums.
+  // Sets all fields of datum but data, and points *data at the uint8
+  // payload, in place until the cursor is destroyed. Returns false if values
+  // are serialized Datums.
+  virtual bool record(Datum* datum, const char** data, size_t* size) {
+    return false;
+  }
+  // Random access, for backends with numbered records: size() is the number
+  // of records, or 0 if they can only be read in sequence, index() that of
+  // the current record, and SeekToIndex() moves to a record in constant time.
+  virtual size_t size() { return 0; }
+  virtual size_t index() {
+    LOG(FATAL) << "Cursor has no random access";
+    return 0;
+  }
+  virtual void SeekToIndex(size_t index) {
+    LOG(FATAL) << "Cursor has no random access";
+  }
 
   DISABLE_COPY_AND_ASSIGN(Cursor);
 };
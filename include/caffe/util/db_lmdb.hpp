@@ -26,6 +26,11 @@ class LMDBCursor : public Cursor {
     mdb_txn_abort(mdb_txn_);
   }
   virtual void SeekToFirst() { Seek(MDB_FIRST); }
+  virtual void Seek(const string& key) {
+    mdb_key_.mv_size = key.size();
+    mdb_key_.mv_data = const_cast<char*>(key.data());
+    Seek(MDB_SET_RANGE);
+  }
   virtual void Next() { Seek(MDB_NEXT); }
   virtual string key() {
     return string(static_cast<const char*>(mdb_key_.mv_data), mdb_key_.mv_size);
@@ -35,6 +40,11 @@ class LMDBCursor : public Cursor {
         mdb_value_.mv_size);
   }
   virtual bool valid() { return valid_; }
+  // Pages of a read-only transaction stay mapped until it ends
+  virtual const char* pinned_value(size_t* size) {
+    *size = mdb_value_.mv_size;
+    return static_cast<const char*>(mdb_value_.mv_data);
+  }
 
  private:
   void Seek(MDB_cursor_op op) {
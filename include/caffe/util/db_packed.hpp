@@ -0,0 +1,97 @@
+#ifndef CAFFE_UTIL_DB_PACKED_HPP
+#define CAFFE_UTIL_DB_PACKED_HPP
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "caffe/util/db.hpp"
+
+namespace caffe { namespace db {
+
+// A packed database is a single file: this header, then count records of
+// stride bytes, each an int32 label followed by channels * height * width
+// uint8 or float values. There are no keys, records are numbered.
+struct PackedHeader {
+  enum Type { UINT8 = 0, FLOAT = 1 };
+
+  char magic[8];
+  uint32_t version;
+  uint32_t type;
+  uint32_t channels;
+  uint32_t height;
+  uint32_t width;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t stride;
+  char padding[16];
+};
+
+class PackedCursor : public Cursor {
+ public:
+  PackedCursor(const PackedHeader& header, const char* records)
+    : header_(header), records_(records), index_(0) { }
+  virtual void SeekToFirst() { index_ = 0; }
+  virtual void Seek(const string& key);
+  virtual void Next() { ++index_; }
+  // Keys are the zero-padded record numbers, so they sort like records
+  virtual string key();
+  virtual string value();
+  virtual bool valid() { return index_ < header_.count; }
+  virtual bool record(Datum* datum, const char** data, size_t* size);
+  virtual size_t size() { return header_.count; }
+  virtual size_t index() { return index_; }
+  virtual void SeekToIndex(size_t index) { index_ = index; }
+
+ private:
+  const PackedHeader header_;
+  const char* records_;
+  size_t index_;
+};
+
+class PackedDB;
+
+class PackedTransaction : public Transaction {
+ public:
+  explicit PackedTransaction(PackedDB* db) : db_(db) { }
+  // Keys are ignored, records are numbered in the order they are put
+  virtual void Put(const string& key, const string& value);
+  virtual void Commit();
+
+ private:
+  PackedDB* db_;
+  vector<char> records_;
+
+  DISABLE_COPY_AND_ASSIGN(PackedTransaction);
+};
+
+class PackedDB : public DB {
+ public:
+  PackedDB() : file_(NULL), map_(NULL), map_size_(0) { }
+  virtual ~PackedDB() { Close(); }
+  virtual void Open(const string& source, Mode mode);
+  virtual void Close();
+  virtual PackedCursor* NewCursor();
+  virtual PackedTransaction* NewTransaction();
+
+ private:
+  // Appends datum to records as a raw record, the first record written to
+  // the database setting the shape and type of all others.
+  void Pack(const Datum& datum, vector<char>* records);
+  void Append(const vector<char>& records);
+  void WriteHeader();
+
+  string source_;
+  PackedHeader header_;
+  FILE* file_;       // When writing
+  char* map_;        // When reading
+  size_t map_size_;
+
+  friend class PackedTransaction;
+};
+
+}  // namespace db
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_PACKED_HPP
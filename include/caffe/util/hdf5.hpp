@@ -1,7 +1,10 @@
 #ifndef CAFFE_UTIL_HDF5_H_
 #define CAFFE_UTIL_HDF5_H_
 
+#include <boost/thread/recursive_mutex.hpp>
+
 #include <string>
+#include <vector>
 
 #include "hdf5.h"
 #include "hdf5_hl.h"
@@ -10,6 +13,15 @@
 
 namespace caffe {
 
+// libhdf5 is not necessarily built thread-safe: every call into it holds
+// this lock, so that HDF5 data prefetched in the background does not race
+// with snapshots, HDF5 outputs or weights loaded on other threads. It is
+// recursive so that a caller can hold it across the helpers below.
+boost::recursive_mutex& hdf5_mutex();
+
+vector<int> hdf5_get_nd_dataset_shape(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim);
+
 template <typename Dtype>
 void hdf5_load_nd_dataset_helper(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
@@ -20,6 +32,12 @@ void hdf5_load_nd_dataset(
     hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
     Blob<Dtype>* blob);
 
+// Loads rows [begin, begin + count) of the first axis of a dataset.
+template <typename Dtype>
+void hdf5_load_nd_dataset_rows(
+    hid_t file_id, const char* dataset_name_, int min_dim, int max_dim,
+    hsize_t begin, hsize_t count, Blob<Dtype>* blob);
+
 template <typename Dtype>
 void hdf5_save_nd_dataset(
     const hid_t file_id, const string& dataset_name, const Blob<Dtype>& blob,
@@ -0,0 +1,69 @@
+#ifndef CAFFE_UTIL_IMAGE_CACHE_HPP_
+#define CAFFE_UTIL_IMAGE_CACHE_HPP_
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief A memory-bounded, least recently used cache of decoded images,
+ * keyed by path, so that image files are read and decoded once instead of
+ * once per epoch.
+ *
+ * Entries are spread over independently locked shards, so the prefetch
+ * threads of several layers can share a cache without contending on a
+ * single lock. The memory budget is shared by all shards, images larger
+ * than the whole budget are not cached. To fit more of a dataset in memory, images can be stored
+ * re-encoded (e.g. as lossless PNG), or downscaled. Downscaled images are
+ * restored to their original size when read, so coordinates into them,
+ * e.g. windows, stay valid.
+ *
+ * Cached images are shared with the callers and must not be modified.
+ */
+class ImageCache {
+ public:
+  explicit ImageCache(const ImageCacheParameter& param);
+  ~ImageCache();
+
+  // Returns the cache registered under key, creating it if no other caller
+  // holds it anymore.
+  static shared_ptr<ImageCache> Shared(const string& key,
+      const ImageCacheParameter& param);
+
+  // Sets image and returns true if path is cached
+  bool Get(const string& path, cv::Mat* image);
+  // Caches image, evicting least recently used images, of its shard first,
+  // to stay within the memory budget.
+  void Put(const string& path, const cv::Mat& image);
+
+  size_t hits() const;
+  size_t misses() const;
+  // Bytes used by cached images
+  size_t bytes() const;
+
+ protected:
+  class Shard;
+  int shard_index(const string& path) const;
+
+  const ImageCacheParameter param_;
+  const size_t capacity_;
+  size_t bytes_;  // Updated atomically, across shards
+  vector<shared_ptr<Shard> > shards_;
+
+  static map<const string, boost::weak_ptr<ImageCache> > caches_;
+
+DISABLE_COPY_AND_ASSIGN(ImageCache);
+};
+
+}  // namespace caffe
+
+#endif  // USE_OPENCV
+#endif  // CAFFE_UTIL_IMAGE_CACHE_HPP_
@@ -100,6 +100,12 @@ bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color,
     const std::string & encoding, Datum* datum);
 
+// Same as ReadImageToDatum, for the content of an image file already read,
+// e.g. by another thread. filename is only used to match the encoding.
+bool DecodeImageToDatum(const string& filename, const string& file_content,
+    const int label, const int height, const int width, const bool is_color,
+    const std::string & encoding, Datum* datum);
+
 inline bool ReadImageToDatum(const string& filename, const int label,
     const int height, const int width, const bool is_color, Datum* datum) {
   return ReadImageToDatum(filename, label, height, width, is_color,
@@ -129,6 +135,14 @@ inline bool ReadImageToDatum(const string& filename, const int label,
 bool DecodeDatumNative(Datum* datum);
 bool DecodeDatum(Datum* datum, bool is_color);
 
+/**
+ * @brief Parses a serialized Datum without copying its payload. All fields
+ * but data are set on datum; *data and *data_size point at the data bytes
+ * inside buffer (NULL and 0 if the record has none).
+ */
+bool ParseDatumHeader(const char* buffer, size_t size, Datum* datum,
+    const char** data, size_t* data_size);
+
 #ifdef USE_OPENCV
 cv::Mat ReadImageToCVMat(const string& filename,
     const int height, const int width, const bool is_color);
@@ -143,6 +157,10 @@ cv::Mat ReadImageToCVMat(const string& filename);
 
 cv::Mat DecodeDatumToCVMatNative(const Datum& datum);
 cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color);
+// Decode encoded datum bytes held outside of a Datum, see ParseDatumHeader
+cv::Mat DecodeDatumToCVMatNative(const char* data, size_t data_size);
+cv::Mat DecodeDatumToCVMat(const char* data, size_t data_size,
+    bool is_color);
 
 void CVMatToDatum(const cv::Mat& cv_img, Datum* datum);
 #endif  // USE_OPENCV
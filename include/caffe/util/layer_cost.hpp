@@ -0,0 +1,74 @@
+#ifndef CAFFE_UTIL_LAYER_COST_HPP_
+#define CAFFE_UTIL_LAYER_COST_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/perf_counters.hpp"
+
+namespace caffe {
+
+/**
+ * @brief The work of a pass of a layer, computed from its type and shapes
+ * rather than measured, to relate measured times to what the hardware can do.
+ *
+ * A multiply-add counts as 2 flops. Bytes are those of the blobs the pass
+ * reads and writes once each, i.e. the memory traffic without cache reuse.
+ * Layers that only share or reshape blobs cost nothing. Layers without a
+ * specific model count one flop per output value.
+ */
+struct LayerCost {
+  double flops;
+  double bytes;
+};
+
+template <typename Dtype>
+LayerCost ForwardCost(Layer<Dtype>* layer, const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top);
+
+/** Weight gradients double the flops of layers with weights. */
+template <typename Dtype>
+LayerCost BackwardCost(Layer<Dtype>* layer, const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top);
+
+/**
+ * @brief The attainable compute and memory throughput of a thread, the roofs
+ * of the roofline model that passes are classified under.
+ */
+struct Roofline {
+  double gflops;
+  double gbps;
+};
+
+/**
+ * Measures the roofs that are not positive, the compute one with a float
+ * gemm and the memory one with a copy well past the last level cache.
+ */
+Roofline MeasureRoofline(double gflops, double gbps);
+
+/** Derived from the counters of a pass, and where it sits under the roofs. */
+struct PassCounters {
+  double ipc;
+  double gflops;
+  double dram_gbps;  // Last level cache misses times the line size
+  double intensity;  // Flops per DRAM byte
+  /**
+   * "compute-bound" or "memory-bound" by the side of the ridge point its
+   * intensity is on, "latency-bound" when far below both roofs, i.e. stalls,
+   * overheads or a short pass bound it, "unmeasured" without a time.
+   */
+  const char* bound;
+};
+
+/**
+ * Analyzes a pass of the given cost and mean time, from its mean counts per
+ * pass indexed by PerfCounters::Event.
+ */
+PassCounters AnalyzeCounters(const LayerCost& cost, double mean_ms,
+    const double* counts, const Roofline& roof);
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_LAYER_COST_HPP_
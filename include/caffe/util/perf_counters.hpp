@@ -0,0 +1,50 @@
+#ifndef CAFFE_UTIL_PERF_COUNTERS_HPP_
+#define CAFFE_UTIL_PERF_COUNTERS_HPP_
+
+#include <stdint.h>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Hardware counters of the calling thread between Start and Stop,
+ * from Linux perf_event_open, to tell compute from memory-bound code.
+ *
+ * Threads the code starts, e.g. of a multi-threaded BLAS, are not counted.
+ * Counters the kernel, the CPU or the perf_event_paranoid setting do not
+ * allow read 0, and available() is false when none can be opened, e.g. on
+ * other systems.
+ */
+class PerfCounters {
+ public:
+  enum Event {
+    CYCLES,
+    INSTRUCTIONS,
+    LLC_REFERENCES,  // Last level cache
+    LLC_MISSES,
+    NUM_EVENTS
+  };
+
+  PerfCounters();
+  ~PerfCounters();
+
+  inline bool available() const { return fds_[CYCLES] >= 0; }
+  /** Resets the counters and starts counting. */
+  void Start();
+  /** Stops counting and reads the counts, scaled if multiplexed. */
+  void Stop();
+  inline double count(Event event) const { return counts_[event]; }
+
+  static const char* name(Event event);
+
+ protected:
+  int fds_[NUM_EVENTS];
+  double counts_[NUM_EVENTS];
+
+  DISABLE_COPY_AND_ASSIGN(PerfCounters);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PERF_COUNTERS_HPP_
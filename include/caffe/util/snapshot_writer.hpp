@@ -0,0 +1,50 @@
+#ifndef CAFFE_UTIL_SNAPSHOT_WRITER_HPP_
+#define CAFFE_UTIL_SNAPSHOT_WRITER_HPP_
+
+#include <google/protobuf/message.h>
+
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Writes protos to binary files on a background thread, in the order
+ * they are given, so that a solver can go on training once it has copied its
+ * state into them.
+ *
+ * A file is written under a temporary name, synced and renamed, so it only
+ * appears once complete.
+ */
+class SnapshotWriter : public InternalThread {
+ public:
+  /** At most pending protos wait to be written, Write blocking after that. */
+  explicit SnapshotWriter(int pending);
+  virtual ~SnapshotWriter();
+
+  void Write(const shared_ptr<google::protobuf::Message>& proto,
+      const string& filename);
+  /** Blocks until all the protos given are written. */
+  void Wait();
+
+ protected:
+  virtual void InternalThreadEntry();
+
+  struct File {
+    shared_ptr<google::protobuf::Message> proto;
+    string filename;
+  };
+  vector<File> files_;
+  BlockingQueue<int> free_;
+  BlockingQueue<int> full_;
+
+  DISABLE_COPY_AND_ASSIGN(SnapshotWriter);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SNAPSHOT_WRITER_HPP_
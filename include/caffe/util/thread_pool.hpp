@@ -0,0 +1,60 @@
+#ifndef CAFFE_UTIL_THREAD_POOL_HPP_
+#define CAFFE_UTIL_THREAD_POOL_HPP_
+
+#include <boost/function.hpp>
+
+#include <vector>
+
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/util/blocking_queue.hpp"
+
+namespace caffe {
+
+/**
+ * @brief A fixed set of persistent worker threads that run the same task in
+ * parallel. Each worker receives its own index in [0, size()), so callers can
+ * partition work statically and keep results independent of scheduling.
+ *
+ * Workers are InternalThreads, so they inherit the Caffe mode, device and
+ * solver state of the thread that created the pool.
+ */
+class ThreadPool {
+ public:
+  typedef boost::function<void(int)> Task;
+
+  explicit ThreadPool(int size);
+  ~ThreadPool();
+
+  /** Runs task(i) on worker i for every worker, and blocks until all return. */
+  void Run(const Task& task);
+
+  inline int size() const { return workers_.size(); }
+
+ protected:
+  class Worker : public InternalThread {
+   public:
+    Worker(ThreadPool* pool, int index);
+    virtual ~Worker();
+
+    BlockingQueue<int> start_;
+
+   protected:
+    void InternalThreadEntry();
+
+    ThreadPool* pool_;
+    const int index_;
+
+  DISABLE_COPY_AND_ASSIGN(Worker);
+  };
+
+  vector<shared_ptr<Worker> > workers_;
+  BlockingQueue<int> done_;
+  const Task* task_;
+
+DISABLE_COPY_AND_ASSIGN(ThreadPool);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_THREAD_POOL_HPP_
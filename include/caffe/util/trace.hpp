@@ -0,0 +1,79 @@
+#ifndef CAFFE_UTIL_TRACE_HPP_
+#define CAFFE_UTIL_TRACE_HPP_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Records spans of time of all threads, e.g. layers, prefetching,
+ * gradient reductions and snapshots, and writes them as Chrome trace events
+ * for chrome://tracing or Perfetto to show how they overlap.
+ *
+ * Each thread records into its own ring buffer, which keeps its last events,
+ * without a lock: events are published by an atomic count, which Stop reads.
+ * Only the first event of a thread and Stop take a lock. When not started, a
+ * TraceScope only tests a flag.
+ */
+class Trace {
+ public:
+  /** Starts recording, keeping the last events_per_thread of each thread. */
+  static void Start(const string& filename, int events_per_thread = 1 << 16);
+  /**
+   * Stops recording and writes the events to the file given to Start. Spans
+   * that other threads are still recording are dropped.
+   */
+  static void Stop();
+
+  static inline bool enabled() {
+    return __atomic_load_n(&enabled_, __ATOMIC_ACQUIRE);
+  }
+  /** Microseconds since Start. */
+  static int64_t Now();
+  /** Bytes of a name, with its terminating null. */
+  static const int kNameSize = 64;
+  /** Longer names are cut, categories must be literals. */
+  static void Record(const char* name, const char* category, int64_t begin,
+      int64_t end);
+
+ private:
+  static bool enabled_;
+};
+
+/** Records the span of time from its construction to its destruction. */
+class TraceScope {
+ public:
+  TraceScope(const char* name, const char* category) : category_(NULL) {
+    if (Trace::enabled()) {
+      Begin(name, category);
+    }
+  }
+  TraceScope(const string& name, const char* category) : category_(NULL) {
+    if (Trace::enabled()) {
+      Begin(name.c_str(), category);
+    }
+  }
+  ~TraceScope() {
+    if (category_) {
+      Trace::Record(name_, category_, begin_, Trace::Now());
+    }
+  }
+
+ private:
+  // Copies the name, which may not outlive the constructor
+  void Begin(const char* name, const char* category);
+
+  char name_[Trace::kNameSize];
+  const char* category_;
+  int64_t begin_;
+
+  DISABLE_COPY_AND_ASSIGN(TraceScope);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_TRACE_HPP_
@@ -0,0 +1,240 @@
+#!/usr/bin/env python
+"""
+Performance-regression gate: times reference nets with `caffe time` and the
+kernels with `microbenchmark` on the CPU, then compares their medians with a
+checked-in baseline and fails if any got slower than its tolerance allows.
+
+    python scripts/perf_regression.py                 # check
+    python scripts/perf_regression.py --update        # record a new baseline
+
+Baselines only compare within one machine: record one per reference box.
+None is checked in, and without one the check fails unless
+--allow_missing_baseline is given.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Name, deploy model and timed iterations. Deploy models need no data, they
+# are timed in the TRAIN phase with force_backward, since without a loss
+# backward would only compute the gradients of the params.
+NETS = [
+    ('alexnet', 'models/bvlc_alexnet/deploy.prototxt', 5),
+    ('googlenet', 'models/bvlc_googlenet/deploy.prototxt', 3),
+    ('cifar10_quick', 'examples/cifar10/cifar10_quick.prototxt', 50),
+    ('cifar10_full', 'examples/cifar10/cifar10_full.prototxt', 50),
+    ('lenet', 'examples/mnist/lenet.prototxt', 20),
+]
+
+
+def run(command, args):
+    """Runs a command, printing its output only if it fails."""
+    if args.verbose:
+        print(' '.join(command))
+    process = subprocess.Popen(command, stdout=subprocess.PIPE,
+                               stderr=subprocess.STDOUT)
+    output = process.communicate()[0]
+    if process.returncode != 0:
+        sys.stdout.write(output.decode('utf-8', 'replace'))
+        sys.exit('%s failed with status %d' % (command[0], process.returncode))
+
+
+def read_json(command, args):
+    """Runs a command that writes JSON to the file named by --json."""
+    handle, filename = tempfile.mkstemp(suffix='.json')
+    os.close(handle)
+    try:
+        run(command + ['--json=' + filename], args)
+        with open(filename) as f:
+            return json.load(f)
+    finally:
+        os.remove(filename)
+
+
+def force_backward(model):
+    """Returns a temporary copy of a model that back-propagates to all."""
+    handle, filename = tempfile.mkstemp(suffix='.prototxt')
+    with os.fdopen(handle, 'w') as out:
+        with open(os.path.join(ROOT, model)) as f:
+            out.write(f.read())
+        out.write('\nforce_backward: true\n')
+    return filename
+
+
+def metric(net, pass_name):
+    return 'net/%s/%s' % (net, pass_name)
+
+
+def time_nets(args):
+    medians = {}
+    passes = ('forward', 'forward_backward')
+    for name, model, iterations in NETS:
+        if not [p for p in passes if args.filter in metric(name, p)]:
+            continue
+        print('Timing', name)
+        filename = force_backward(model)
+        try:
+            report = read_json([args.caffe, 'time', '--phase=TRAIN',
+                                '--model=' + filename,
+                                '--iterations=%d' % iterations,
+                                '--warmup=%d' % args.warmup], args)
+        finally:
+            os.remove(filename)
+        for p in passes:
+            medians[metric(name, p)] = report['net'][p]['median_ms']
+    return medians
+
+
+def kernel_filter(name_filter):
+    """Returns the filter of microbenchmark matching the same kernels."""
+    prefix = 'kernel/'
+    if name_filter.startswith(prefix):
+        return name_filter[len(prefix):]
+    # A filter within the prefix, or that may span it, is applied to the
+    # names afterwards
+    if name_filter in prefix:
+        return ''
+    for i in range(1, len(name_filter) + 1):
+        if prefix.endswith(name_filter[:i]):
+            return ''
+    return name_filter
+
+
+def time_kernels(args):
+    print('Timing kernels')
+    command = [args.microbenchmark, '--iterations=%d' % args.iterations,
+               '--warmup=%d' % args.warmup,
+               '--filter=' + kernel_filter(args.filter)]
+    report = read_json(command, args)
+    medians = {}
+    for result in report['benchmarks']:
+        name = 'kernel/' + result['name']
+        if args.filter in name:
+            medians[name] = result['median_ms']
+    return medians
+
+
+def compare(baseline, medians, args):
+    """Returns the rows of the report and whether any metric regressed."""
+    default_tolerance = baseline.get('tolerance', args.tolerance)
+    rows = []
+    failed = False
+    metrics = baseline.get('metrics', {})
+    skipped = (('net/',) if args.skip_nets else ()) + \
+        (('kernel/',) if args.skip_kernels else ())
+    for name in sorted(set(metrics) | set(medians)):
+        if args.filter not in name or name.startswith(skipped):
+            continue
+        if name not in metrics:
+            rows.append((name, None, medians[name], None, 'NEW'))
+            continue
+        base = metrics[name]['median_ms']
+        tolerance = metrics[name].get('tolerance', default_tolerance)
+        if name not in medians:
+            rows.append((name, base, None, None, 'MISSING'))
+            failed = True
+            continue
+        change = medians[name] / base - 1
+        if change > tolerance:
+            status = 'SLOWER'
+            failed = True
+        elif change < -tolerance:
+            status = 'FASTER'
+        else:
+            status = 'OK'
+        rows.append((name, base, medians[name], change, status))
+    return rows, failed
+
+
+def print_report(rows):
+    def ms(value):
+        return '-' if value is None else '%.3f' % value
+    width = max([len(row[0]) for row in rows] + [6])
+    print('%-*s %12s %12s %9s  %s' % (width, 'metric', 'baseline ms',
+                                      'current ms', 'change', 'status'))
+    for name, base, current, change, status in rows:
+        print('%-*s %12s %12s %9s  %s' % (
+            width, name, ms(base), ms(current),
+            '-' if change is None else '%+.1f%%' % (change * 100), status))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument('--caffe', default=os.path.join(ROOT, 'build', 'tools',
+                                                        'caffe'))
+    parser.add_argument('--microbenchmark',
+                        default=os.path.join(ROOT, 'build', 'tools',
+                                             'microbenchmark'))
+    parser.add_argument('--baseline', default=os.path.join(
+        ROOT, 'scripts', 'perf_baseline.json'))
+    parser.add_argument('--tolerance', type=float, default=0.15,
+                        help='slowdown allowed, unless the baseline sets one')
+    parser.add_argument('--iterations', type=int, default=20,
+                        help='timed runs of each kernel benchmark')
+    parser.add_argument('--warmup', type=int, default=2)
+    parser.add_argument('--filter', default='',
+                        help='only time the metrics whose name contains this')
+    parser.add_argument('--skip_nets', action='store_true')
+    parser.add_argument('--skip_kernels', action='store_true')
+    parser.add_argument('--update', action='store_true',
+                        help='write the medians as the new baseline')
+    parser.add_argument('--allow_missing_baseline', action='store_true',
+                        help='pass without a baseline instead of failing')
+    parser.add_argument('--report', help='also write the comparison as JSON')
+    parser.add_argument('--verbose', action='store_true')
+    args = parser.parse_args()
+
+    # Single-threaded BLAS keeps the times comparable across loads
+    os.environ.setdefault('OMP_NUM_THREADS', '1')
+    os.environ.setdefault('GLOG_minloglevel', '1')
+    if not args.update and not os.path.exists(args.baseline):
+        print('No baseline %s. Record one on this machine with --update.'
+              % args.baseline)
+        if args.allow_missing_baseline:
+            print('SKIPPED')
+            return 0
+        print('FAIL')
+        return 1
+    medians = {}
+    if not args.skip_nets:
+        medians.update(time_nets(args))
+    if not args.skip_kernels:
+        medians.update(time_kernels(args))
+
+    if args.update:
+        baseline = {'tolerance': args.tolerance, 'metrics': {}}
+        if os.path.exists(args.baseline):
+            with open(args.baseline) as f:
+                baseline = json.load(f)
+        for name, median in medians.items():
+            baseline['metrics'].setdefault(name, {})['median_ms'] = median
+        with open(args.baseline, 'w') as f:
+            json.dump(baseline, f, indent=1, sort_keys=True)
+            f.write('\n')
+        print('Wrote %d medians to %s' % (len(medians), args.baseline))
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    rows, failed = compare(baseline, medians, args)
+    print_report(rows)
+    if args.report:
+        with open(args.report, 'w') as f:
+            json.dump([dict(zip(('metric', 'baseline_ms', 'current_ms',
+                                 'change', 'status'), row)) for row in rows],
+                      f, indent=1)
+            f.write('\n')
+    print('FAIL' if failed else 'PASS')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
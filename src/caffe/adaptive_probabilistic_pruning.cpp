@@ -76,4 +76,29 @@ namespace caffe {
     float APP::Delta_loss_history = 0;
     float APP::learning_speed = 0;
 
+    void APP::Reset() {
+        prune_method = "None";
+        inner_iter = 0;
+        step_ = -1;
+        layer_index.clear();
+        layer_cnt = -1;
+        num_pruned_col.clear();
+        num_pruned_row.clear();
+        IF_row_pruned.clear();
+        IF_col_pruned.clear();
+        history_prob.clear();
+        iter_prune_finished.clear();
+        prune_ratio.clear();
+        delta.clear();
+        pruned_ratio.clear();
+        IF_never_updated.clear();
+        filter_area.clear();
+        group.clear();
+        priority.clear();
+        num_log = 0;
+        log_weight.clear();
+        log_diff.clear();
+        log_index.clear();
+    }
+
 }
@@ -1,4 +1,5 @@
 #include <boost/thread.hpp>
+#include <cstring>
 #include <map>
 #include <string>
 #include <vector>
@@ -7,6 +8,8 @@
 #include "caffe/data_reader.hpp"
 #include "caffe/layers/data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
@@ -39,22 +42,226 @@ DataReader::~DataReader() {
   }
 }
 
+void DataReader::Grow(int count) {
+  for (int i = 0; i < count; ++i) {
+    queue_pair_->free_.push(new Item());
+  }
+}
+
+int DataReader::Shrink(int count) {
+  Item* item;
+  int released = 0;
+  while (released < count && queue_pair_->free_.try_pop(&item)) {
+    delete item;
+    ++released;
+  }
+  return released;
+}
+
+void DataReader::fill(Item* item, const char* data, size_t size,
+    bool pinned) {
+  if (pinned) {
+    // Deserialize in-place, the payload stays in the pinned pages
+    CHECK(ParseDatumHeader(data, size, &item->datum_, &item->data_,
+        &item->data_size_)) << "Could not parse datum";
+  } else {
+    CHECK(item->datum_.ParseFromArray(data, size)) << "Could not parse datum";
+    item->data_ = item->datum_.data().data();
+    item->data_size_ = item->datum_.data().size();
+  }
+}
+
 //
 
 DataReader::QueuePair::QueuePair(int size) {
-  // Initialize the free queue with requested number of datums
+  // Initialize the free queue with requested number of items
   for (int i = 0; i < size; ++i) {
-    free_.push(new Datum());
+    free_.push(new Item());
   }
 }
 
 DataReader::QueuePair::~QueuePair() {
-  Datum* datum;
-  while (free_.try_pop(&datum)) {
-    delete datum;
+  Item* item;
+  while (free_.try_pop(&item)) {
+    delete item;
+  }
+  while (full_.try_pop(&item)) {
+    delete item;
   }
-  while (full_.try_pop(&datum)) {
-    delete datum;
+}
+
+//
+
+DataReader::ShuffleBuffer::ShuffleBuffer(int capacity)
+    : stride_(0),
+      pinned_(capacity, NULL),
+      sizes_(capacity, 0),
+      size_(0) {
+  CHECK_GT(capacity, 0);
+}
+
+void DataReader::ShuffleBuffer::Put(int slot, const char* data, size_t size,
+    bool pinned) {
+  CHECK_LE(slot, size_);
+  CHECK_LT(slot, capacity());
+  CHECK_GT(size, 0) << "Empty record";
+  if (pinned) {
+    pinned_[slot] = data;
+  } else {
+    if (size > stride_) {
+      // Re-layout the arena once for the larger stride. Records of a
+      // database usually have the same size, so this happens early if ever.
+      vector<char> arena(size * capacity());
+      for (int i = 0; i < size_; ++i) {
+        if (!pinned_[i]) {
+          memcpy(&arena[i * size], &arena_[i * stride_], sizes_[i]);
+        }
+      }
+      arena_.swap(arena);
+      stride_ = size;
+    }
+    memcpy(&arena_[slot * stride_], data, size);
+    pinned_[slot] = NULL;
+  }
+  sizes_[slot] = size;
+  if (slot == size_) {
+    ++size_;
+  }
+}
+
+const char* DataReader::ShuffleBuffer::Get(int slot, size_t* size,
+    bool* pinned) const {
+  CHECK_LT(slot, size_);
+  *size = sizes_[slot];
+  *pinned = pinned_[slot] != NULL;
+  return *pinned ? pinned_[slot] : &arena_[slot * stride_];
+}
+
+//
+
+DataReader::Source::Source(const LayerParameter& param,
+    const shared_ptr<db::DB>& db, const string& path, const string& begin,
+    size_t size)
+    : db_(db),
+      begin_(begin),
+      size_(size),
+      position_(0),
+      first_(0) {
+  cursor_.reset(db_->NewCursor());
+  if (!begin_.empty()) {
+    cursor_->Seek(begin_);
+  }
+  const DataParameter& data_param = param.data_param();
+  if (data_param.shuffle()) {
+    CHECK_GT(cursor_->size(), 0) << "Backend of " << path
+        << " cannot be read in random order, use shuffle_buffer instead";
+    CHECK_LE(data_param.shuffle_buffer(), 1)
+        << "shuffle and shuffle_buffer are exclusive";
+    first_ = cursor_->index();
+    order_.resize(size_ ? size_ : cursor_->size());
+    for (size_t i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+    shuffle(order_.begin(), order_.end());
+  } else if (data_param.shuffle_buffer() > 1) {
+    shuffle_.reset(new ShuffleBuffer(data_param.shuffle_buffer()));
+  }
+}
+
+void DataReader::Source::read_one(QueuePair* qp) {
+  if (shuffle_) {
+    // Records are sampled at random, so the first ones can only be handed
+    // out once the whole buffer has been read.
+    while (shuffle_->size() < shuffle_->capacity()) {
+      buffer_one(shuffle_->size());
+    }
+  }
+  Item* item = qp->free_.pop();
+  size_t size;
+  if (shuffle_) {
+    // Hand out a random record and replace it with the next one. The slot is
+    // overwritten, so the record is copied to the item unless it is pinned.
+    int slot = caffe_rng_rand() % shuffle_->size();
+    bool pinned;
+    const char* value = shuffle_->Get(slot, &size, &pinned);
+    fill(item, value, size, pinned);
+    buffer_one(slot);
+  } else if (!order_.empty()) {
+    cursor_->SeekToIndex(first_ + order_[position_]);
+    fill_current(item);
+    if (++position_ == order_.size()) {
+      DLOG(INFO) << "Restarting data prefetching in a new random order.";
+      shuffle(order_.begin(), order_.end());
+      position_ = 0;
+    }
+  } else {
+    fill_current(item);
+    next();
+  }
+  qp->full_.push(item);
+}
+
+void DataReader::Source::fill_current(Item* item) {
+  // Raw records are read directly into the item
+  if (cursor_->record(&item->datum_, &item->data_, &item->data_size_)) {
+    return;
+  }
+  size_t size;
+  const char* value = cursor_->pinned_value(&size);
+  if (value) {
+    fill(item, value, size, true);
+  } else {
+    const string& record = cursor_->value();
+    fill(item, record.data(), record.size(), false);
+  }
+}
+
+void DataReader::Source::buffer_one(int slot) {
+  size_t size;
+  const char* value = cursor_->pinned_value(&size);
+  if (value) {
+    shuffle_->Put(slot, value, size, true);
+  } else {
+    const string& record = cursor_->value();
+    shuffle_->Put(slot, record.data(), record.size(), false);
+  }
+  next();
+}
+
+void DataReader::Source::next() {
+  // go to the next iter
+  cursor_->Next();
+  if (!cursor_->valid() || ++position_ == size_) {
+    DLOG(INFO) << "Restarting data prefetching from start.";
+    if (begin_.empty()) {
+      cursor_->SeekToFirst();
+    } else {
+      cursor_->Seek(begin_);
+    }
+    position_ = 0;
+  }
+}
+
+//
+
+DataReader::Shard::Shard(const shared_ptr<Source>& source,
+    const shared_ptr<QueuePair>& qp)
+    : source_(source),
+      qp_(qp) {
+  StartInternalThread();
+}
+
+DataReader::Shard::~Shard() {
+  StopInternalThread();
+}
+
+void DataReader::Shard::InternalThreadEntry() {
+  try {
+    while (!must_stop()) {
+      source_->read_one(qp_.get());
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
   }
 }
 
@@ -62,7 +269,8 @@ DataReader::QueuePair::~QueuePair() {
 
 DataReader::Body::Body(const LayerParameter& param)
     : param_(param),
-      new_queue_pairs_() {
+      new_queue_pairs_(),
+      next_shard_(0) {
   StartInternalThread();
 }
 
@@ -71,9 +279,28 @@ DataReader::Body::~Body() {
 }
 
 void DataReader::Body::InternalThreadEntry() {
-  shared_ptr<db::DB> db(db::GetDB(param_.data_param().backend()));
-  db->Open(param_.data_param().source(), db::READ);
-  shared_ptr<db::Cursor> cursor(db->NewCursor());
+  vector<shared_ptr<Source> > sources;
+  make_sources(&sources);
+  vector<shared_ptr<Shard> > shards;
+  if (sources.size() == 1) {
+    source_ = sources[0];
+  } else {
+    // Each shard reads ahead up to a batch, in its own queue pair to keep
+    // the interleaving fixed, or in a common one to take records as they
+    // come. Shards start reading right away, on their own threads.
+    const DataParameter& data_param = param_.data_param();
+    const int size = data_param.batch_size();
+    for (int i = 0; i < sources.size(); ++i) {
+      if (data_param.ordered_shards() || i == 0) {
+        shard_queue_pairs_.push_back(shared_ptr<QueuePair>(
+            new QueuePair(data_param.ordered_shards() ? size : size * 2)));
+      }
+      shards.push_back(shared_ptr<Shard>(
+          new Shard(sources[i], shard_queue_pairs_.back())));
+    }
+    LOG(INFO) << "Reading " << data_param.source() << " with "
+              << shards.size() << " shards";
+  }
   vector<shared_ptr<QueuePair> > qps;
   try {
     int solver_count = param_.phase() == TRAIN ? Caffe::solver_count() : 1;
@@ -83,13 +310,13 @@ void DataReader::Body::InternalThreadEntry() {
     // so read one item, then wait for the next solver.
     for (int i = 0; i < solver_count; ++i) {
       shared_ptr<QueuePair> qp(new_queue_pairs_.pop());
-      read_one(cursor.get(), qp.get());
+      read_one(qp.get());
       qps.push_back(qp);
     }
     // Main loop
     while (!must_stop()) {
       for (int i = 0; i < solver_count; ++i) {
-        read_one(cursor.get(), qps[i].get());
+        read_one(qps[i].get());
       }
       // Check no additional readers have been created. This can happen if
       // more than one net is trained at a time per process, whether single
@@ -102,17 +329,76 @@ void DataReader::Body::InternalThreadEntry() {
   }
 }
 
-void DataReader::Body::read_one(db::Cursor* cursor, QueuePair* qp) {
-  Datum* datum = qp->free_.pop();
-  // TODO deserialize in-place instead of copy?
-  datum->ParseFromString(cursor->value());
-  qp->full_.push(datum);
+void DataReader::Body::read_one(QueuePair* qp) {
+  if (source_) {
+    source_->read_one(qp);
+    return;
+  }
+  // Exchange a free item of the solver for one the next shard has read
+  QueuePair* shard = shard_queue_pairs_[next_shard_].get();
+  next_shard_ = (next_shard_ + 1) % shard_queue_pairs_.size();
+  Item* item = qp->free_.pop();
+  Item* read;
+  try {
+    read = shard->full_.pop();
+  } catch (boost::thread_interrupted&) {
+    qp->free_.push(item);
+    throw;
+  }
+  shard->free_.push(item);
+  qp->full_.push(read);
+}
 
-  // go to the next iter
-  cursor->Next();
-  if (!cursor->valid()) {
-    DLOG(INFO) << "Restarting data prefetching from start.";
+void DataReader::Body::make_sources(vector<shared_ptr<Source> >* sources) {
+  const DataParameter& data_param = param_.data_param();
+  vector<string> paths(1, data_param.source());
+  for (int i = 0; i < data_param.shard_source_size(); ++i) {
+    paths.push_back(data_param.shard_source(i));
+  }
+  const int partitions = data_param.partitions();
+  CHECK_GT(partitions, 0);
+  for (int i = 0; i < paths.size(); ++i) {
+    // Backends cannot open a database twice in a process, partitions share
+    // it. Cursors are all made here, before the shards read on their own
+    // threads, as making one is not thread safe for every backend.
+    shared_ptr<db::DB> db(db::GetDB(data_param.backend()));
+    db->Open(paths[i], db::READ);
+    if (partitions == 1) {
+      sources->push_back(shared_ptr<Source>(
+          new Source(param_, db, paths[i], "", 0)));
+      continue;
+    }
+    // Count the records, then find the first key of each partition. Only
+    // keys are visited, which for LMDB does not touch the values, and
+    // backends with random access are not scanned at all.
+    shared_ptr<db::Cursor> cursor(db->NewCursor());
+    const bool random_access = cursor->size() > 0;
+    size_t count = cursor->size();
+    for (; !random_access && cursor->valid(); cursor->Next()) {
+      ++count;
+    }
+    CHECK_GE(count, partitions) << "Fewer records than partitions in "
+                                << paths[i];
     cursor->SeekToFirst();
+    size_t index = 0;
+    vector<string> begin_keys(partitions);
+    for (int p = 0; p < partitions; ++p) {
+      const size_t begin = count * p / partitions;
+      if (random_access) {
+        cursor->SeekToIndex(begin);
+      } else {
+        for (; index < begin; ++index) {
+          cursor->Next();
+        }
+      }
+      begin_keys[p] = cursor->key();
+    }
+    cursor.reset();
+    for (int p = 0; p < partitions; ++p) {
+      const size_t size = count * (p + 1) / partitions - count * p / partitions;
+      sources->push_back(shared_ptr<Source>(
+          new Source(param_, db, paths[i], begin_keys[p], size)));
+    }
   }
 }
 
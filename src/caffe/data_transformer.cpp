@@ -2,6 +2,7 @@
 #include <opencv2/core/core.hpp>
 #endif  // USE_OPENCV
 
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -38,10 +39,43 @@ DataTransformer<Dtype>::DataTransformer(const TransformationParameter& param,
   }
 }
 
+// Subtracts the mean and scales a row of width pixels, read every stride
+// elements from src, and writes it to dst, reversed if mirror. mean is the
+// matching row of the mean file, or NULL to subtract mean_value. The variant
+// is picked once per row, so that each loop is branch-free over contiguous
+// output, which compilers vectorize.
+template <typename Dtype, typename Src>
+static inline void TransformRow(const Src* src, int stride, int width,
+    const Dtype* mean, Dtype mean_value, Dtype scale, bool mirror,
+    Dtype* dst) {
+  if (mirror) {
+    dst += width - 1;
+    if (mean) {
+      for (int w = 0; w < width; ++w) {
+        dst[-w] = (static_cast<Dtype>(src[w * stride]) - mean[w]) * scale;
+      }
+    } else {
+      for (int w = 0; w < width; ++w) {
+        dst[-w] = (static_cast<Dtype>(src[w * stride]) - mean_value) * scale;
+      }
+    }
+  } else {
+    if (mean) {
+      for (int w = 0; w < width; ++w) {
+        dst[w] = (static_cast<Dtype>(src[w * stride]) - mean[w]) * scale;
+      }
+    } else {
+      for (int w = 0; w < width; ++w) {
+        dst[w] = (static_cast<Dtype>(src[w * stride]) - mean_value) * scale;
+      }
+    }
+  }
+}
+
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
+                                       const char* data, size_t data_size,
                                        Dtype* transformed_data) {
-  const string& data = datum.data();
   const int datum_channels = datum.channels();
   const int datum_height = datum.height();
   const int datum_width = datum.width();
@@ -50,7 +84,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   const Dtype scale = param_.scale();
   const bool do_mirror = param_.mirror() && Rand(2);
   const bool has_mean_file = param_.has_mean_file();
-  const bool has_uint8 = data.size() > 0;
+  const bool has_uint8 = data_size > 0;
   const bool has_mean_values = mean_values_.size() > 0;
 
   CHECK_GT(datum_channels, 0);
@@ -93,42 +127,141 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     }
   }
 
-  Dtype datum_element;
-  int top_index, data_index;
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(data);
+  const float* float_data = has_uint8 ? NULL : datum.float_data().data();
   for (int c = 0; c < datum_channels; ++c) {
+    const Dtype mean_value = has_mean_values ? mean_values_[c] : Dtype(0);
     for (int h = 0; h < height; ++h) {
-      for (int w = 0; w < width; ++w) {
-        data_index = (c * datum_height + h_off + h) * datum_width + w_off + w;
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        if (has_uint8) {
-          datum_element =
-            static_cast<Dtype>(static_cast<uint8_t>(data[data_index]));
-        } else {
-          datum_element = datum.float_data(data_index);
+      const int data_index = (c * datum_height + h_off + h) * datum_width +
+          w_off;
+      const Dtype* mean_row = has_mean_file ? mean + data_index : NULL;
+      Dtype* top_row = transformed_data + (c * height + h) * width;
+      if (has_uint8) {
+        TransformRow(pixels + data_index, 1, width, mean_row, mean_value,
+            scale, do_mirror, top_row);
+      } else {
+        TransformRow(float_data + data_index, 1, width, mean_row, mean_value,
+            scale, do_mirror, top_row);
+      }
+    }
+  }
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::TransformPixels(const Datum& datum,
+                                             const char* data,
+                                             size_t data_size,
+                                             uint8_t* pixels, int* crop) {
+  CHECK(!datum.encoded()) << "Deferred normalization needs raw uint8 data";
+  CHECK_GT(data_size, 0) << "Deferred normalization needs uint8 data";
+  const int datum_channels = datum.channels();
+  const int datum_height = datum.height();
+  const int datum_width = datum.width();
+  const int crop_size = param_.crop_size();
+  // Draw random numbers in the same order as Transform
+  const bool do_mirror = param_.mirror() && Rand(2);
+  CHECK_GE(datum_height, crop_size);
+  CHECK_GE(datum_width, crop_size);
+
+  int height = datum_height;
+  int width = datum_width;
+  int h_off = 0;
+  int w_off = 0;
+  if (crop_size) {
+    height = crop_size;
+    width = crop_size;
+    if (phase_ == TRAIN) {
+      h_off = Rand(datum_height - crop_size + 1);
+      w_off = Rand(datum_width - crop_size + 1);
+    } else {
+      h_off = (datum_height - crop_size) / 2;
+      w_off = (datum_width - crop_size) / 2;
+    }
+  }
+  crop[0] = h_off;
+  crop[1] = w_off;
+  crop[2] = do_mirror;
+
+  for (int c = 0; c < datum_channels; ++c) {
+    for (int h = 0; h < height; ++h) {
+      const uint8_t* row = reinterpret_cast<const uint8_t*>(data) +
+          (c * datum_height + h_off + h) * datum_width + w_off;
+      uint8_t* top_row = pixels + (c * height + h) * width;
+      if (do_mirror) {
+        for (int w = 0; w < width; ++w) {
+          top_row[width - 1 - w] = row[w];
         }
-        if (has_mean_file) {
-          transformed_data[top_index] =
-            (datum_element - mean[data_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (datum_element - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = datum_element * scale;
-          }
+      } else {
+        memcpy(top_row, row, width);
+      }
+    }
+  }
+}
+
+template<typename Dtype>
+const Blob<Dtype>& DataTransformer<Dtype>::channel_mean(int channels) {
+  if (channel_mean_.count() != channels) {
+    CHECK(mean_values_.size() <= 1 || mean_values_.size() == channels) <<
+     "Specify either 1 mean_value or as many as channels: " << channels;
+    channel_mean_.Reshape(vector<int>(1, channels));
+    Dtype* mean = channel_mean_.mutable_cpu_data();
+    for (int c = 0; c < channels; ++c) {
+      mean[c] = mean_values_.empty() ? Dtype(0) :
+          mean_values_[mean_values_.size() == 1 ? 0 : c];
+    }
+  }
+  return channel_mean_;
+}
+
+template<typename Dtype>
+void DataTransformer<Dtype>::Normalize(const uint8_t* pixels,
+                                       const int* crops,
+                                       Blob<Dtype>* normalized_blob) {
+  const int num = normalized_blob->num();
+  const int channels = normalized_blob->channels();
+  const int height = normalized_blob->height();
+  const int width = normalized_blob->width();
+  const Dtype scale = param_.scale();
+  const bool has_mean_file = param_.has_mean_file();
+  if (has_mean_file) {
+    CHECK_EQ(channels, data_mean_.channels());
+    CHECK_GE(data_mean_.height(), height);
+    CHECK_GE(data_mean_.width(), width);
+  }
+  const Dtype* mean = has_mean_file ? data_mean_.cpu_data() :
+      channel_mean(channels).cpu_data();
+  const int mean_height = data_mean_.height();
+  const int mean_width = data_mean_.width();
+
+  Dtype* normalized = normalized_blob->mutable_cpu_data();
+  for (int n = 0; n < num; ++n) {
+    const int* crop = crops + n * 3;
+    for (int c = 0; c < channels; ++c) {
+      for (int h = 0; h < height; ++h) {
+        // The mean file is indexed by the position in the uncropped datum
+        const Dtype* mean_row = has_mean_file ?
+            mean + (c * mean_height + crop[0] + h) * mean_width + crop[1] :
+            NULL;
+        for (int w = 0; w < width; ++w) {
+          const Dtype m = has_mean_file ?
+              mean_row[crop[2] ? width - 1 - w : w] : mean[c];
+          *normalized++ = (static_cast<Dtype>(*pixels++) - m) * scale;
         }
       }
     }
   }
 }
 
+template<typename Dtype>
+void DataTransformer<Dtype>::Transform(const Datum& datum,
+                                       Blob<Dtype>* transformed_blob) {
+  const string& data = datum.data();
+  Transform(datum, data.data(), data.size(), transformed_blob);
+}
 
 template<typename Dtype>
 void DataTransformer<Dtype>::Transform(const Datum& datum,
+                                       const char* data, size_t data_size,
                                        Blob<Dtype>* transformed_blob) {
   // If datum is encoded, decoded and transform the cv::image.
   if (datum.encoded()) {
@@ -138,9 +271,9 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
     cv::Mat cv_img;
     if (param_.force_color() || param_.force_gray()) {
     // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
+      cv_img = DecodeDatumToCVMat(data, data_size, param_.force_color());
     } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
+      cv_img = DecodeDatumToCVMatNative(data, data_size);
     }
     // Transform the cv::image into blob.
     return Transform(cv_img, transformed_blob);
@@ -178,7 +311,7 @@ void DataTransformer<Dtype>::Transform(const Datum& datum,
   }
 
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  Transform(datum, transformed_data);
+  Transform(datum, data, data_size, transformed_data);
 }
 
 template<typename Dtype>
@@ -294,32 +427,15 @@ void DataTransformer<Dtype>::Transform(const cv::Mat& cv_img,
   CHECK(cv_cropped_img.data);
 
   Dtype* transformed_data = transformed_blob->mutable_cpu_data();
-  int top_index;
   for (int h = 0; h < height; ++h) {
+    // Pixels are interleaved, so each channel reads every img_channels bytes
     const uchar* ptr = cv_cropped_img.ptr<uchar>(h);
-    int img_index = 0;
-    for (int w = 0; w < width; ++w) {
-      for (int c = 0; c < img_channels; ++c) {
-        if (do_mirror) {
-          top_index = (c * height + h) * width + (width - 1 - w);
-        } else {
-          top_index = (c * height + h) * width + w;
-        }
-        // int top_index = (c * height + h) * width + w;
-        Dtype pixel = static_cast<Dtype>(ptr[img_index++]);
-        if (has_mean_file) {
-          int mean_index = (c * img_height + h_off + h) * img_width + w_off + w;
-          transformed_data[top_index] =
-            (pixel - mean[mean_index]) * scale;
-        } else {
-          if (has_mean_values) {
-            transformed_data[top_index] =
-              (pixel - mean_values_[c]) * scale;
-          } else {
-            transformed_data[top_index] = pixel * scale;
-          }
-        }
-      }
+    for (int c = 0; c < img_channels; ++c) {
+      const Dtype* mean_row = has_mean_file ?
+          mean + (c * img_height + h_off + h) * img_width + w_off : NULL;
+      const Dtype mean_value = has_mean_values ? mean_values_[c] : Dtype(0);
+      TransformRow(ptr + c, img_channels, width, mean_row, mean_value, scale,
+          do_mirror, transformed_data + (c * height + h) * width);
     }
   }
 }
@@ -440,6 +556,13 @@ void DataTransformer<Dtype>::Transform(Blob<Dtype>* input_blob,
 
 template<typename Dtype>
 vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
+  const string& data = datum.data();
+  return InferBlobShape(datum, data.data(), data.size());
+}
+
+template<typename Dtype>
+vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum,
+    const char* data, size_t data_size) {
   if (datum.encoded()) {
 #ifdef USE_OPENCV
     CHECK(!(param_.force_color() && param_.force_gray()))
@@ -447,9 +570,9 @@ vector<int> DataTransformer<Dtype>::InferBlobShape(const Datum& datum) {
     cv::Mat cv_img;
     if (param_.force_color() || param_.force_gray()) {
     // If force_color then decode in color otherwise decode in gray.
-      cv_img = DecodeDatumToCVMat(datum, param_.force_color());
+      cv_img = DecodeDatumToCVMat(data, data_size, param_.force_color());
     } else {
-      cv_img = DecodeDatumToCVMatNative(datum);
+      cv_img = DecodeDatumToCVMatNative(data, data_size);
     }
     // InferBlobShape using the cv::image.
     return InferBlobShape(cv_img);
@@ -0,0 +1,57 @@
+#include <stdint.h>
+
+#include "caffe/data_transformer.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+__global__ void NormalizeKernel(const int n, const uint8_t* pixels,
+    const int* crops, const Dtype* mean, const bool has_mean_file,
+    const int channels, const int height, const int width,
+    const int mean_height, const int mean_width, const Dtype scale,
+    Dtype* normalized) {
+  CUDA_KERNEL_LOOP(index, n) {
+    const int w = index % width;
+    const int h = (index / width) % height;
+    const int c = (index / width / height) % channels;
+    const int* crop = crops + (index / width / height / channels) * 3;
+    Dtype m;
+    if (has_mean_file) {
+      // The mean file is indexed by the position in the uncropped datum
+      const int mean_w = crop[1] + (crop[2] ? width - 1 - w : w);
+      m = mean[(c * mean_height + crop[0] + h) * mean_width + mean_w];
+    } else {
+      m = mean[c];
+    }
+    normalized[index] = (static_cast<Dtype>(pixels[index]) - m) * scale;
+  }
+}
+
+template <typename Dtype>
+void DataTransformer<Dtype>::Normalize_gpu(const uint8_t* pixels,
+    const int* crops, Blob<Dtype>* normalized_blob) {
+  const int count = normalized_blob->count();
+  const int channels = normalized_blob->channels();
+  const bool has_mean_file = param_.has_mean_file();
+  if (has_mean_file) {
+    CHECK_EQ(channels, data_mean_.channels());
+    CHECK_GE(data_mean_.height(), normalized_blob->height());
+    CHECK_GE(data_mean_.width(), normalized_blob->width());
+  }
+  const Dtype* mean = has_mean_file ? data_mean_.gpu_data() :
+      channel_mean(channels).gpu_data();
+  // NOLINT_NEXT_LINE(whitespace/operators)
+  NormalizeKernel<Dtype><<<CAFFE_GET_BLOCKS(count), CAFFE_CUDA_NUM_THREADS>>>(
+      count, pixels, crops, mean, has_mean_file, channels,
+      normalized_blob->height(), normalized_blob->width(),
+      data_mean_.height(), data_mean_.width(), Dtype(param_.scale()),
+      normalized_blob->mutable_gpu_data());
+  CUDA_POST_KERNEL_CHECK;
+}
+
+template void DataTransformer<float>::Normalize_gpu(const uint8_t* pixels,
+    const int* crops, Blob<float>* normalized_blob);
+template void DataTransformer<double>::Normalize_gpu(const uint8_t* pixels,
+    const int* crops, Blob<double>* normalized_blob);
+
+}  // namespace caffe
@@ -1,4 +1,10 @@
 #include <boost/thread.hpp>
+#include <stdint.h>
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <limits>
+#include <string>
 #include <vector>
 
 #include "caffe/blob.hpp"
@@ -8,6 +14,7 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/util/blocking_queue.hpp"
+#include "caffe/util/trace.hpp"
 
 namespace caffe {
 
@@ -36,40 +43,78 @@ template <typename Dtype>
 BasePrefetchingDataLayer<Dtype>::BasePrefetchingDataLayer(
     const LayerParameter& param)
     : BaseDataLayer<Dtype>(param),
-      prefetch_free_(), prefetch_full_() {
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_free_.push(&prefetch_[i]);
+      prefetch_(param.data_param().has_prefetch() ?
+          param.data_param().prefetch() : PREFETCH_COUNT),
+      prefetch_free_(), prefetch_full_(),
+      defer_normalization_(false), min_prefetch_(prefetch_.size()),
+      forward_count_(0), full_waits_(0), free_waits_(0) {
+  CHECK_GT(prefetch_.size(), 0) << "Data layers need to prefetch a batch";
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    prefetch_[i].reset(new Batch<Dtype>());
+    prefetch_free_.push(prefetch_[i].get());
   }
 }
 
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::LayerSetUp(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
+  // Setting the layer up again restarts prefetching
+  if (is_started()) {
+    StopInternalThread();
+    Batch<Dtype>* batch;
+    while (prefetch_full_.try_pop(&batch)) {
+      prefetch_free_.push(batch);
+    }
+  }
   BaseDataLayer<Dtype>::LayerSetUp(bottom, top);
+  if (this->transform_param_.defer_normalization() && !defer_normalization_) {
+    LOG(WARNING) << "Data layer " << this->layer_param_.name()
+        << " cannot defer normalization, batches are prefetched normalized";
+  }
   // Before starting the prefetch thread, we make cpu_data and gpu_data
   // calls so that the prefetch thread does not accidentally make simultaneous
   // cudaMalloc calls when the main thread is running. In some GPUs this
   // seems to cause failures if we do not so.
-  for (int i = 0; i < PREFETCH_COUNT; ++i) {
-    prefetch_[i].data_.mutable_cpu_data();
-    if (this->output_labels_) {
-      prefetch_[i].label_.mutable_cpu_data();
-    }
+  for (int i = 0; i < prefetch_.size(); ++i) {
+    reserve_batch(prefetch_[i].get());
+  }
+  DLOG(INFO) << "Initializing prefetch";
+  this->data_transformer_->InitRand();
+  StartInternalThread();
+  DLOG(INFO) << "Prefetch initialized.";
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::reserve_batch(Batch<Dtype>* batch) {
+  if (defer_normalization_) {
+    batch->ReshapePixels();
+    batch->pixels_->mutable_cpu_data();
+    batch->crops_.mutable_cpu_data();
+  } else {
+    batch->data_.mutable_cpu_data();
+  }
+  if (this->output_labels_) {
+    batch->label_.mutable_cpu_data();
+  }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    batch->extra_[i]->mutable_cpu_data();
   }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
-    for (int i = 0; i < PREFETCH_COUNT; ++i) {
-      prefetch_[i].data_.mutable_gpu_data();
-      if (this->output_labels_) {
-        prefetch_[i].label_.mutable_gpu_data();
-      }
+    if (defer_normalization_) {
+      batch->pixels_->mutable_gpu_data();
+      batch->crops_.mutable_gpu_data();
+    } else {
+      batch->data_.mutable_gpu_data();
+    }
+    if (this->output_labels_) {
+      batch->label_.mutable_gpu_data();
+    }
+    for (int i = 0; i < batch->extra_.size(); ++i) {
+      batch->extra_[i]->mutable_gpu_data();
     }
   }
 #endif
-  DLOG(INFO) << "Initializing prefetch";
-  this->data_transformer_->InitRand();
-  StartInternalThread();
-  DLOG(INFO) << "Prefetch initialized.";
 }
 
 template <typename Dtype>
@@ -81,20 +126,32 @@ void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
   }
 #endif
 
+  Batch<Dtype>* batch = NULL;
   try {
     while (!must_stop()) {
-      Batch<Dtype>* batch = prefetch_free_.pop();
+      batch = prefetch_free_.pop();
+      TraceScope trace(this->layer_param_.name(), "load_batch");
       load_batch(batch);
 #ifndef CPU_ONLY
       if (Caffe::mode() == Caffe::GPU) {
-        batch->data_.data().get()->async_gpu_push(stream);
+        if (defer_normalization_) {
+          batch->pixels_->async_gpu_push(stream);
+          batch->crops_.data().get()->async_gpu_push(stream);
+        } else {
+          batch->data_.data().get()->async_gpu_push(stream);
+        }
         CUDA_CHECK(cudaStreamSynchronize(stream));
       }
 #endif
       prefetch_full_.push(batch);
+      batch = NULL;
     }
   } catch (boost::thread_interrupted&) {
-    // Interrupted exception is expected on shutdown
+    // Interrupted exception is expected on shutdown. A batch being loaded is
+    // handed back, in case the thread is restarted.
+    if (batch) {
+      prefetch_free_.push(batch);
+    }
   }
 #ifndef CPU_ONLY
   if (Caffe::mode() == Caffe::GPU) {
@@ -103,15 +160,132 @@ void BasePrefetchingDataLayer<Dtype>::InternalThreadEntry() {
 #endif
 }
 
+// Forward passes between reads of the available memory, if not logging stats
+static const int kMemoryCheckInterval = 100;
+
+// Available host memory in MB, or -1 if it cannot be determined.
+static int64_t AvailableMemoryMB() {
+  std::ifstream meminfo("/proc/meminfo");
+  string key;
+  int64_t kb;
+  while (meminfo >> key >> kb) {
+    if (key == "MemAvailable:") {
+      return kb / 1024;
+    }
+    meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+  return -1;
+}
+
+template <typename Dtype>
+Batch<Dtype>* BasePrefetchingDataLayer<Dtype>::next_batch() {
+  Batch<Dtype>* batch;
+  {
+    // Spans of this net waiting for data
+    TraceScope trace(this->layer_param_.name(), "wait_for_batch");
+    batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  }
+  ++forward_count_;
+  const DataParameter& param = this->layer_param_.data_param();
+  if (param.max_prefetch() <= prefetch_.size()) {
+    return batch;
+  }
+  // Only a net that waited while the prefetch thread had itself been
+  // blocked on a full queue benefits from a deeper queue. If the thread is
+  // always behind, more batches just cost memory.
+  const size_t full_waits = prefetch_full_.stats().waits_;
+  const size_t free_waits = prefetch_free_.stats().waits_;
+  if (forward_count_ > 1 && full_waits > full_waits_ &&
+      free_waits > free_waits_) {
+    shared_ptr<Batch<Dtype> > grown(new Batch<Dtype>());
+    grown->data_.ReshapeLike(batch->data_);
+    if (this->output_labels_) {
+      grown->label_.ReshapeLike(batch->label_);
+    }
+    for (int i = 0; i < batch->extra_.size(); ++i) {
+      grown->extra_.push_back(shared_ptr<Blob<Dtype> >(
+          new Blob<Dtype>(batch->extra_[i]->shape())));
+    }
+    reserve_batch(grown.get());
+    prefetch_.push_back(grown);
+    prefetch_free_.push(grown.get());
+    free_waits_ = free_waits;
+    prefetch_resized(1);
+    LOG(INFO) << "Data layer " << this->layer_param_.name()
+        << " prefetch depth grown to " << prefetch_.size() << " batches";
+  }
+  full_waits_ = full_waits;
+  return batch;
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::recycle_batch(Batch<Dtype>* batch) {
+  const DataParameter& param = this->layer_param_.data_param();
+  bool release = false;
+  const int check_interval = param.prefetch_stats_interval() ?
+      param.prefetch_stats_interval() : kMemoryCheckInterval;
+  if (static_cast<int>(prefetch_.size()) > min_prefetch_ &&
+      forward_count_ % check_interval == 0) {
+    const int64_t available = AvailableMemoryMB();
+    release = available >= 0 && available < param.min_free_memory_mb();
+  }
+  if (release) {
+    for (int i = 0; i < prefetch_.size(); ++i) {
+      if (prefetch_[i].get() == batch) {
+        prefetch_.erase(prefetch_.begin() + i);
+        break;
+      }
+    }
+    prefetch_resized(-1);
+    LOG(INFO) << "Data layer " << this->layer_param_.name()
+        << " prefetch depth shrunk to " << prefetch_.size()
+        << " batches, host memory is low";
+  } else {
+    prefetch_free_.push(batch);
+  }
+  if (param.prefetch_stats_interval() &&
+      forward_count_ % param.prefetch_stats_interval() == 0) {
+    log_prefetch_stats();
+  }
+}
+
+template <typename Dtype>
+void BasePrefetchingDataLayer<Dtype>::log_prefetch_stats() {
+  const BlockingQueueStats full = prefetch_full_.stats();
+  const BlockingQueueStats free = prefetch_free_.stats();
+  const size_t batches = full.pops_ - last_full_stats_.pops_;
+  const size_t loads = std::max<size_t>(free.pops_ - last_free_stats_.pops_, 1);
+  if (batches == 0) {
+    return;
+  }
+  LOG(INFO) << "Data layer " << this->layer_param_.name() << ": net waited "
+      << (full.waits_ - last_full_stats_.waits_) << "/" << batches
+      << " batches, " << (full.wait_ms_ - last_full_stats_.wait_ms_) / batches
+      << " ms per batch; prefetch thread waited "
+      << (free.wait_ms_ - last_free_stats_.wait_ms_) / loads
+      << " ms per batch; " << static_cast<float>(
+          full.occupancy_ - last_full_stats_.occupancy_) / batches
+      << "/" << prefetch_.size() << " batches ready on average";
+  last_full_stats_ = full;
+  last_free_stats_ = free;
+}
+
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  Batch<Dtype>* batch = next_batch();
   // Reshape to loaded data.
   top[0]->ReshapeLike(batch->data_);
-  // Copy the data
-  caffe_copy(batch->data_.count(), batch->data_.cpu_data(),
-             top[0]->mutable_cpu_data());
+  if (defer_normalization_) {
+    // Finish the transformation of the items
+    this->data_transformer_->Normalize(
+        static_cast<const uint8_t*>(batch->pixels_->cpu_data()),
+        batch->crops_.cpu_data(), top[0]);
+  } else {
+    // Copy the data
+    caffe_copy(batch->data_.count(), batch->data_.cpu_data(),
+               top[0]->mutable_cpu_data());
+  }
   DLOG(INFO) << "Prefetch copied";
   if (this->output_labels_) {
     // Reshape to loaded labels.
@@ -120,8 +294,13 @@ void BasePrefetchingDataLayer<Dtype>::Forward_cpu(
     caffe_copy(batch->label_.count(), batch->label_.cpu_data(),
         top[1]->mutable_cpu_data());
   }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    top[i + 2]->ReshapeLike(*batch->extra_[i]);
+    caffe_copy(batch->extra_[i]->count(), batch->extra_[i]->cpu_data(),
+        top[i + 2]->mutable_cpu_data());
+  }
 
-  prefetch_free_.push(batch);
+  recycle_batch(batch);
 }
 
 #ifdef CPU_ONLY
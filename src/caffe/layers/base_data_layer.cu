@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #include <vector>
 
 #include "caffe/layers/base_data_layer.hpp"
@@ -7,12 +9,19 @@ namespace caffe {
 template <typename Dtype>
 void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
     const vector<Blob<Dtype>*>& bottom, const vector<Blob<Dtype>*>& top) {
-  Batch<Dtype>* batch = prefetch_full_.pop("Data layer prefetch queue empty");
+  Batch<Dtype>* batch = next_batch();
   // Reshape to loaded data.
   top[0]->ReshapeLike(batch->data_);
-  // Copy the data
-  caffe_copy(batch->data_.count(), batch->data_.gpu_data(),
-      top[0]->mutable_gpu_data());
+  if (defer_normalization_) {
+    // Finish the transformation of the items on the device
+    this->data_transformer_->Normalize_gpu(
+        static_cast<const uint8_t*>(batch->pixels_->gpu_data()),
+        batch->crops_.gpu_data(), top[0]);
+  } else {
+    // Copy the data
+    caffe_copy(batch->data_.count(), batch->data_.gpu_data(),
+        top[0]->mutable_gpu_data());
+  }
   if (this->output_labels_) {
     // Reshape to loaded labels.
     top[1]->ReshapeLike(batch->label_);
@@ -20,10 +29,15 @@ void BasePrefetchingDataLayer<Dtype>::Forward_gpu(
     caffe_copy(batch->label_.count(), batch->label_.gpu_data(),
         top[1]->mutable_gpu_data());
   }
+  for (int i = 0; i < batch->extra_.size(); ++i) {
+    top[i + 2]->ReshapeLike(*batch->extra_[i]);
+    caffe_copy(batch->extra_[i]->count(), batch->extra_[i]->gpu_data(),
+        top[i + 2]->mutable_gpu_data());
+  }
   // Ensure the copy is synchronous wrt the host, so that the next batch isn't
   // copied in meanwhile.
   CUDA_CHECK(cudaStreamSynchronize(cudaStreamDefault));
-  prefetch_free_.push(batch);
+  recycle_batch(batch);
 }
 
 INSTANTIATE_LAYER_GPU_FORWARD(BasePrefetchingDataLayer);
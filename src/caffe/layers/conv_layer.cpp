@@ -1,6 +1,7 @@
 #include <vector>
 #include "caffe/layers/conv_layer.hpp"
 #include "caffe/adaptive_probabilistic_pruning.hpp"
+#include "caffe/util/trace.hpp"
 #include <cstdlib>
 #include <cmath>
 #define NSUM 50
@@ -19,16 +20,7 @@ void ConvolutionLayer<Dtype>::PruneSetUp(const PruneParameter& prune_param) {
     this->masks_.resize(count, 1); /// in test we still need masks and weight backup for PP
     this->weight_backup.resize(count);
     
-    /// Get layer_index
-    const string layer_name = this->layer_param_.name();
-    if (this->phase_ == TRAIN) {
-        if (APP::layer_index.count(layer_name) == 0) {
-            ++ APP::layer_cnt;
-            APP::layer_index[layer_name] = APP::layer_cnt;
-        }
-    } else { return; }
-    
-    const int L = APP::layer_index[layer_name];
+    if (this->phase_ != TRAIN) { return; }
     const string mthd = APP::prune_method;
     
     /// Note: the varibales below can ONLY be used in training.
@@ -36,6 +28,32 @@ void ConvolutionLayer<Dtype>::PruneSetUp(const PruneParameter& prune_param) {
     this->prune_ratio = prune_param.prune_ratio();
     this->delta = prune_param.delta();
     this->pruned_ratio = 0;
+    
+    /// Pruning state info
+    if (mthd == "PPc") {
+        this->history_score.resize(num_col, 0);
+    } else {
+        this->history_score.resize(num_row, 0);
+    }
+    
+    this->history_diff.resize(count, 0);
+    this->blobs_[0]->mutable_cpu_second_diff = new Dtype[count];
+    for (int i = 0; i < count; ++i) {
+        this->blobs_[0]->mutable_cpu_second_diff[i] = 0;
+    } // legacy
+    
+    /// The worker solvers of data-parallel training share the pruning state
+    /// of the root solver, only its layers register in APP.
+    if (!Caffe::root_solver()) { return; }
+    
+    /// Get layer_index
+    const string layer_name = this->layer_param_.name();
+    if (APP::layer_index.count(layer_name) == 0) {
+        ++ APP::layer_cnt;
+        APP::layer_index[layer_name] = APP::layer_cnt;
+    }
+    const int L = APP::layer_index[layer_name];
+    
     APP::prune_ratio.push_back(prune_param.prune_ratio());
     APP::delta.push_back(prune_param.delta());
     APP::pruned_ratio.push_back(0);
@@ -75,19 +93,6 @@ void ConvolutionLayer<Dtype>::PruneSetUp(const PruneParameter& prune_param) {
     APP::log_diff.push_back( vector<vector<float> >(num_log) );   /// [layer, weight_index, diff-value-along-time]
     
     
-    /// Pruning state info
-    if (mthd == "PPc") {
-        this->history_score.resize(num_col, 0);
-    } else {
-        this->history_score.resize(num_row, 0);
-    }
-    
-    this->history_diff.resize(count, 0);
-    this->blobs_[0]->mutable_cpu_second_diff = new Dtype[count];
-    for (int i = 0; i < count; ++i) {
-        this->blobs_[0]->mutable_cpu_second_diff[i] = 0;
-    } // legacy
-    
     if (num_col * this->prune_ratio > APP::max_num_column_to_prune) {
         APP::max_num_column_to_prune = num_col * this->prune_ratio;
     } // legacy
@@ -146,6 +151,7 @@ int ConvolutionLayer<Dtype>::GetPruneInterval() {
 
 template <typename Dtype> 
 void ConvolutionLayer<Dtype>::TaylorPrune(const vector<Blob<Dtype>*>& top) {
+    TraceScope trace("TaylorPrune", "prune");
     for (int i = 0; i < top.size(); ++i) {
         const Dtype* top_data = top[i]->cpu_data();
         const Dtype* top_diff = top[i]->cpu_diff();
@@ -195,6 +201,7 @@ void ConvolutionLayer<Dtype>::TaylorPrune(const vector<Blob<Dtype>*>& top) {
 
 template <typename Dtype> 
 void ConvolutionLayer<Dtype>::ProbPruneCol() {
+    TraceScope trace("ProbPruneCol", "prune");
     Dtype* muweight = this->blobs_[0]->mutable_cpu_data();
     const int count = this->blobs_[0]->count();
     const int num_row = this->blobs_[0]->shape()[0];
@@ -296,6 +303,7 @@ void ConvolutionLayer<Dtype>::ProbPruneCol() {
 
 template <typename Dtype> 
 void ConvolutionLayer<Dtype>::ProbPruneRow() {
+    TraceScope trace("ProbPruneRow", "prune");
     Dtype* muweight = this->blobs_[0]->mutable_cpu_data();
     const int count = this->blobs_[0]->count();
     const int num_row = this->blobs_[0]->shape()[0];
@@ -476,6 +484,7 @@ void ConvolutionLayer<Dtype>::UpdateNumPrunedCol() {
 
 template <typename Dtype> 
 void ConvolutionLayer<Dtype>::FilterPrune() {
+    TraceScope trace("FilterPrune", "prune");
     Dtype* muweight = this->blobs_[0]->mutable_cpu_data();
     const int count = this->blobs_[0]->count();
     const int num_row = this->blobs_[0]->shape()[0];
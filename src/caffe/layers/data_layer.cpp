@@ -3,6 +3,8 @@
 #endif  // USE_OPENCV
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
 #include <vector>
 
 #include "caffe/data_transformer.hpp"
@@ -27,27 +29,50 @@ void DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   const int batch_size = this->layer_param_.data_param().batch_size();
   // Read a data point, and use it to initialize the top blob.
-  Datum& datum = *(reader_.full().peek());
+  DataReader::Item& item = *(reader_.full().peek());
 
   // Use data_transformer to infer the expected blob shape from datum.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      item.datum_, item.data_, item.data_size_);
   this->transformed_data_.Reshape(top_shape);
+  if (this->transform_param_.defer_normalization()) {
+    // Mean subtraction and scaling can only be deferred for uint8 pixels
+    this->defer_normalization_ =
+        !item.datum_.encoded() && item.data_size_ > 0;
+  }
   // Reshape top[0] and prefetch_data according to the batch_size.
   top_shape[0] = batch_size;
   top[0]->Reshape(top_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].data_.Reshape(top_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->data_.Reshape(top_shape);
   }
   LOG(INFO) << "output data size: " << top[0]->num() << ","
       << top[0]->channels() << "," << top[0]->height() << ","
       << top[0]->width();
+  if (this->defer_normalization_) {
+    LOG(INFO) << "Prefetching uint8 data, normalized in the forward pass";
+  }
   // label
   if (this->output_labels_) {
     vector<int> label_shape(1, batch_size);
     top[1]->Reshape(label_shape);
-    for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-      this->prefetch_[i].label_.Reshape(label_shape);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->label_.Reshape(label_shape);
+    }
+  }
+  // Split decoding and transformation of each batch across worker threads
+  const int transform_threads =
+      this->layer_param_.data_param().transform_threads();
+  if (transform_threads > 1) {
+    for (int i = 0; i < transform_threads; ++i) {
+      shared_ptr<DataTransformer<Dtype> > transformer(
+          new DataTransformer<Dtype>(this->transform_param_, this->phase_));
+      transformer->InitRand();
+      transformers_.push_back(transformer);
     }
+    transform_pool_.reset(new ThreadPool(transform_threads));
+    LOG(INFO) << "Transforming batches on " << transform_threads
+        << " threads";
   }
 }
 
@@ -65,37 +90,61 @@ void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   // Reshape according to the first datum of each batch
   // on single input batches allows for inputs of varying dimension.
   const int batch_size = this->layer_param_.data_param().batch_size();
-  Datum& datum = *(reader_.full().peek());
+  DataReader::Item& item = *(reader_.full().peek());
   // Use data_transformer to infer the expected blob shape from datum.
-  vector<int> top_shape = this->data_transformer_->InferBlobShape(datum);
+  vector<int> top_shape = this->data_transformer_->InferBlobShape(
+      item.datum_, item.data_, item.data_size_);
   this->transformed_data_.Reshape(top_shape);
   // Reshape batch according to the batch_size.
   top_shape[0] = batch_size;
   batch->data_.Reshape(top_shape);
 
-  Dtype* top_data = batch->data_.mutable_cpu_data();
-  Dtype* top_label = NULL;  // suppress warnings about uninitialized variables
-
+  Slots slots;
+  slots.data = NULL;
+  slots.label = NULL;
+  slots.pixels = NULL;
+  slots.crops = NULL;
+  if (this->defer_normalization_) {
+    batch->ReshapePixels();
+    slots.pixels = static_cast<uint8_t*>(batch->pixels_->mutable_cpu_data());
+    slots.crops = batch->crops_.mutable_cpu_data();
+  } else {
+    slots.data = batch->data_.mutable_cpu_data();
+  }
   if (this->output_labels_) {
-    top_label = batch->label_.mutable_cpu_data();
+    slots.label = batch->label_.mutable_cpu_data();
   }
-  for (int item_id = 0; item_id < batch_size; ++item_id) {
+  if (transform_pool_) {
+    // Pop the whole batch in reader order, then let each worker transform
+    // its own item slots in place.
     timer.Start();
-    // get a datum
-    Datum& datum = *(reader_.full().pop("Waiting for data"));
+    batch_items_.resize(batch_size);
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      batch_items_[item_id] = reader_.full().pop("Waiting for data");
+    }
     read_time += timer.MicroSeconds();
     timer.Start();
-    // Apply data transformations (mirror, scale, crop...)
-    int offset = batch->data_.offset(item_id);
-    this->transformed_data_.set_cpu_data(top_data + offset);
-    this->data_transformer_->Transform(datum, &(this->transformed_data_));
-    // Copy label.
-    if (this->output_labels_) {
-      top_label[item_id] = datum.label();
-    }
+    transform_pool_->Run(boost::bind(&DataLayer<Dtype>::transform_items,
+        this, boost::cref(slots), _1));
     trans_time += timer.MicroSeconds();
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      reader_.free().push(batch_items_[item_id]);
+    }
+    batch_items_.clear();
+  } else {
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      timer.Start();
+      // get a datum
+      DataReader::Item* item = reader_.full().pop("Waiting for data");
+      read_time += timer.MicroSeconds();
+      timer.Start();
+      // Apply data transformations (mirror, scale, crop...)
+      transform_item(this->data_transformer_.get(), *item, item_id, slots,
+          &this->transformed_data_);
+      trans_time += timer.MicroSeconds();
 
-    reader_.free().push(const_cast<Datum*>(&datum));
+      reader_.free().push(item);
+    }
   }
   timer.Stop();
   batch_timer.Stop();
@@ -104,6 +153,47 @@ void DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
 }
 
+// Keep the reader's read-ahead in line with the number of prefetched batches
+template<typename Dtype>
+void DataLayer<Dtype>::prefetch_resized(int delta) {
+  const int batch_size = this->layer_param_.data_param().batch_size();
+  if (delta > 0) {
+    reader_.Grow(delta * batch_size);
+  } else {
+    reader_.Shrink(-delta * batch_size);
+  }
+}
+
+template<typename Dtype>
+void DataLayer<Dtype>::transform_item(DataTransformer<Dtype>* transformer,
+    const DataReader::Item& item, int item_id, const Slots& slots,
+    Blob<Dtype>* view) {
+  const int item_count = view->count();
+  if (slots.pixels) {
+    transformer->TransformPixels(item.datum_, item.data_, item.data_size_,
+        slots.pixels + item_id * item_count, slots.crops + item_id * 3);
+  } else {
+    view->set_cpu_data(slots.data + item_id * item_count);
+    transformer->Transform(item.datum_, item.data_, item.data_size_, view);
+  }
+  // Copy label.
+  if (slots.label) {
+    slots.label[item_id] = item.datum_.label();
+  }
+}
+
+// This function is called on the transform workers
+template<typename Dtype>
+void DataLayer<Dtype>::transform_items(const Slots& slots, int worker) {
+  DataTransformer<Dtype>* transformer = transformers_[worker].get();
+  Blob<Dtype> view(this->transformed_data_.shape());
+  for (int item_id = worker; item_id < batch_items_.size();
+       item_id += transformers_.size()) {
+    transform_item(transformer, *batch_items_[item_id], item_id, slots,
+        &view);
+  }
+}
+
 INSTANTIATE_CLASS(DataLayer);
 REGISTER_LAYER_CLASS(Data);
 
@@ -1,11 +1,6 @@
-/*
-TODO:
-- load file in a separate thread ("prefetch")
-- can be smarter about the memcpy call instead of doing it row-by-row
-  :: use util functions caffe_copy, and Blob->offset()
-  :: don't forget to update hdf5_daa_layer.cu accordingly
-- add ability to shuffle filenames if flag is set
-*/
+#include <boost/thread.hpp>
+
+#include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -14,62 +9,174 @@ TODO:
 #include "hdf5_hl.h"
 #include "stdint.h"
 
+#include "caffe/internal_thread.hpp"
 #include "caffe/layers/hdf5_data_layer.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/hdf5.hpp"
+#include "caffe/util/rng.hpp"
 
 namespace caffe {
 
-template <typename Dtype>
-HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() { }
+static const int MIN_DATA_DIM = 1;
+static const int MAX_DATA_DIM = INT_MAX;
 
-// Load data and label from HDF5 filename into the class property blobs.
+// Reads the files chunk by chunk on a background thread, into two buffers,
+// so that the next chunk is read while rows are taken from the current one.
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LoadHDF5FileData(const char* filename) {
-  DLOG(INFO) << "Loading HDF5 file: " << filename;
-  hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (file_id < 0) {
-    LOG(FATAL) << "Failed opening HDF5 file: " << filename;
-  }
+class HDF5DataLayer<Dtype>::Reader : public InternalThread {
+ public:
+  struct Chunk {
+    Chunk() : file(-1), begin(0) {}
+    vector<shared_ptr<Blob<Dtype> > > blobs;
+    // Order in which rows are output
+    vector<int> permutation;
+    // Rows held by the buffer, file is -1 if none
+    int file;
+    hsize_t begin;
+  };
 
-  int top_size = this->layer_param_.top_size();
-  hdf_blobs_.resize(top_size);
+  Reader(const LayerParameter& param, const vector<string>& filenames)
+      : param_(param), filenames_(filenames), rows_(filenames.size(), -1),
+        chunks_(2), file_id_(-1) {
+    for (int i = 0; i < chunks_.size(); ++i) {
+      free_.push(i);
+    }
+  }
+  virtual ~Reader() {
+    StopInternalThread();
+  }
 
-  const int MIN_DATA_DIM = 1;
-  const int MAX_DATA_DIM = INT_MAX;
+  // Index of the next loaded chunk, to release with push
+  int pop() {
+    return full_.pop("Waiting for HDF5 data");
+  }
+  const Chunk& chunk(int i) const {
+    return chunks_[i];
+  }
+  void push(int i) {
+    free_.push(i);
+  }
 
-  for (int i = 0; i < top_size; ++i) {
-    hdf_blobs_[i] = shared_ptr<Blob<Dtype> >(new Blob<Dtype>());
-    hdf5_load_nd_dataset(file_id, this->layer_param_.top(i).c_str(),
-        MIN_DATA_DIM, MAX_DATA_DIM, hdf_blobs_[i].get());
+ protected:
+  virtual void InternalThreadEntry() {
+    const HDF5DataParameter& param = param_.hdf5_data_param();
+    vector<int> files(filenames_.size());
+    for (int i = 0; i < files.size(); ++i) {
+      files[i] = i;
+    }
+    try {
+      while (!must_stop()) {
+        if (param.shuffle()) {
+          shuffle(files.begin(), files.end());
+        }
+        int chunks = 0;
+        for (int f = 0; f < files.size(); ++f) {
+          chunks += read_file(files[f]);
+          close_file();
+        }
+        CHECK_GT(chunks, 0) << "HDF5 files have no rows";
+        DLOG(INFO) << "Looping around to first file.";
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+      close_file();
+    }
   }
 
-  herr_t status = H5Fclose(file_id);
-  CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
+  // Queues the chunks of a file, returns their number
+  int read_file(int file) {
+    const HDF5DataParameter& param = param_.hdf5_data_param();
+    if (rows_[file] < 0) {
+      open_file(file);
+    }
+    const hsize_t rows = rows_[file];
+    const hsize_t chunk_size = param.chunk_size() ? param.chunk_size() : rows;
+    vector<hsize_t> begins;
+    for (hsize_t begin = 0; begin < rows; begin += chunk_size) {
+      begins.push_back(begin);
+    }
+    if (param.shuffle()) {
+      shuffle(begins.begin(), begins.end());
+    }
+    for (int i = 0; i < begins.size(); ++i) {
+      const int c = free_.pop();
+      Chunk& chunk = chunks_[c];
+      const hsize_t count = std::min(chunk_size, rows - begins[i]);
+      // Buffers are reused as is if they already hold the rows, e.g. when
+      // there are only two chunks overall.
+      if (chunk.file != file || chunk.begin != begins[i]) {
+        if (file_id_ < 0) {
+          open_file(file);
+        }
+        chunk.file = -1;
+        boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
+        chunk.blobs.resize(param_.top_size());
+        for (int j = 0; j < param_.top_size(); ++j) {
+          if (!chunk.blobs[j]) {
+            chunk.blobs[j].reset(new Blob<Dtype>());
+          }
+          hdf5_load_nd_dataset_rows(file_id_, param_.top(j).c_str(),
+              MIN_DATA_DIM, MAX_DATA_DIM, begins[i], count,
+              chunk.blobs[j].get());
+        }
+        chunk.file = file;
+        chunk.begin = begins[i];
+      }
+      chunk.permutation.resize(count);
+      for (int j = 0; j < count; ++j) {
+        chunk.permutation[j] = j;
+      }
+      if (param.shuffle()) {
+        shuffle(chunk.permutation.begin(), chunk.permutation.end());
+      }
+      full_.push(c);
+    }
+    return begins.size();
+  }
 
-  // MinTopBlobs==1 guarantees at least one top blob
-  CHECK_GE(hdf_blobs_[0]->num_axes(), 1) << "Input must have at least 1 axis.";
-  const int num = hdf_blobs_[0]->shape(0);
-  for (int i = 1; i < top_size; ++i) {
-    CHECK_EQ(hdf_blobs_[i]->shape(0), num);
+  void open_file(int file) {
+    const string& filename = filenames_[file];
+    DLOG(INFO) << "Loading HDF5 file: " << filename;
+    boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
+    file_id_ = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id_ < 0) {
+      LOG(FATAL) << "Failed opening HDF5 file: " << filename;
+    }
+    // MinTopBlobs==1 guarantees at least one top blob
+    const int num = hdf5_get_nd_dataset_shape(file_id_, param_.top(0).c_str(),
+        MIN_DATA_DIM, MAX_DATA_DIM)[0];
+    for (int i = 1; i < param_.top_size(); ++i) {
+      CHECK_EQ(hdf5_get_nd_dataset_shape(file_id_, param_.top(i).c_str(),
+          MIN_DATA_DIM, MAX_DATA_DIM)[0], num);
+    }
+    rows_[file] = num;
   }
-  // Default to identity permutation.
-  data_permutation_.clear();
-  data_permutation_.resize(hdf_blobs_[0]->shape(0));
-  for (int i = 0; i < hdf_blobs_[0]->shape(0); i++)
-    data_permutation_[i] = i;
-
-  // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0)
-               << " rows (shuffled)";
-  } else {
-    DLOG(INFO) << "Successully loaded " << hdf_blobs_[0]->shape(0) << " rows";
+
+  void close_file() {
+    if (file_id_ >= 0) {
+      boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
+      herr_t status = H5Fclose(file_id_);
+      CHECK_GE(status, 0) << "Failed to close HDF5 file";
+      file_id_ = -1;
+    }
   }
+
+  const LayerParameter param_;
+  const vector<string> filenames_;
+  vector<int64_t> rows_;  // Rows in each file, -1 until opened
+  vector<Chunk> chunks_;
+  hid_t file_id_;  // File being read, -1 if none
+  BlockingQueue<int> free_;
+  BlockingQueue<int> full_;
+};
+
+template <typename Dtype>
+HDF5DataLayer<Dtype>::~HDF5DataLayer<Dtype>() {
+  this->StopInternalThread();
 }
 
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+void HDF5DataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       const vector<Blob<Dtype>*>& top) {
   // Refuse transformation parameters since HDF5 is totally generic.
   CHECK(!this->layer_param_.has_transform_param()) <<
@@ -89,77 +196,92 @@ void HDF5DataLayer<Dtype>::LayerSetUp(const vector<Blob<Dtype>*>& bottom,
   }
   source_file.close();
   num_files_ = hdf_filenames_.size();
-  current_file_ = 0;
   LOG(INFO) << "Number of HDF5 files: " << num_files_;
   CHECK_GE(num_files_, 1) << "Must have at least 1 HDF5 filename listed in "
     << source;
 
-  file_permutation_.clear();
-  file_permutation_.resize(num_files_);
-  // Default to identity permutation.
-  for (int i = 0; i < num_files_; i++) {
-    file_permutation_[i] = i;
-  }
-
-  // Shuffle if needed.
-  if (this->layer_param_.hdf5_data_param().shuffle()) {
-    std::random_shuffle(file_permutation_.begin(), file_permutation_.end());
+  // Get the shapes of the rows from the first file, all files must agree.
+  const int top_size = this->layer_param_.top_size();
+  vector<vector<int> > shapes(top_size);
+  {
+    const char* filename = hdf_filenames_[0].c_str();
+    boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
+    hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file_id < 0) {
+      LOG(FATAL) << "Failed opening HDF5 file: " << filename;
+    }
+    for (int i = 0; i < top_size; ++i) {
+      shapes[i] = hdf5_get_nd_dataset_shape(file_id,
+          this->layer_param_.top(i).c_str(), MIN_DATA_DIM, MAX_DATA_DIM);
+    }
+    herr_t status = H5Fclose(file_id);
+    CHECK_GE(status, 0) << "Failed to close HDF5 file: " << filename;
   }
 
-  // Load the first HDF5 file and initialize the line counter.
-  LoadHDF5FileData(hdf_filenames_[file_permutation_[current_file_]].c_str());
-  current_row_ = 0;
-
   // Reshape blobs.
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  const int top_size = this->layer_param_.top_size();
-  vector<int> top_shape;
   for (int i = 0; i < top_size; ++i) {
-    top_shape.resize(hdf_blobs_[i]->num_axes());
-    top_shape[0] = batch_size;
-    for (int j = 1; j < top_shape.size(); ++j) {
-      top_shape[j] = hdf_blobs_[i]->shape(j);
+    shapes[i][0] = batch_size;
+    top[i]->Reshape(shapes[i]);
+  }
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    Batch<Dtype>* batch = this->prefetch_[i].get();
+    batch->data_.Reshape(shapes[0]);
+    if (top_size > 1) {
+      batch->label_.Reshape(shapes[1]);
+    }
+    batch->extra_.resize(std::max(top_size - 2, 0));
+    for (int j = 2; j < top_size; ++j) {
+      batch->extra_[j - 2].reset(new Blob<Dtype>(shapes[j]));
     }
-    top[i]->Reshape(top_shape);
   }
+
+  // Start reading the first chunks.
+  reader_.reset(new Reader(this->layer_param_, hdf_filenames_));
+  reader_->StartInternalThread();
+  current_chunk_ = -1;
+  current_row_ = 0;
 }
 
+// This function is called on prefetch thread
 template <typename Dtype>
-void HDF5DataLayer<Dtype>::Forward_cpu(const vector<Blob<Dtype>*>& bottom,
-      const vector<Blob<Dtype>*>& top) {
+void HDF5DataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
   const int batch_size = this->layer_param_.hdf5_data_param().batch_size();
-  for (int i = 0; i < batch_size; ++i, ++current_row_) {
-    if (current_row_ == hdf_blobs_[0]->shape(0)) {
-      if (num_files_ > 1) {
-        ++current_file_;
-        if (current_file_ == num_files_) {
-          current_file_ = 0;
-          if (this->layer_param_.hdf5_data_param().shuffle()) {
-            std::random_shuffle(file_permutation_.begin(),
-                                file_permutation_.end());
-          }
-          DLOG(INFO) << "Looping around to first file.";
-        }
-        LoadHDF5FileData(
-            hdf_filenames_[file_permutation_[current_file_]].c_str());
-      }
+  const int top_size = this->layer_param_.top_size();
+  vector<Blob<Dtype>*> blobs(top_size);
+  for (int j = 0; j < top_size; ++j) {
+    blobs[j] = j == 0 ? &batch->data_ :
+        j == 1 ? &batch->label_ : batch->extra_[j - 2].get();
+  }
+  for (int i = 0; i < batch_size; ) {
+    if (current_chunk_ < 0) {
+      current_chunk_ = reader_->pop();
       current_row_ = 0;
-      if (this->layer_param_.hdf5_data_param().shuffle())
-        std::random_shuffle(data_permutation_.begin(), data_permutation_.end());
     }
-    for (int j = 0; j < this->layer_param_.top_size(); ++j) {
-      int data_dim = top[j]->count() / top[j]->shape(0);
-      caffe_copy(data_dim,
-          &hdf_blobs_[j]->cpu_data()[data_permutation_[current_row_]
-            * data_dim], &top[j]->mutable_cpu_data()[i * data_dim]);
+    const typename Reader::Chunk& chunk = reader_->chunk(current_chunk_);
+    const vector<int>& permutation = chunk.permutation;
+    // Copy runs of consecutive rows at once, i.e. whole chunks when not
+    // shuffling
+    const int row = permutation[current_row_];
+    int run = 1;
+    while (i + run < batch_size && current_row_ + run < permutation.size() &&
+        permutation[current_row_ + run] == row + run) {
+      ++run;
+    }
+    for (int j = 0; j < top_size; ++j) {
+      const int data_dim = chunk.blobs[j]->count(1);
+      caffe_copy(run * data_dim, chunk.blobs[j]->cpu_data() + row * data_dim,
+          blobs[j]->mutable_cpu_data() + i * data_dim);
+    }
+    i += run;
+    current_row_ += run;
+    if (current_row_ == permutation.size()) {
+      reader_->push(current_chunk_);
+      current_chunk_ = -1;
     }
   }
 }
 
-#ifdef CPU_ONLY
-STUB_GPU_FORWARD(HDF5DataLayer, Forward);
-#endif
-
 INSTANTIATE_CLASS(HDF5DataLayer);
 REGISTER_LAYER_CLASS(HDF5Data);
 
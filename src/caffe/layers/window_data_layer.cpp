@@ -17,6 +17,7 @@
 #include "caffe/layers/base_data_layer.hpp"
 #include "caffe/layers/window_data_layer.hpp"
 #include "caffe/util/benchmark.hpp"
+#include "caffe/util/image_cache.hpp"
 #include "caffe/util/io.hpp"
 #include "caffe/util/math_functions.hpp"
 #include "caffe/util/rng.hpp"
@@ -63,6 +64,13 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
       << this->layer_param_.window_data_param().root_folder();
 
   cache_images_ = this->layer_param_.window_data_param().cache_images();
+  const ImageCacheParameter& cache_param =
+      this->layer_param_.window_data_param().image_cache();
+  if (cache_param.size_mb() > 0) {
+    image_cache_ = ImageCache::Shared(
+        this->layer_param_.window_data_param().source() + ":color",
+        cache_param);
+  }
   string root_folder = this->layer_param_.window_data_param().root_folder();
 
   const bool prefetch_needs_rand =
@@ -173,8 +181,8 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   CHECK_GT(crop_size, 0);
   const int batch_size = this->layer_param_.window_data_param().batch_size();
   top[0]->Reshape(batch_size, channels, crop_size, crop_size);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i)
-    this->prefetch_[i].data_.Reshape(
+  for (int i = 0; i < this->prefetch_.size(); ++i)
+    this->prefetch_[i]->data_.Reshape(
         batch_size, channels, crop_size, crop_size);
 
   LOG(INFO) << "output data size: " << top[0]->num() << ","
@@ -183,8 +191,8 @@ void WindowDataLayer<Dtype>::DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
   // label
   vector<int> label_shape(1, batch_size);
   top[1]->Reshape(label_shape);
-  for (int i = 0; i < this->PREFETCH_COUNT; ++i) {
-    this->prefetch_[i].label_.Reshape(label_shape);
+  for (int i = 0; i < this->prefetch_.size(); ++i) {
+    this->prefetch_[i]->label_.Reshape(label_shape);
   }
 
   // data mean
@@ -285,15 +293,21 @@ void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
           image_database_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
 
       cv::Mat cv_img;
-      if (this->cache_images_) {
-        pair<std::string, Datum> image_cached =
-          image_database_cache_[window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
-        cv_img = DecodeDatumToCVMat(image_cached.second, true);
-      } else {
-        cv_img = cv::imread(image.first, CV_LOAD_IMAGE_COLOR);
-        if (!cv_img.data) {
-          LOG(ERROR) << "Could not open or find file " << image.first;
-          return;
+      if (!this->image_cache_ ||
+          !this->image_cache_->Get(image.first, &cv_img)) {
+        if (this->cache_images_) {
+          pair<std::string, Datum> image_cached = image_database_cache_[
+              window[WindowDataLayer<Dtype>::IMAGE_INDEX]];
+          cv_img = DecodeDatumToCVMat(image_cached.second, true);
+        } else {
+          cv_img = cv::imread(image.first, CV_LOAD_IMAGE_COLOR);
+          if (!cv_img.data) {
+            LOG(ERROR) << "Could not open or find file " << image.first;
+            return;
+          }
+        }
+        if (this->image_cache_) {
+          this->image_cache_->Put(image.first, cv_img);
         }
       }
       read_time += timer.MicroSeconds();
@@ -389,9 +403,10 @@ void WindowDataLayer<Dtype>::load_batch(Batch<Dtype>* batch) {
         }
       }
 
+      // Warp to a new image, cv_img may be shared with the image cache
       cv::Rect roi(x1, y1, x2-x1+1, y2-y1+1);
-      cv::Mat cv_cropped_img = cv_img(roi);
-      cv::resize(cv_cropped_img, cv_cropped_img,
+      cv::Mat cv_cropped_img;
+      cv::resize(cv_img(roi), cv_cropped_img,
           cv_crop_size, 0, 0, cv::INTER_LINEAR);
 
       // horizontal flip at random
@@ -17,6 +17,7 @@
 #include "caffe/util/hdf5.hpp"
 #include "caffe/util/insert_splits.hpp"
 #include "caffe/util/math_functions.hpp"
+#include "caffe/util/trace.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
@@ -291,6 +292,9 @@ void Net<Dtype>::Init(const NetParameter& in_param) {
     layer_names_index_[layer_names_[layer_id]] = layer_id;
   }
   ShareWeights();
+  if (param.contiguous_params()) {
+    FlattenParams();
+  }
   debug_info_ = param.debug_info();
   LOG_IF(INFO, Caffe::root_solver()) << "Network initialization done.";
 }
@@ -558,6 +562,7 @@ Dtype Net<Dtype>::ForwardFromTo(int start, int end) {
   CHECK_LT(end, layers_.size());
   Dtype loss = 0;
   for (int i = start; i <= end; ++i) {
+    TraceScope trace(layer_names_[i], "forward");
     Dtype layer_loss = layers_[i]->Forward(bottom_vecs_[i], top_vecs_[i]); // 这个Forward在layer.hpp中实现
     loss += layer_loss;
     if (debug_info_) { ForwardDebugInfo(i); }
@@ -603,13 +608,25 @@ void Net<Dtype>::BackwardFromTo(int start, int end) {
   CHECK_LT(start, layers_.size());
   for (int i = start; i >= end; --i) {
     if (layer_need_backward_[i]) {
+      TraceScope trace(layer_names_[i], "backward");
       layers_[i]->Backward(
           top_vecs_[i], bottom_need_backward_[i], bottom_vecs_[i]);
       if (debug_info_) { BackwardDebugInfo(i); }
     }
+    for (int c = 0; c < after_backward_.size(); ++c) {
+      after_backward_[c]->run(i);
+    }
   }
 }
 
+template <typename Dtype>
+void Net<Dtype>::remove_after_backward(Callback* value) {
+  typename vector<Callback*>::iterator it =
+      std::find(after_backward_.begin(), after_backward_.end(), value);
+  CHECK(it != after_backward_.end()) << "Callback was not added";
+  after_backward_.erase(it);
+}
+
 template <typename Dtype>
 void Net<Dtype>::ForwardDebugInfo(const int layer_id) {
   for (int top_id = 0; top_id < top_vecs_[layer_id].size(); ++top_id) {
@@ -691,6 +708,16 @@ void Net<Dtype>::UpdateDebugInfo(const int param_id) {
 
 template <typename Dtype>
 void Net<Dtype>::ShareTrainedLayersWith(const Net* other) {
+  ShareOrCopyTrainedLayers(other, false);
+}
+
+template <typename Dtype>
+void Net<Dtype>::CopyTrainedLayersFrom(const Net* other) {
+  ShareOrCopyTrainedLayers(other, true);
+}
+
+template <typename Dtype>
+void Net<Dtype>::ShareOrCopyTrainedLayers(const Net* other, bool copy) {
   int num_source_layers = other->layers().size();
   for (int i = 0; i < num_source_layers; ++i) {
     Layer<Dtype>* source_layer = other->layers()[i].get();
@@ -712,11 +739,16 @@ void Net<Dtype>::ShareTrainedLayersWith(const Net* other) {
     for (int j = 0; j < target_blobs.size(); ++j) {
       Blob<Dtype>* source_blob = source_layer->blobs()[j].get();
       CHECK(target_blobs[j]->shape() == source_blob->shape())
-          << "Cannot share param " << j << " weights from layer '"
-          << source_layer_name << "'; shape mismatch.  Source param shape is "
+          << "Cannot " << (copy ? "copy" : "share") << " param " << j
+          << " weights from layer '" << source_layer_name
+          << "'; shape mismatch.  Source param shape is "
           << source_blob->shape_string() << "; target param shape is "
           << target_blobs[j]->shape_string();
-      target_blobs[j]->ShareData(*source_blob);
+      if (copy) {
+        target_blobs[j]->CopyFrom(*source_blob);
+      } else {
+        target_blobs[j]->ShareData(*source_blob);
+      }
     }
   }
 }
@@ -835,6 +867,7 @@ void Net<Dtype>::CopyTrainedLayersFromBinaryProto(
 
 template <typename Dtype>
 void Net<Dtype>::CopyTrainedLayersFromHDF5(const string trained_filename) {
+  boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fopen(trained_filename.c_str(), H5F_ACC_RDONLY,
                            H5P_DEFAULT);
   CHECK_GE(file_hid, 0) << "Couldn't open " << trained_filename;
@@ -909,6 +942,7 @@ void Net<Dtype>::ToProto(NetParameter* param, bool write_diff) const {
 
 template <typename Dtype>
 void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
+  boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT,
       H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
@@ -964,8 +998,45 @@ void Net<Dtype>::ToHDF5(const string& filename, bool write_diff) const {
   H5Fclose(file_hid);
 }
 
+template <typename Dtype>
+void Net<Dtype>::FlattenParams() {
+  CHECK(!flat_params_) << "Params of " << name_ << " already flattened";
+  // Ranges start on cache lines, the blob memory being allocated aligned
+  const int align = 64 / sizeof(Dtype);
+  vector<int> offsets(learnable_params_.size());
+  int count = 0;
+  for (int i = 0; i < learnable_params_.size(); ++i) {
+    offsets[i] = count;
+    count += (learnable_params_[i]->count() + align - 1) / align * align;
+  }
+  flat_params_.reset(new Blob<Dtype>(vector<int>(1, std::max(count, 1))));
+  Dtype* data = flat_params_->mutable_cpu_data();
+  Dtype* diff = flat_params_->mutable_cpu_diff();
+  caffe_set(flat_params_->count(), Dtype(0), data);
+  caffe_set(flat_params_->count(), Dtype(0), diff);
+  for (int i = 0; i < learnable_params_.size(); ++i) {
+    Blob<Dtype>* param = learnable_params_[i];
+    if (param->count() == 0) { continue; }
+    caffe_copy(param->count(), param->cpu_data(), data + offsets[i]);
+    caffe_copy(param->count(), param->cpu_diff(), diff + offsets[i]);
+    // Shared params hold the same memory as their owners, which are the
+    // learnable ones, so they become views too.
+    param->data()->set_cpu_data(data + offsets[i]);
+    param->diff()->set_cpu_data(diff + offsets[i]);
+  }
+  LOG_IF(INFO, Caffe::root_solver()) << "Learnable params flattened into "
+      << count << " values (" << count * sizeof(Dtype) << " bytes) for data "
+      << "and diffs each";
+}
+
 template <typename Dtype>
 void Net<Dtype>::Update() {
+  if (flat_params_ && Caffe::mode() == Caffe::CPU) {
+    // The padding is zero in both buffers, and remains so
+    caffe_axpy(flat_params_->count(), Dtype(-1), flat_params_->cpu_diff(),
+        flat_params_->mutable_cpu_data());
+    return;
+  }
   for (int i = 0; i < learnable_params_.size(); ++i) {
     learnable_params_[i]->Update();
   }
@@ -973,6 +1044,11 @@ void Net<Dtype>::Update() {
 
 template <typename Dtype>
 void Net<Dtype>::ClearParamDiffs() {
+  if (flat_params_ && Caffe::mode() == Caffe::CPU) {
+    caffe_set(flat_params_->count(), static_cast<Dtype>(0),
+        flat_params_->mutable_cpu_diff());
+    return;
+  }
   for (int i = 0; i < learnable_params_.size(); ++i) {
     Blob<Dtype>* blob = learnable_params_[i];
     switch (Caffe::mode()) {
@@ -4,6 +4,7 @@
 #include <glog/logging.h>
 #include <stdio.h>
 
+#include <algorithm>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -11,6 +12,7 @@
 #include "boost/thread.hpp"
 #include "caffe/caffe.hpp"
 #include "caffe/parallel.hpp"
+#include "caffe/util/trace.hpp"
 
 namespace caffe {
 
@@ -436,8 +438,260 @@ void P2PSync<Dtype>::Run(const vector<int>& gpus) {
   }
 }
 
+// Reduces the buckets of gradients of a replica as backward signals them
+template<typename Dtype>
+class CPUSync<Dtype>::Reducer : public InternalThread {
+ public:
+  explicit Reducer(CPUSync<Dtype>* sync)
+      : sync_(sync) {
+  }
+  virtual ~Reducer() {
+    StopInternalThread();
+  }
+
+  BlockingQueue<int> ready_;  // Buckets final on this replica
+  BlockingQueue<int> done_;   // Once per pass, after the last bucket
+
+ protected:
+  virtual void InternalThreadEntry() {
+    CPUSync<Dtype>* root = sync_->root_ ? sync_->root_ : sync_;
+    const vector<Bucket>& buckets = root->buckets_;
+    try {
+      while (!must_stop()) {
+        const int b = ready_.pop();
+        // Wait for the bucket to be final on all replicas
+        root->reducer_barrier_->wait();
+        sync_->Reduce(buckets[b].begin, buckets[b].end);
+        if (b == static_cast<int>(buckets.size()) - 1) {
+          done_.push(b);
+        }
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  CPUSync<Dtype>* sync_;
+};
+
+template<typename Dtype>
+CPUSync<Dtype>::CPUSync(shared_ptr<Solver<Dtype> > root_solver,
+                        CPUSync<Dtype>* root, int rank)
+    : root_(root),
+      rank_(rank),
+      initial_iter_(root_solver->iter()),
+      solver_(),
+      next_bucket_(0) {
+  CHECK(Caffe::mode() == Caffe::CPU);
+  if (root == NULL) {
+    solver_ = root_solver;
+  } else {
+    Caffe::set_root_solver(false);
+    solver_.reset(new WorkerSolver<Dtype>(root_solver->param(),
+        root_solver.get()));
+    Caffe::set_root_solver(true);
+  }
+  Net<Dtype>* net = solver_->net().get();
+  if (!net->flat_params()) {
+    net->FlattenParams();
+  }
+  Blob<Dtype>* flat = net->flat_params().get();
+  size_ = flat->count();
+  diff_ = flat->mutable_cpu_diff();
+  const vector<Blob<Dtype>*>& params = net->learnable_params();
+  const vector<float>& params_lr = net->params_lr();
+  for (int i = 0; i < params.size(); ++i) {
+    if (params[i]->count() && params_lr[i] == 0) {
+      state_params_.push_back(i);
+    }
+  }
+  if (root == NULL) {
+    data_ = flat->mutable_cpu_data();
+  } else {
+    // Nets have the same layout, point the learned params at the root's
+    // values
+    CHECK_EQ(size_, root->size_);
+    data_ = root->data_;
+    const Dtype* own = flat->cpu_data();
+    for (int i = 0; i < params.size(); ++i) {
+      if (params[i]->count() && params_lr[i] != 0) {
+        params[i]->data()->set_cpu_data(data_ + (params[i]->cpu_data() - own));
+      }
+    }
+  }
+  solver_->add_callback(this);
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::InternalThreadEntry() {
+  CHECK(Caffe::root_solver());
+  Caffe::set_root_solver(false);
+  // Same as for P2PSync, replicas must not all have the same seed
+  if (solver_->param().random_seed() >= 0) {
+    Caffe::set_random_seed(solver_->param().random_seed() + rank_);
+  }
+  solver_->Step(solver_->param().max_iter() - initial_iter_);
+}
+
+template<typename Dtype>
+int CPUSync<Dtype>::MakeBuckets(size_t bucket_size) {
+  const Net<Dtype>& net = *solver_->net();
+  const vector<shared_ptr<Layer<Dtype> > >& layers = net.layers();
+  const Dtype* flat = net.flat_params()->cpu_diff();
+  // Params are in the flat buffer in the order of the layers first using
+  // them, find the range of each layer.
+  vector<size_t> begins(layers.size()), ends(layers.size());
+  size_t end = 0;
+  for (int i = 0; i < layers.size(); ++i) {
+    begins[i] = end;
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = layers[i]->blobs();
+    for (int j = 0; j < blobs.size(); ++j) {
+      if (blobs[j]->count()) {
+        const size_t offset = blobs[j]->cpu_diff() - flat;
+        end = std::max(end, offset + blobs[j]->count());
+      }
+    }
+    ends[i] = end;
+  }
+  // Buckets go from the end of the buffer, ready first
+  buckets_.clear();
+  Bucket bucket;
+  bucket.end = size_;
+  for (int i = layers.size() - 1; i >= 0; --i) {
+    if (begins[i] == ends[i]) { continue; }
+    bucket.layer = i;
+    bucket.begin = begins[i];
+    if ((bucket.end - bucket.begin) * sizeof(Dtype) >= bucket_size ||
+        bucket.begin == 0) {
+      buckets_.push_back(bucket);
+      bucket.end = bucket.begin;
+    }
+  }
+  return buckets_.size();
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::Reduce(size_t begin, size_t end) {
+  TraceScope trace("Reduce", "sync");
+  CPUSync<Dtype>* root = root_ ? root_ : this;
+  const vector<CPUSync<Dtype>*>& replicas = root->replicas_;
+  // Each replica sums a range of cache lines
+  const int replica_count = replicas.size();
+  const size_t align = 64 / sizeof(Dtype);
+  const size_t range = (end - begin + replica_count * align - 1) /
+      (replica_count * align) * align;
+  begin = std::min(end, begin + rank_ * range);
+  end = std::min(end, begin + range);
+  Dtype* dst = root->diff_ + begin;
+  for (int i = 1; i < replica_count; ++i) {
+    caffe_axpy<Dtype>(end - begin, Dtype(1), replicas[i]->diff_ + begin, dst);
+  }
+  // Loss functions divide gradients by the batch size, so to compensate
+  // for split batch, the gradients are divided by the number of replicas.
+  caffe_scal<Dtype>(end - begin, Dtype(1) / replica_count, dst);
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::on_start() {
+  // Wait for the root to have updated the params
+  CPUSync<Dtype>* root = root_ ? root_ : this;
+  next_bucket_ = 0;
+  root->barrier_->wait();
+  if (state_params_.empty()) {
+    return;
+  }
+  // Copy the root's state before its forward changes it
+  if (root_) {
+    const vector<Blob<Dtype>*>& params = solver_->net()->learnable_params();
+    const vector<Blob<Dtype>*>& root_params =
+        root->solver_->net()->learnable_params();
+    for (int i = 0; i < state_params_.size(); ++i) {
+      const int id = state_params_[i];
+      caffe_copy(params[id]->count(), root_params[id]->cpu_data(),
+          params[id]->mutable_cpu_data());
+    }
+  }
+  root->barrier_->wait();
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::run(int layer) {
+  CPUSync<Dtype>* root = root_ ? root_ : this;
+  if (next_bucket_ < static_cast<int>(root->buckets_.size()) &&
+      root->buckets_[next_bucket_].layer == layer) {
+    reducer_->ready_.push(next_bucket_++);
+  }
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::on_gradients_ready() {
+  CPUSync<Dtype>* root = root_ ? root_ : this;
+  if (reducer_) {
+    reducer_->done_.pop();
+  } else {
+    root->barrier_->wait();
+    Reduce(0, size_);
+  }
+  // Replicas must not clear their gradients before all ranges are summed
+  root->barrier_->wait();
+}
+
+template<typename Dtype>
+void CPUSync<Dtype>::Run(int replicas, size_t bucket_size) {
+  CHECK(root_ == NULL) << "Run must be called on the root";
+  CHECK_GE(replicas, 1);
+  // Pruning keeps the state of its layers in process-wide globals
+  CHECK(replicas == 1 || solver_->param().prune_method() == "None")
+      << "Pruning is not supported with several CPU replicas.";
+  replicas_.push_back(this);
+  for (int i = 1; i < replicas; ++i) {
+    workers_.push_back(shared_ptr<CPUSync<Dtype> >(
+        new CPUSync<Dtype>(solver_, this, i)));
+    replicas_.push_back(workers_.back().get());
+  }
+  barrier_.reset(new boost::barrier(replicas));
+
+  // Gradients accumulated over several passes are only final after the last
+  if (bucket_size && solver_->param().iter_size() == 1 && MakeBuckets(
+      bucket_size)) {
+    LOG(INFO) << "Reducing gradients in " << buckets_.size() << " buckets";
+    reducer_barrier_.reset(new boost::barrier(replicas));
+    for (int i = 0; i < replicas; ++i) {
+      CPUSync<Dtype>* replica = replicas_[i];
+      replica->reducer_.reset(new Reducer(replica));
+      replica->solver_->net()->add_after_backward(replica);
+      replica->reducer_->StartInternalThread();
+    }
+  }
+
+  LOG(INFO)<< "Starting Optimization on " << replicas << " CPU replicas";
+
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->StartInternalThread();
+  }
+  // Starting threads draws their seeds from the root's generator, reset it
+  // so that a seeded run does not depend on the number of reducers
+  if (solver_->param().random_seed() >= 0) {
+    Caffe::set_random_seed(solver_->param().random_seed());
+  }
+
+  // Run root solver on current thread
+  solver_->Solve();
+
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->StopInternalThread();
+  }
+  for (int i = 0; i < replicas; ++i) {
+    if (replicas_[i]->reducer_) {
+      replicas_[i]->solver_->net()->remove_after_backward(replicas_[i]);
+    }
+    replicas_[i]->reducer_.reset();
+  }
+}
+
 INSTANTIATE_CLASS(Params);
 INSTANTIATE_CLASS(GPUParams);
 INSTANTIATE_CLASS(P2PSync);
+INSTANTIATE_CLASS(CPUSync);
 
 }  // namespace caffe
@@ -1,12 +1,18 @@
+#include <boost/thread.hpp>
+
 #include <cstdio>
 
 #include <string>
 #include <vector>
 
+#include "caffe/internal_thread.hpp"
 #include "caffe/solver.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/format.hpp"
 #include "caffe/util/hdf5.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
+#include "caffe/util/trace.hpp"
 #include "caffe/util/upgrade_proto.hpp"
 #include "caffe/adaptive_probabilistic_pruning.hpp"
 #include <ctime>
@@ -30,7 +36,8 @@ SolverAction::Enum Solver<Dtype>::GetRequestedAction() {
 template <typename Dtype>
 Solver<Dtype>::Solver(const SolverParameter& param, const Solver* root_solver)
     : net_(), callbacks_(), root_solver_(root_solver),
-      requested_early_exit_(false) {
+      requested_early_exit_(false), early_exit_mutex_(new boost::mutex()),
+      snapshots_since_base_(0) {
   Init(param);
 }
 
@@ -38,7 +45,8 @@ template <typename Dtype>
 // construct solver with param_file
 Solver<Dtype>::Solver(const string& param_file, const Solver* root_solver)
     : net_(), callbacks_(), root_solver_(root_solver),
-      requested_early_exit_(false) {
+      requested_early_exit_(false), early_exit_mutex_(new boost::mutex()),
+      snapshots_since_base_(0) {
   SolverParameter param;
   ReadSolverParamsFromTextFileOrDie(param_file, &param);
   Init(param);
@@ -54,27 +62,34 @@ void Solver<Dtype>::Init(const SolverParameter& param) {
   
   // ------------------------------------------
   // WANGHUAN, copy prune params
-  APP::prune_method = param_.prune_method();
-  APP::criteria = param_.criteria();
-  APP::num_once_prune = param_.num_once_prune();
-  APP::prune_interval_begin = param_.prune_interval_begin();
-  APP::prune_interval_end = param_.prune_interval_end();
-  APP::prune_iter_begin = param_.prune_iter_begin();
-  APP::prune_iter_end = param_.prune_iter_end();
+  // Worker solvers have the same params, the root solver set them already.
+  if (Caffe::root_solver()) {
+    APP::prune_method = param_.prune_method();
+    APP::criteria = param_.criteria();
+    APP::num_once_prune = param_.num_once_prune();
+    APP::prune_interval_begin = param_.prune_interval_begin();
+    APP::prune_interval_end = param_.prune_interval_end();
+    APP::prune_iter_begin = param_.prune_iter_begin();
+    APP::prune_iter_end = param_.prune_iter_end();
   
-  /// APP::range = param_.range();
-  APP::rgamma = param_.rgamma();
-  APP::rpower = param_.rpower();
-  APP::cgamma = param_.cgamma();
-  APP::cpower = param_.cpower();
-  APP::iter_size = param_.iter_size();
-  //APP::recover_multiplier = param_.recover_multiplier();
+    /// APP::range = param_.range();
+    APP::rgamma = param_.rgamma();
+    APP::rpower = param_.rpower();
+    APP::cgamma = param_.cgamma();
+    APP::cpower = param_.cpower();
+    APP::iter_size = param_.iter_size();
+    //APP::recover_multiplier = param_.recover_multiplier();
   
-  // APP::score_decay = param_.score_decay();
-  APP::num_log = 50; //param_.num_log();  
+    // APP::score_decay = param_.score_decay();
+    APP::num_log = 50; //param_.num_log();  
+  }
   // ------------------------------------------
 
   CHECK_GE(param_.average_loss(), 1) << "average_loss should be non-negative.";
+  // Pruning keeps the state of its layers in process-wide globals, which
+  // the test nets would read while training updates them
+  CHECK(!param_.async_test() || param_.prune_method() == "None")
+      << "async_test is not supported with pruning.";
 
   CheckSnapshotWritePermissions();
   if (Caffe::root_solver() && param_.random_seed() >= 0) {
@@ -235,15 +250,19 @@ void Solver<Dtype>::Step(int iters) {
     if (param_.test_interval() && iter_ % param_.test_interval() == 0
         && (iter_ > 0 || param_.test_initialization())
         && Caffe::root_solver()) {
+      TraceScope trace("TestAll", "solver");
       TestAll();
-      if (requested_early_exit_) {
+      if (requested_early_exit()) {
         // Break out of the while loop because stop was requested while testing.
         break;
       }
     }
     // cout << "call_backs_.size(): " << callbacks_.size() << endl; // WANGHUAN, 0, why?
-    for (int i = 0; i < callbacks_.size(); ++i) {
-      callbacks_[i]->on_start();
+    {
+      TraceScope trace("on_start", "sync");
+      for (int i = 0; i < callbacks_.size(); ++i) {
+        callbacks_[i]->on_start();
+      }
     }
     const bool display = param_.display() && iter_ % param_.display() == 0;
     net_->set_debug_info(display && param_.debug_info());
@@ -252,14 +271,19 @@ void Solver<Dtype>::Step(int iters) {
 
     /// ----------------------------------------------------------------------
     /// WANGHUAN added, for iterative pruning
-    APP::step_ = iter_ + 1;
-    std::cout << "\n**** Step " << APP::step_ << " ****" << std::endl;
+    /// The pruning state is process-wide, only the root solver keeps it
+    /// when data-parallel.
+    const bool root_solver = Caffe::root_solver();
+    if (root_solver) {
+      APP::step_ = iter_ + 1;
+      std::cout << "\n**** Step " << APP::step_ << " ****" << std::endl;
+      APP::inner_iter = 0;
+    }
     /// ----------------------------------------------------------------------
     
-    APP::inner_iter = 0;
     for (int i = 0; i < param_.iter_size(); ++i) {
       loss += net_->ForwardBackward();
-      ++ APP::inner_iter;
+      if (root_solver) { ++ APP::inner_iter; }
     }
 
     loss /= param_.iter_size();
@@ -270,9 +294,11 @@ void Solver<Dtype>::Step(int iters) {
     /// WANGHUAN, used for Adaptive SPP
     /// APP::Delta_loss_history =  APP::Delta_loss_history * APP::loss_decay + (smoothed_loss_ - APP::loss);
     /// APP::Delta_loss_history =  smoothed_loss_ - APP::loss;
-    APP::learning_speed = APP::loss - smoothed_loss_;
-    APP::loss = smoothed_loss_;
-    cout << "learning_speed: " << APP::learning_speed << endl;
+    if (root_solver) {
+      APP::learning_speed = APP::loss - smoothed_loss_;
+      APP::loss = smoothed_loss_;
+      cout << "learning_speed: " << APP::learning_speed << endl;
+    }
     /// ----------------------------------------------------------------------
 
     if (display) {
@@ -298,10 +324,16 @@ void Solver<Dtype>::Step(int iters) {
         }
       }
     }
-    for (int i = 0; i < callbacks_.size(); ++i) {
-      callbacks_[i]->on_gradients_ready();
+    {
+      TraceScope trace("on_gradients_ready", "sync");
+      for (int i = 0; i < callbacks_.size(); ++i) {
+        callbacks_[i]->on_gradients_ready();
+      }
+    }
+    {
+      TraceScope trace("ApplyUpdate", "solver");
+      ApplyUpdate(); /// Virtual Function
     }
-    ApplyUpdate(); /// Virtual Function
 
     // Increment the internal iter_ counter -- its value should always indicate
     // the number of times the weights have been updated.
@@ -317,7 +349,7 @@ void Solver<Dtype>::Step(int iters) {
       Snapshot();
     }
     if (SolverAction::STOP == request) {
-      requested_early_exit_ = true;
+      set_requested_early_exit(true);
       // Break out of training loop.
       break;
     }
@@ -331,7 +363,7 @@ void Solver<Dtype>::Solve(const char* resume_file) {
   LOG(INFO) << "Learning Rate Policy: " << param_.lr_policy();
 
   // Initialize to false every time we start solving.
-  requested_early_exit_ = false;
+  set_requested_early_exit(false);
 
   if (resume_file) {
     LOG(INFO) << "Restoring previous solver status from " << resume_file;
@@ -344,13 +376,17 @@ void Solver<Dtype>::Solve(const char* resume_file) {
   Step(param_.max_iter() - iter_);
 
   // If we haven't already, save a snapshot after optimization, unless
-  // overridden by setting snapshot_after_train := false
+  // overridden by setting snapshot_after_train := false. It is in full, with
+  // the .caffemodel, even if the last periodic one was a delta.
   if (param_.snapshot_after_train()
-      && (!param_.snapshot() || iter_ % param_.snapshot() != 0)) {
-    Snapshot();
+      && (!param_.snapshot() || iter_ % param_.snapshot() != 0
+          || snapshots_since_base_ > 1)) {
+    SnapshotFull();
   }
-  if (requested_early_exit_) {
+  if (requested_early_exit()) {
     if (APP::num_log) { Logshot(); }
+    if (snapshot_writer_) { snapshot_writer_->Wait(); }
+    WaitForTests();
     LOG(INFO) << "Optimization stopped early.";
     
     return;
@@ -374,19 +410,86 @@ void Solver<Dtype>::Solve(const char* resume_file) {
     TestAll();
   }
   if (APP::num_log) { Logshot(); }
+  if (snapshot_writer_) { snapshot_writer_->Wait(); }
+  WaitForTests();
   LOG(INFO) << "Optimization Done.";
 }
 
+template <typename Dtype>
+class Solver<Dtype>::Tester : public InternalThread {
+ public:
+  explicit Tester(Solver<Dtype>* solver)
+      : solver_(solver) {
+    idle_.push(0);
+  }
+  virtual ~Tester() {
+    StopInternalThread();
+  }
+
+  // Iterations to test at, one at a time
+  BlockingQueue<int> iters_;
+  BlockingQueue<int> idle_;
+
+ protected:
+  virtual void InternalThreadEntry() {
+    try {
+      while (!must_stop()) {
+        const int iter = iters_.pop();
+        for (int i = 0; i < solver_->test_nets_.size() &&
+            !solver_->requested_early_exit(); ++i) {
+          LOG(INFO) << "Iteration " << iter << ", Testing net (#" << i
+              << ") in the background";
+          solver_->Evaluate(i, iter, false);
+        }
+        idle_.push(0);
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  Solver<Dtype>* solver_;
+};
+
 template <typename Dtype>
 void Solver<Dtype>::TestAll() {
+  if (param_.async_test()) {
+    if (!tester_) {
+      // Starting the thread draws its seed from the solver's generator,
+      // restore it so that training does not depend on async tests
+      const rng_t state = *caffe_rng();
+      tester_.reset(new Tester(this));
+      tester_->StartInternalThread();
+      *caffe_rng() = state;
+    }
+    // The test nets get their own copy of the params once idle
+    tester_->idle_.pop("Waiting for the previous test");
+    for (int test_net_id = 0; test_net_id < test_nets_.size(); ++test_net_id) {
+      test_nets_[test_net_id]->CopyTrainedLayersFrom(net_.get());
+    }
+    tester_->iters_.push(iter_);
+    return;
+  }
   for (int test_net_id = 0;
-       test_net_id < test_nets_.size() && !requested_early_exit_;
+       test_net_id < test_nets_.size() && !requested_early_exit();
        ++test_net_id) {
     Test(test_net_id);
   }
   
 }
 
+template <typename Dtype>
+bool Solver<Dtype>::requested_early_exit() const {
+  boost::mutex::scoped_lock lock(*early_exit_mutex_);
+  return requested_early_exit_;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::set_requested_early_exit(bool requested) {
+  boost::mutex::scoped_lock lock(*early_exit_mutex_);
+  requested_early_exit_ = requested;
+}
+
 template <typename Dtype>
 void Solver<Dtype>::Test(const int test_net_id) {
   CHECK(Caffe::root_solver());  
@@ -395,22 +498,29 @@ void Solver<Dtype>::Test(const int test_net_id) {
             << ", Testing net (#" << test_net_id << ")";
   CHECK_NOTNULL(test_nets_[test_net_id].get())->
       ShareTrainedLayersWith(net_.get());
+  Evaluate(test_net_id, iter_, true);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::Evaluate(const int test_net_id, const int iter,
+    bool handle_requests) {
   vector<Dtype> test_score;
   vector<int> test_score_output_id;
   const shared_ptr<Net<Dtype> >& test_net = test_nets_[test_net_id];
   Dtype loss = 0;
   for (int i = 0; i < param_.test_iter(test_net_id); ++i) {
-    SolverAction::Enum request = GetRequestedAction();
+    SolverAction::Enum request =
+        handle_requests ? GetRequestedAction() : SolverAction::NONE;
     // Check to see if stoppage of testing/training has been requested.
     while (request != SolverAction::NONE) {
         if (SolverAction::SNAPSHOT == request) {
           Snapshot();
         } else if (SolverAction::STOP == request) {
-          requested_early_exit_ = true;
+          set_requested_early_exit(true);
         }
         request = GetRequestedAction();
     }
-    if (requested_early_exit_) {
+    if (requested_early_exit()) {
       // break out of test loop.
       break;
     }
@@ -439,13 +549,18 @@ void Solver<Dtype>::Test(const int test_net_id) {
       }
     }
   }
-  if (requested_early_exit_) {
+  if (requested_early_exit()) {
     LOG(INFO) << "Test interrupted.";
     return;
   }
+  // Background tests interleave with training, name the iteration
+  ostringstream iter_msg_stream;
+  if (!handle_requests) {
+    iter_msg_stream << " (iteration " << iter << ")";
+  }
   if (param_.test_compute_loss()) {
     loss /= param_.test_iter(test_net_id);
-    LOG(INFO) << "Test loss: " << loss;
+    LOG(INFO) << "Test loss: " << loss << iter_msg_stream.str();
   }
   for (int i = 0; i < test_score.size(); ++i) {
     const int output_blob_index =
@@ -459,13 +574,35 @@ void Solver<Dtype>::Test(const int test_net_id) {
                       << " = " << loss_weight * mean_score << " loss)";
     }
     LOG(INFO) << "    Test net output #" << i << ": " << output_name << " = "
-              << mean_score << loss_msg_stream.str();
+              << mean_score << loss_msg_stream.str() << iter_msg_stream.str();
+  }
+}
+
+template <typename Dtype>
+void Solver<Dtype>::WaitForTests() {
+  if (tester_) {
+    tester_->idle_.pop("Waiting for tests");
+    tester_->idle_.push(0);
   }
 }
 
 template <typename Dtype>
 void Solver<Dtype>::Snapshot() {
   CHECK(Caffe::root_solver());
+  TraceScope trace("Snapshot", "solver");
+  const bool incremental = param_.incremental_snapshot() &&
+      param_.snapshot_format() ==
+      caffe::SolverParameter_SnapshotFormat_BINARYPROTO;
+  if (incremental && !snapshot_base_file_.empty() &&
+      snapshots_since_base_ < param_.snapshot_base_interval()) {
+    SnapshotDelta();
+    return;
+  }
+  SnapshotFull();
+}
+
+template <typename Dtype>
+void Solver<Dtype>::SnapshotFull() {
   string model_filename;
   switch (param_.snapshot_format()) {
   case caffe::SolverParameter_SnapshotFormat_BINARYPROTO:
@@ -479,6 +616,150 @@ void Solver<Dtype>::Snapshot() {
   }
 
   SnapshotSolverState(model_filename);
+  if (param_.incremental_snapshot() && param_.snapshot_format() ==
+      caffe::SolverParameter_SnapshotFormat_BINARYPROTO) {
+    SetSnapshotBase(SnapshotFilename(".solverstate"));
+  }
+}
+
+// Incremental snapshots store blobs as their words XORed with the base ones,
+// in runs of zero words, i.e. unchanged values, and of other words.
+template <int size> struct DeltaWord;
+template <> struct DeltaWord<4> { typedef uint32_t type; };
+template <> struct DeltaWord<8> { typedef uint64_t type; };
+
+static void AppendVarint(uint64_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+static uint64_t ReadVarint(const string& in, size_t* pos) {
+  uint64_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    CHECK_LT(*pos, in.size()) << "Truncated snapshot delta";
+    const uint8_t byte = in[(*pos)++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+template <typename Word>
+static void EncodeDelta(const Word* values, const Word* base, int count,
+    string* out) {
+  for (int i = 0; i < count; ) {
+    int zeros = 0;
+    while (i + zeros < count && values[i + zeros] == base[i + zeros]) {
+      ++zeros;
+    }
+    i += zeros;
+    int others = 0;
+    while (i + others < count && values[i + others] != base[i + others]) {
+      ++others;
+    }
+    AppendVarint(zeros, out);
+    AppendVarint(others, out);
+    for (int j = 0; j < others; ++j, ++i) {
+      const Word word = values[i] ^ base[i];
+      out->append(reinterpret_cast<const char*>(&word), sizeof(word));
+    }
+  }
+}
+
+template <typename Word>
+static void DecodeDelta(const string& in, int count, Word* values) {
+  size_t pos = 0;
+  for (int i = 0; i < count; ) {
+    i += ReadVarint(in, &pos);
+    const uint64_t others = ReadVarint(in, &pos);
+    CHECK_LE(i + others, count) << "Snapshot delta does not fit its blob";
+    CHECK_LE(pos + others * sizeof(Word), in.size())
+        << "Truncated snapshot delta";
+    for (int j = 0; j < others; ++j, ++i) {
+      Word word;
+      memcpy(&word, in.data() + pos, sizeof(word));
+      values[i] ^= word;
+      pos += sizeof(word);
+    }
+  }
+  CHECK_EQ(pos, in.size()) << "Snapshot delta does not fit its blob";
+}
+
+template <typename Dtype>
+void Solver<Dtype>::SnapshotBlobs(vector<Blob<Dtype>*>* blobs) {
+  *blobs = net_->learnable_params();
+  AppendStateBlobs(blobs);
+}
+
+template <typename Dtype>
+void Solver<Dtype>::SetSnapshotBase(const string& state_file) {
+  vector<Blob<Dtype>*> blobs;
+  SnapshotBlobs(&blobs);
+  snapshot_base_.resize(blobs.size());
+  for (int i = 0; i < blobs.size(); ++i) {
+    if (!snapshot_base_[i]) {
+      snapshot_base_[i].reset(new Blob<Dtype>());
+    }
+    snapshot_base_[i]->CopyFrom(*blobs[i], false, true);
+  }
+  snapshot_base_file_ = state_file;
+  snapshots_since_base_ = 1;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::SnapshotDelta() {
+  typedef typename DeltaWord<sizeof(Dtype)>::type Word;
+  vector<Blob<Dtype>*> blobs;
+  SnapshotBlobs(&blobs);
+  CHECK_EQ(blobs.size(), snapshot_base_.size());
+  shared_ptr<DeltaSnapshot> delta(new DeltaSnapshot());
+  delta->set_base(snapshot_base_file_);
+  delta->set_iter(iter_);
+  delta->set_current_step(current_step_);
+  for (int i = 0; i < blobs.size(); ++i) {
+    const int count = blobs[i]->count();
+    CHECK_EQ(count, snapshot_base_[i]->count());
+    const Dtype* values = blobs[i]->cpu_data();
+    const Dtype* base = snapshot_base_[i]->cpu_data();
+    // Frozen params do not change at all
+    if (memcmp(values, base, count * sizeof(Dtype)) == 0) {
+      continue;
+    }
+    delta->add_blob(i);
+    EncodeDelta(reinterpret_cast<const Word*>(values),
+        reinterpret_cast<const Word*>(base), count, delta->add_delta());
+  }
+  const string filename = SnapshotFilename(".solverstate.delta");
+  LOG(INFO) << "Snapshotting " << delta->blob_size() << " of " << blobs.size()
+      << " blobs changed since " << snapshot_base_file_ << " to "
+      << filename;
+  SnapshotProto(delta, filename);
+  ++snapshots_since_base_;
+}
+
+template <typename Dtype>
+void Solver<Dtype>::RestoreDelta(const string& state_file) {
+  typedef typename DeltaWord<sizeof(Dtype)>::type Word;
+  DeltaSnapshot delta;
+  ReadProtoFromBinaryFileOrDie(state_file, &delta);
+  CHECK_EQ(delta.blob_size(), delta.delta_size());
+  Restore(delta.base().c_str());
+  vector<Blob<Dtype>*> blobs;
+  SnapshotBlobs(&blobs);
+  for (int i = 0; i < delta.blob_size(); ++i) {
+    const int blob = delta.blob(i);
+    CHECK_GE(blob, 0);
+    CHECK_LT(blob, blobs.size()) << "Snapshot delta " << state_file
+        << " does not match the net";
+    DecodeDelta(delta.delta(i), blobs[blob]->count(),
+        reinterpret_cast<Word*>(blobs[blob]->mutable_cpu_data()));
+  }
+  iter_ = delta.iter();
+  current_step_ = delta.current_step();
 }
 
 template <typename Dtype>
@@ -580,12 +861,28 @@ template <typename Dtype>
 string Solver<Dtype>::SnapshotToBinaryProto() {
   string model_filename = SnapshotFilename(".caffemodel");
   LOG(INFO) << "Snapshotting to binary proto file " << model_filename;
-  NetParameter net_param;
-  net_->ToProto(&net_param, param_.snapshot_diff());
-  WriteProtoToBinaryFile(net_param, model_filename);
+  shared_ptr<NetParameter> net_param(new NetParameter());
+  net_->ToProto(net_param.get(), param_.snapshot_diff());
+  SnapshotProto(net_param, model_filename);
   return model_filename;
 }
 
+template <typename Dtype>
+void Solver<Dtype>::SnapshotProto(
+    const shared_ptr<google::protobuf::Message>& proto,
+    const string& filename) {
+  if (!param_.async_snapshot()) {
+    WriteProtoToBinaryFile(*proto, filename);
+    return;
+  }
+  if (!snapshot_writer_) {
+    // Each snapshot is a model and a solver state
+    snapshot_writer_.reset(new SnapshotWriter(
+        2 * param_.max_pending_snapshots()));
+  }
+  snapshot_writer_->Write(proto, filename);
+}
+
 template <typename Dtype>
 string Solver<Dtype>::SnapshotToHDF5() {
   string model_filename = SnapshotFilename(".caffemodel.h5");
@@ -598,11 +895,18 @@ template <typename Dtype>
 void Solver<Dtype>::Restore(const char* state_file) {
   CHECK(Caffe::root_solver());
   string state_filename(state_file);
-  if (state_filename.size() >= 3 &&
+  if (state_filename.size() >= 6 &&
+      state_filename.compare(state_filename.size() - 6, 6, ".delta") == 0) {
+    RestoreDelta(state_filename);
+  } else if (state_filename.size() >= 3 &&
       state_filename.compare(state_filename.size() - 3, 3, ".h5") == 0) {
     RestoreSolverStateFromHDF5(state_filename);
   } else {
     RestoreSolverStateFromBinaryProto(state_filename);
+    // Later snapshots can be deltas of this one
+    if (param_.incremental_snapshot()) {
+      SetSnapshotBase(state_filename);
+    }
   }
 }
 
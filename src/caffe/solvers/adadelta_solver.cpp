@@ -106,6 +106,36 @@ void AdaDeltaSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
   }
 }
 
+template <typename Dtype>
+void AdaDeltaSolver<Dtype>::FusedUpdateValue(int param_id, int begin,
+    int end) {
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  Blob<Dtype>* param = net_params[param_id];
+  const vector<bool>* mask = this->fused_masks_[param_id];
+  const Dtype delta = this->param_.delta();
+  const Dtype momentum = this->param_.momentum();
+  const Dtype local_rate = this->fused_rates_[param_id];
+  Dtype* data = param->mutable_cpu_data();
+  Dtype* diff = param->mutable_cpu_diff();
+  Dtype* history = this->history_[param_id]->mutable_cpu_data();
+  Dtype* update_history =
+      this->history_[net_params.size() + param_id]->mutable_cpu_data();
+  for (int i = begin; i < end; ++i) {
+    if (mask && !(*mask)[i]) {
+      history[i] = 0;
+    }
+    const Dtype gradient = this->FusedGradient(param_id, data[i], diff[i]);
+    history[i] = (Dtype(1) - momentum) * gradient * gradient +
+        momentum * history[i];
+    const Dtype update = gradient *
+        std::sqrt((update_history[i] + delta) / (history[i] + delta));
+    update_history[i] = (Dtype(1) - momentum) * update * update +
+        momentum * update_history[i];
+    diff[i] = local_rate * update;
+    data[i] -= diff[i];
+  }
+}
+
 INSTANTIATE_CLASS(AdaDeltaSolver);
 REGISTER_SOLVER_CLASS(AdaDelta);
 
@@ -88,6 +88,34 @@ void AdamSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
   }
 }
 
+template <typename Dtype>
+void AdamSolver<Dtype>::FusedUpdateValue(int param_id, int begin, int end) {
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  Blob<Dtype>* param = net_params[param_id];
+  const vector<bool>* mask = this->fused_masks_[param_id];
+  const Dtype beta1 = this->param_.momentum();
+  const Dtype beta2 = this->param_.momentum2();
+  const int t = this->iter_ + 1;
+  const Dtype correction = std::sqrt(Dtype(1) - pow(beta2, t)) /
+      (Dtype(1.) - pow(beta1, t));
+  const Dtype rate = this->fused_rates_[param_id] * correction;
+  const Dtype eps_hat = this->param_.delta();
+  Dtype* data = param->mutable_cpu_data();
+  Dtype* diff = param->mutable_cpu_diff();
+  Dtype* m = this->history_[param_id]->mutable_cpu_data();
+  Dtype* v = this->history_[net_params.size() + param_id]->mutable_cpu_data();
+  for (int i = begin; i < end; ++i) {
+    if (mask && !(*mask)[i]) {
+      m[i] = 0;
+    }
+    const Dtype gradient = this->FusedGradient(param_id, data[i], diff[i]);
+    m[i] = (Dtype(1) - beta1) * gradient + beta1 * m[i];
+    v[i] = (Dtype(1) - beta2) * gradient * gradient + beta2 * v[i];
+    diff[i] = rate * m[i] / (std::sqrt(v[i]) + eps_hat);
+    data[i] -= diff[i];
+  }
+}
+
 INSTANTIATE_CLASS(AdamSolver);
 REGISTER_SOLVER_CLASS(Adam);
 
@@ -56,6 +56,29 @@ void NesterovSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
   }
 }
 
+template <typename Dtype>
+void NesterovSolver<Dtype>::FusedUpdateValue(int param_id, int begin,
+    int end) {
+  Blob<Dtype>* param = this->net_->learnable_params()[param_id];
+  const vector<bool>* mask = this->fused_masks_[param_id];
+  const Dtype momentum = this->param_.momentum();
+  const Dtype local_rate = this->fused_rates_[param_id];
+  Dtype* data = param->mutable_cpu_data();
+  Dtype* diff = param->mutable_cpu_diff();
+  Dtype* history = this->history_[param_id]->mutable_cpu_data();
+  for (int i = begin; i < end; ++i) {
+    if (mask && !(*mask)[i]) {
+      history[i] = 0;
+    }
+    // update history, then step back and over step
+    const Dtype previous = history[i];
+    history[i] = local_rate * this->FusedGradient(param_id, data[i], diff[i])
+        + momentum * history[i];
+    diff[i] = (Dtype(1) + momentum) * history[i] - momentum * previous;
+    data[i] -= diff[i];
+  }
+}
+
 INSTANTIATE_CLASS(NesterovSolver);
 REGISTER_SOLVER_CLASS(Nesterov);
 
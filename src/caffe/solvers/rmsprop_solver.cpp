@@ -64,6 +64,29 @@ void RMSPropSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
   }
 }
 
+template <typename Dtype>
+void RMSPropSolver<Dtype>::FusedUpdateValue(int param_id, int begin,
+    int end) {
+  Blob<Dtype>* param = this->net_->learnable_params()[param_id];
+  const vector<bool>* mask = this->fused_masks_[param_id];
+  const Dtype delta = this->param_.delta();
+  const Dtype rms_decay = this->param_.rms_decay();
+  const Dtype local_rate = this->fused_rates_[param_id];
+  Dtype* data = param->mutable_cpu_data();
+  Dtype* diff = param->mutable_cpu_diff();
+  Dtype* history = this->history_[param_id]->mutable_cpu_data();
+  for (int i = begin; i < end; ++i) {
+    if (mask && !(*mask)[i]) {
+      history[i] = 0;
+    }
+    const Dtype gradient = this->FusedGradient(param_id, data[i], diff[i]);
+    history[i] = (Dtype(1) - rms_decay) * gradient * gradient +
+        rms_decay * history[i];
+    diff[i] = local_rate * gradient / (std::sqrt(history[i]) + delta);
+    data[i] -= diff[i];
+  }
+}
+
 INSTANTIATE_CLASS(RMSPropSolver);
 REGISTER_SOLVER_CLASS(RMSProp);
 
@@ -1,3 +1,5 @@
+#include <boost/bind.hpp>
+
 #include <string>
 #include <vector>
 
@@ -90,17 +92,26 @@ void SGDSolver<Dtype>::PreSolve() {
       vector<Dtype> tmp(num_col, 0);
       history_reg_.push_back(tmp);
   }
+
+  if (this->param_.update_threads() > 1) {
+    update_pool_.reset(new ThreadPool(this->param_.update_threads()));
+  }
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::ClipGradients() {
+Dtype SGDSolver<Dtype>::GetClipScale() {
   const Dtype clip_gradients = this->param_.clip_gradients();
   // cout << "clip_gradients: " << clip_gradients << endl; // WANGHUAN
-  if (clip_gradients < 0) { return; }
+  if (clip_gradients < 0) { return Dtype(1); }
   const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const shared_ptr<Blob<Dtype> >& flat_params = this->net_->flat_params();
   Dtype sumsq_diff = 0;
-  for (int i = 0; i < net_params.size(); ++i) {
-    sumsq_diff += net_params[i]->sumsq_diff();
+  if (flat_params && Caffe::mode() == Caffe::CPU) {
+    sumsq_diff = flat_params->sumsq_diff();
+  } else {
+    for (int i = 0; i < net_params.size(); ++i) {
+      sumsq_diff += net_params[i]->sumsq_diff();
+    }
   }
   const Dtype l2norm_diff = std::sqrt(sumsq_diff);
   if (l2norm_diff > clip_gradients) {
@@ -108,6 +119,20 @@ void SGDSolver<Dtype>::ClipGradients() {
     LOG(INFO) << "Gradient clipping: scaling down gradients (L2 norm "
         << l2norm_diff << " > " << clip_gradients << ") "
         << "by scale factor " << scale_factor;
+    return scale_factor;
+  }
+  return Dtype(1);
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::ClipGradients() {
+  const Dtype scale_factor = GetClipScale();
+  const shared_ptr<Blob<Dtype> >& flat_params = this->net_->flat_params();
+  if (scale_factor != Dtype(1) && flat_params &&
+      Caffe::mode() == Caffe::CPU) {
+    flat_params->scale_diff(scale_factor);
+  } else if (scale_factor != Dtype(1)) {
+    const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
     for (int i = 0; i < net_params.size(); ++i) {
       net_params[i]->scale_diff(scale_factor);
     }
@@ -121,6 +146,12 @@ void SGDSolver<Dtype>::ApplyUpdate() {
   if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
     LOG(INFO) << "Iteration " << this->iter_ << ", lr = " << rate;
   }
+  const string& regularization_type = this->param_.regularization_type();
+  if (Caffe::mode() == Caffe::CPU && this->param_.fused_update() &&
+      (regularization_type == "L2" || regularization_type == "L1")) {
+    FusedApplyUpdate(rate);
+    return;
+  }
   ClipGradients();
   ClearHistory(); // WANGHUAN
   for (int param_id = 0; param_id < this->net_->learnable_params().size();
@@ -137,6 +168,77 @@ void SGDSolver<Dtype>::ApplyUpdate() {
   this->net_->Update();
 }
 
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedApplyUpdate(Dtype rate) {
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const vector<float>& net_params_lr = this->net_->params_lr();
+  const vector<float>& net_params_weight_decay =
+      this->net_->params_weight_decay();
+  // Clipping and normalization both scale the gradients
+  fused_grad_scale_ = GetClipScale() / this->param_.iter_size();
+  fused_l1_ = this->param_.regularization_type() == "L1";
+  const Dtype weight_decay = GetWeightDecay();
+  fused_rates_.resize(net_params.size());
+  fused_decays_.resize(net_params.size());
+  fused_offsets_.resize(net_params.size() + 1);
+  fused_offsets_[0] = 0;
+  for (int i = 0; i < net_params.size(); ++i) {
+    fused_rates_[i] = rate * net_params_lr[i];
+    fused_decays_[i] = weight_decay * net_params_weight_decay[i];
+    fused_offsets_[i + 1] = fused_offsets_[i] + net_params[i]->count();
+    // Make sure values are on the CPU before the workers use them
+    net_params[i]->mutable_cpu_data();
+    net_params[i]->mutable_cpu_diff();
+  }
+  for (int i = 0; i < history_.size(); ++i) {
+    history_[i]->mutable_cpu_data();
+  }
+  GetParamMasks(&fused_masks_);
+  if (update_pool_) {
+    update_pool_->Run(boost::bind(&SGDSolver<Dtype>::FusedUpdateWorker, this,
+        _1));
+  } else {
+    FusedUpdateWorker(0);
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdateWorker(int worker) {
+  // Workers update equal shares of all the values, whatever the parameters
+  const int workers = update_pool_ ? update_pool_->size() : 1;
+  const int64_t total = fused_offsets_.back();
+  const int64_t begin = total * worker / workers;
+  const int64_t end = total * (worker + 1) / workers;
+  for (int i = 0; i < fused_offsets_.size() - 1; ++i) {
+    const int64_t param_begin = std::max(begin, fused_offsets_[i]);
+    const int64_t param_end = std::min(end, fused_offsets_[i + 1]);
+    if (param_begin < param_end) {
+      FusedUpdateValue(i, param_begin - fused_offsets_[i],
+          param_end - fused_offsets_[i]);
+    }
+  }
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::FusedUpdateValue(int param_id, int begin, int end) {
+  Blob<Dtype>* param = this->net_->learnable_params()[param_id];
+  const vector<bool>* mask = fused_masks_[param_id];
+  const Dtype momentum = this->param_.momentum();
+  const Dtype local_rate = fused_rates_[param_id];
+  Dtype* data = param->mutable_cpu_data();
+  Dtype* diff = param->mutable_cpu_diff();
+  Dtype* history = history_[param_id]->mutable_cpu_data();
+  for (int i = begin; i < end; ++i) {
+    if (mask && !(*mask)[i]) {
+      history[i] = 0;
+    }
+    history[i] = local_rate * FusedGradient(param_id, data[i], diff[i]) +
+        momentum * history[i];
+    diff[i] = history[i];
+    data[i] -= history[i];
+  }
+}
+
 template <typename Dtype>
 void SGDSolver<Dtype>::Normalize(int param_id) {
   if (this->param_.iter_size() == 1) { return; }
@@ -171,12 +273,8 @@ bool SGDSolver<Dtype>::Comparator(const std::pair<Dtype, int>& left, const std::
 }    
 
 template <typename Dtype>
-void SGDSolver<Dtype>::Regularize(int param_id) {    
-  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
-  const vector<float>& net_params_weight_decay =
-      this->net_->params_weight_decay();
+Dtype SGDSolver<Dtype>::GetWeightDecay() {
   Dtype weight_decay = this->param_.weight_decay();
-  string regularization_type = this->param_.regularization_type();
 
   // ------------------------------------------------
   // Decrease-Weight-Decay Mode, WANGHUAN
@@ -205,7 +303,17 @@ void SGDSolver<Dtype>::Regularize(int param_id) {
           }
       }
   }
-  
+  return current_wd;
+}
+
+template <typename Dtype>
+void SGDSolver<Dtype>::Regularize(int param_id) {
+  const vector<Blob<Dtype>*>& net_params = this->net_->learnable_params();
+  const vector<float>& net_params_weight_decay =
+      this->net_->params_weight_decay();
+  string regularization_type = this->param_.regularization_type();
+  const Dtype current_wd = GetWeightDecay();
+
   // ------------------------------------------------
   Dtype local_decay = current_wd * net_params_weight_decay[param_id];
   
@@ -241,6 +349,8 @@ void SGDSolver<Dtype>::Regularize(int param_id) {
   }
   case Caffe::GPU: {
 #ifndef CPU_ONLY
+    // The structured regularizers scale the solver's own decay
+    const Dtype weight_decay = this->param_.weight_decay();
     if (local_decay) {
       if (regularization_type == "L2") {
         // add weight decay
@@ -624,8 +734,9 @@ void SGDSolver<Dtype>::ComputeUpdateValue(int param_id, Dtype rate) {
 }
 
 template <typename Dtype>
-void SGDSolver<Dtype>::ClearHistory() {
+void SGDSolver<Dtype>::GetParamMasks(vector<const vector<bool>*>* masks) {
     const vector<shared_ptr<Layer<Dtype> > >& layers = this->net_->layers();
+    masks->assign(this->net_->learnable_params().size(), NULL);
     int param_id = 0;
     for (int i = 0; i < layers.size(); ++i) {
     /// As long as layer i has masks, its history_ should be cleared. But only clear history_ of weights, since we only have masks for weights.
@@ -636,24 +747,42 @@ void SGDSolver<Dtype>::ClearHistory() {
             while (history_[param_id]->count() != count) { 
                 ++ param_id; /// jump over biases
             }
-            Dtype* tmp = new Dtype[count]; /// TODEBUG: Why cannot use bool?
-            for (int k = 0; k < count; ++k) {
-                tmp[k] = layers[i]->masks_[k];
-            }
-            caffe_mul(count, 
-                      (const Dtype*) tmp, 
-                      history_[param_id]->cpu_data(), 
-                      history_[param_id]->mutable_cpu_data());
-            delete[] tmp;
+            (*masks)[param_id] = &layers[i]->masks_;
             ++ param_id;
         }
     }
 }
 
+template <typename Dtype>
+void SGDSolver<Dtype>::ClearHistory() {
+    vector<const vector<bool>*> masks;
+    GetParamMasks(&masks);
+    for (int param_id = 0; param_id < masks.size(); ++param_id) {
+        if (!masks[param_id]) { continue; }
+        const int count = masks[param_id]->size();
+        Dtype* tmp = new Dtype[count]; /// TODEBUG: Why cannot use bool?
+        for (int k = 0; k < count; ++k) {
+            tmp[k] = (*masks[param_id])[k];
+        }
+        caffe_mul(count, 
+                  (const Dtype*) tmp, 
+                  history_[param_id]->cpu_data(), 
+                  history_[param_id]->mutable_cpu_data());
+        delete[] tmp;
+    }
+}
+
 
 
 
 
+template <typename Dtype>
+void SGDSolver<Dtype>::AppendStateBlobs(vector<Blob<Dtype>*>* blobs) {
+  for (int i = 0; i < history_.size(); ++i) {
+    blobs->push_back(history_[i].get());
+  }
+}
+
 template <typename Dtype>
 void SGDSolver<Dtype>::SnapshotSolverState(const string& model_filename) {
   switch (this->param_.snapshot_format()) {
@@ -671,20 +800,20 @@ void SGDSolver<Dtype>::SnapshotSolverState(const string& model_filename) {
 template <typename Dtype>
 void SGDSolver<Dtype>::SnapshotSolverStateToBinaryProto(
     const string& model_filename) {
-  SolverState state;
-  state.set_iter(this->iter_);
-  state.set_learned_net(model_filename);
-  state.set_current_step(this->current_step_);
-  state.clear_history();
+  shared_ptr<SolverState> state(new SolverState());
+  state->set_iter(this->iter_);
+  state->set_learned_net(model_filename);
+  state->set_current_step(this->current_step_);
+  state->clear_history();
   for (int i = 0; i < history_.size(); ++i) {
     // Add history
-    BlobProto* history_blob = state.add_history();
+    BlobProto* history_blob = state->add_history();
     history_[i]->ToProto(history_blob);
   }
   string snapshot_filename = Solver<Dtype>::SnapshotFilename(".solverstate");
   LOG(INFO)
     << "Snapshotting solver state to binary proto file " << snapshot_filename;
-  WriteProtoToBinaryFile(state, snapshot_filename.c_str());
+  this->SnapshotProto(state, snapshot_filename);
 }
 
 template <typename Dtype>
@@ -693,6 +822,7 @@ void SGDSolver<Dtype>::SnapshotSolverStateToHDF5(
   string snapshot_filename =
       Solver<Dtype>::SnapshotFilename(".solverstate.h5");
   LOG(INFO) << "Snapshotting solver state to HDF5 file " << snapshot_filename;
+  boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fcreate(snapshot_filename.c_str(), H5F_ACC_TRUNC,
       H5P_DEFAULT, H5P_DEFAULT);
   CHECK_GE(file_hid, 0)
@@ -735,6 +865,7 @@ void SGDSolver<Dtype>::RestoreSolverStateFromBinaryProto(
 
 template <typename Dtype>
 void SGDSolver<Dtype>::RestoreSolverStateFromHDF5(const string& state_file) {
+  boost::recursive_mutex::scoped_lock lock(hdf5_mutex());
   hid_t file_hid = H5Fopen(state_file.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
   CHECK_GE(file_hid, 0) << "Couldn't open solver state file " << state_file;
   this->iter_ = hdf5_load_int(file_hid, "iter");
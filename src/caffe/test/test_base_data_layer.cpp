@@ -0,0 +1,108 @@
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/base_data_layer.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Loads batches of constants, slowly, for the net to wait on the prefetch
+// thread
+template <typename Dtype>
+class SlowDataLayer : public BasePrefetchingDataLayer<Dtype> {
+ public:
+  explicit SlowDataLayer(const LayerParameter& param)
+      : BasePrefetchingDataLayer<Dtype>(param) {}
+  virtual ~SlowDataLayer() { this->StopInternalThread(); }
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    top[0]->Reshape(2, 3, 1, 1);
+    for (int i = 0; i < this->prefetch_.size(); ++i) {
+      this->prefetch_[i]->data_.ReshapeLike(*top[0]);
+    }
+  }
+  virtual inline const char* type() const { return "SlowData"; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void load_batch(Batch<Dtype>* batch) {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+    caffe_set(batch->data_.count(), Dtype(1), batch->data_.mutable_cpu_data());
+  }
+};
+
+template <typename Dtype>
+class BaseDataLayerTest : public CPUDeviceTest<Dtype> {
+ protected:
+  BaseDataLayerTest() : blob_top_(new Blob<Dtype>()) {
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~BaseDataLayerTest() { delete blob_top_; }
+
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(BaseDataLayerTest, TestDtypes);
+
+TYPED_TEST(BaseDataLayerTest, TestDefaultDepth) {
+  LayerParameter param;
+  SlowDataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const int expected = BasePrefetchingDataLayer<TypeParam>::PREFETCH_COUNT;
+  EXPECT_EQ(layer.prefetch_depth(), expected);
+}
+
+TYPED_TEST(BaseDataLayerTest, TestDepthGrows) {
+  LayerParameter param;
+  param.mutable_data_param()->set_prefetch(1);
+  param.mutable_data_param()->set_max_prefetch(3);
+  param.mutable_data_param()->set_min_free_memory_mb(0);
+  SlowDataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // The net takes batches as soon as they are loaded, while the thread
+  // waits on the only batch, then on the net
+  for (int i = 0; i < 20 && layer.prefetch_depth() == 1; ++i) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  }
+  EXPECT_GT(layer.prefetch_depth(), 1);
+  for (int i = 0; i < 20; ++i) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    EXPECT_LE(layer.prefetch_depth(), 3);
+    EXPECT_EQ(this->blob_top_->cpu_data()[0], 1);
+  }
+}
+
+TYPED_TEST(BaseDataLayerTest, TestDepthShrinks) {
+  LayerParameter param;
+  const int kInterval = 4;
+  param.mutable_data_param()->set_prefetch(1);
+  param.mutable_data_param()->set_max_prefetch(3);
+  param.mutable_data_param()->set_prefetch_stats_interval(kInterval);
+  // Never enough memory, extra batches go at each check
+  param.mutable_data_param()->set_min_free_memory_mb(1 << 30);
+  SlowDataLayer<TypeParam> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Without it the available memory is unknown and batches are kept
+  const bool known = boost::filesystem::exists("/proc/meminfo");
+  for (int i = 1; i <= 10 * kInterval; ++i) {
+    const int depth = layer.prefetch_depth();
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    if (i % kInterval == 0 && depth > 1 && known) {
+      // The batch used is released, even if one was just added
+      EXPECT_LE(layer.prefetch_depth(), depth);
+    } else {
+      // Memory is only checked every kInterval passes
+      EXPECT_GE(layer.prefetch_depth(), depth);
+    }
+  }
+}
+
+}  // namespace caffe
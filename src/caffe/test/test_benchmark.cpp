@@ -1,5 +1,7 @@
 #include <boost/thread.hpp>
 
+#include <vector>
+
 #include "gtest/gtest.h"
 
 #include "caffe/common.hpp"
@@ -87,4 +89,19 @@ TYPED_TEST(BenchmarkTest, TestTimerSeconds) {
   EXPECT_TRUE(timer.has_run_at_least_once());
 }
 
+TEST(TimeStatsTest, TestComputeTimeStats) {
+  std::vector<double> samples;
+  for (int i = 100; i >= 0; --i) {
+    samples.push_back(i);
+  }
+  const TimeStats stats = ComputeTimeStats(samples);
+  EXPECT_DOUBLE_EQ(stats.mean, 50);
+  EXPECT_NEAR(stats.stddev, 29.155, 1e-3);
+  EXPECT_DOUBLE_EQ(stats.median, 50);
+  EXPECT_DOUBLE_EQ(stats.p90, 90);
+  EXPECT_DOUBLE_EQ(stats.p99, 99);
+  samples.resize(2);
+  EXPECT_DOUBLE_EQ(ComputeTimeStats(samples).p90, 99.9);
+}
+
 }  // namespace caffe
@@ -67,7 +67,7 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     db->Close();
   }
 
-  void TestRead() {
+  void TestRead(int transform_threads = 1, bool defer_normalization = false) {
     const Dtype scale = 3;
     LayerParameter param;
     param.set_phase(TRAIN);
@@ -75,10 +75,12 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     data_param->set_batch_size(5);
     data_param->set_source(filename_->c_str());
     data_param->set_backend(backend_);
+    data_param->set_transform_threads(transform_threads);
 
     TransformationParameter* transform_param =
         param.mutable_transform_param();
     transform_param->set_scale(scale);
+    transform_param->set_defer_normalization(defer_normalization);
 
     DataLayer<Dtype> layer(param);
     layer.SetUp(blob_bottom_vec_, blob_top_vec_);
@@ -105,6 +107,160 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
+  void TestAdaptivePrefetch() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_prefetch(1);
+    data_param->set_max_prefetch(3);
+    data_param->set_prefetch_stats_interval(10);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    EXPECT_EQ(layer.prefetch_depth(), 1);
+    for (int iter = 0; iter < 50; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(i, blob_top_label_->cpu_data()[i]);
+      }
+      EXPECT_GE(layer.prefetch_depth(), 1);
+      EXPECT_LE(layer.prefetch_depth(), 3);
+    }
+    const BlockingQueueStats stats = layer.prefetch_full_stats();
+    EXPECT_EQ(stats.pops_, 50);
+    EXPECT_LE(stats.waits_, stats.pops_);
+    EXPECT_GE(stats.wait_ms_, 0);
+  }
+
+  void TestShuffleBuffer() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_shuffle_buffer(3);
+
+    const int num_iter = 20;
+    vector<int> labels[2];
+    for (int run = 0; run < 2; ++run) {
+      Caffe::set_random_seed(seed_);
+      DataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      for (int iter = 0; iter < num_iter; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        for (int i = 0; i < 5; ++i) {
+          const int label = blob_top_label_->cpu_data()[i];
+          labels[run].push_back(label);
+          for (int j = 0; j < 24; ++j) {
+            EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j])
+                << "debug: iter " << iter << " i " << i << " j " << j;
+          }
+        }
+      }
+    }
+    // Same seed, same order
+    EXPECT_TRUE(labels[0] == labels[1]);
+    // Every record is read once per pass, and at most shuffle_buffer of
+    // them have not been handed out yet.
+    vector<int> counts(5, 0);
+    bool in_order = true;
+    for (int k = 0; k < labels[0].size(); ++k) {
+      ASSERT_GE(labels[0][k], 0);
+      ASSERT_LT(labels[0][k], 5);
+      ++counts[labels[0][k]];
+      in_order &= labels[0][k] == k % 5;
+    }
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_NEAR(counts[i], num_iter, 3);
+    }
+    EXPECT_FALSE(in_order);
+  }
+
+  void TestShuffle() {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_shuffle(true);
+
+    const int num_iter = 20;
+    vector<int> labels[2];
+    for (int run = 0; run < 2; ++run) {
+      Caffe::set_random_seed(seed_);
+      DataLayer<Dtype> layer(param);
+      layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+      for (int iter = 0; iter < num_iter; ++iter) {
+        layer.Forward(blob_bottom_vec_, blob_top_vec_);
+        for (int i = 0; i < 5; ++i) {
+          const int label = blob_top_label_->cpu_data()[i];
+          labels[run].push_back(label);
+          for (int j = 0; j < 24; ++j) {
+            EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j])
+                << "debug: iter " << iter << " i " << i << " j " << j;
+          }
+        }
+      }
+    }
+    // Same seed, same order
+    EXPECT_TRUE(labels[0] == labels[1]);
+    // Every pass, i.e. batch, is a permutation of the records
+    bool in_order = true;
+    for (int iter = 0; iter < num_iter; ++iter) {
+      vector<int> counts(5, 0);
+      for (int i = 0; i < 5; ++i) {
+        const int label = labels[0][iter * 5 + i];
+        ASSERT_GE(label, 0);
+        ASSERT_LT(label, 5);
+        ++counts[label];
+        in_order &= label == i;
+      }
+      EXPECT_TRUE(counts == vector<int>(5, 1));
+    }
+    EXPECT_FALSE(in_order);
+  }
+
+  void TestReadPartitions(bool ordered) {
+    LayerParameter param;
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename_->c_str());
+    data_param->set_backend(backend_);
+    data_param->set_partitions(2);
+    data_param->set_ordered_shards(ordered);
+
+    DataLayer<Dtype> layer(param);
+    layer.SetUp(blob_bottom_vec_, blob_top_vec_);
+    // Records 0-1 and 2-4 are read by different threads. In order, they
+    // alternate, each range wrapping around on its own.
+    const int first[] = {0, 2};
+    const int size[] = {2, 3};
+    int read[] = {0, 0};
+    for (int iter = 0; iter < 10; ++iter) {
+      layer.Forward(blob_bottom_vec_, blob_top_vec_);
+      for (int i = 0; i < 5; ++i) {
+        const int label = blob_top_label_->cpu_data()[i];
+        if (ordered) {
+          const int shard = (iter * 5 + i) % 2;
+          EXPECT_EQ(first[shard] + read[shard]++ % size[shard], label);
+        } else {
+          EXPECT_GE(label, 0);
+          EXPECT_LT(label, 5);
+        }
+        for (int j = 0; j < 24; ++j) {
+          EXPECT_EQ(label, blob_top_data_->cpu_data()[i * 24 + j])
+              << "debug: iter " << iter << " i " << i << " j " << j;
+        }
+      }
+    }
+  }
+
   void TestReshape(DataParameter_DB backend) {
     const int num_inputs = 5;
     // Save data of varying shapes.
@@ -224,13 +380,14 @@ class DataLayerTest : public MultiDeviceTest<TypeParam> {
     }
   }
 
-  void TestReadCropTrainSequenceSeeded() {
+  void TestReadCropTrainSequenceSeeded(int transform_threads = 1) {
     LayerParameter param;
     param.set_phase(TRAIN);
     DataParameter* data_param = param.mutable_data_param();
     data_param->set_batch_size(5);
     data_param->set_source(filename_->c_str());
     data_param->set_backend(backend_);
+    data_param->set_transform_threads(transform_threads);
 
     TransformationParameter* transform_param =
         param.mutable_transform_param();
@@ -356,6 +513,42 @@ TYPED_TEST(DataLayerTest, TestReadLevelDB) {
   this->TestRead();
 }
 
+TYPED_TEST(DataLayerTest, TestReadThreadedLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestRead(3);
+}
+
+TYPED_TEST(DataLayerTest, TestAdaptivePrefetchLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestAdaptivePrefetch();
+}
+
+TYPED_TEST(DataLayerTest, TestShuffleBufferLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestShuffleBuffer();
+}
+
+TYPED_TEST(DataLayerTest, TestReadPartitionsLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadPartitions(true);
+}
+
+TYPED_TEST(DataLayerTest, TestReadPartitionsUnorderedLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadPartitions(false);
+}
+
+TYPED_TEST(DataLayerTest, TestReadDeferredNormalizationLevelDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestRead(2, true);
+}
+
 TYPED_TEST(DataLayerTest, TestReshapeLevelDB) {
   this->TestReshape(DataParameter_DB_LEVELDB);
 }
@@ -374,6 +567,13 @@ TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededLevelDB) {
   this->TestReadCropTrainSequenceSeeded();
 }
 
+// Test that per-thread transformers keep the crop sequence reproducible.
+TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededThreadedLevelDB) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_LEVELDB);
+  this->TestReadCropTrainSequenceSeeded(2);
+}
+
 // Test that the sequence of random crops differs across iterations when
 // Caffe::set_random_seed isn't called (and seeds from srand are ignored).
 TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceUnseededLevelDB) {
@@ -396,6 +596,42 @@ TYPED_TEST(DataLayerTest, TestReadLMDB) {
   this->TestRead();
 }
 
+TYPED_TEST(DataLayerTest, TestReadThreadedLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestRead(3);
+}
+
+TYPED_TEST(DataLayerTest, TestAdaptivePrefetchLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestAdaptivePrefetch();
+}
+
+TYPED_TEST(DataLayerTest, TestShuffleBufferLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestShuffleBuffer();
+}
+
+TYPED_TEST(DataLayerTest, TestReadPartitionsLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadPartitions(true);
+}
+
+TYPED_TEST(DataLayerTest, TestReadPartitionsUnorderedLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadPartitions(false);
+}
+
+TYPED_TEST(DataLayerTest, TestReadDeferredNormalizationLMDB) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestRead(2, true);
+}
+
 TYPED_TEST(DataLayerTest, TestReshapeLMDB) {
   this->TestReshape(DataParameter_DB_LMDB);
 }
@@ -414,6 +650,13 @@ TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededLMDB) {
   this->TestReadCropTrainSequenceSeeded();
 }
 
+// Test that per-thread transformers keep the crop sequence reproducible.
+TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceSeededThreadedLMDB) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_LMDB);
+  this->TestReadCropTrainSequenceSeeded(2);
+}
+
 // Test that the sequence of random crops differs across iterations when
 // Caffe::set_random_seed isn't called (and seeds from srand are ignored).
 TYPED_TEST(DataLayerTest, TestReadCropTrainSequenceUnseededLMDB) {
@@ -429,5 +672,36 @@ TYPED_TEST(DataLayerTest, TestReadCropTestLMDB) {
 }
 
 #endif  // USE_LMDB
+
+TYPED_TEST(DataLayerTest, TestReadPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestRead();
+}
+
+TYPED_TEST(DataLayerTest, TestReadDeferredNormalizationPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestRead(1, true);
+}
+
+TYPED_TEST(DataLayerTest, TestShufflePacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestShuffle();
+}
+
+TYPED_TEST(DataLayerTest, TestReadPartitionsPacked) {
+  const bool unique_pixels = false;  // all pixels the same; images different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestReadPartitions(true);
+}
+
+TYPED_TEST(DataLayerTest, TestReadCropTrainPacked) {
+  const bool unique_pixels = true;  // all images the same; pixels different
+  this->Fill(unique_pixels, DataParameter_DB_PACKED);
+  this->TestReadCrop(TRAIN);
+}
+
 }  // namespace caffe
 #endif  // USE_OPENCV
@@ -0,0 +1,85 @@
+#include <sstream>
+#include <string>
+
+#include "boost/scoped_ptr.hpp"
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/data_reader.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+using boost::scoped_ptr;
+
+class DataReaderTest : public ::testing::Test {
+ protected:
+  // Writes records labeled 0 to 4, then reads them in two partitions, which
+  // share the database opened once
+  void TestReadPartitions(DataParameter_DB backend) {
+    string filename;
+    MakeTempDir(&filename);
+    filename += "/db";
+    scoped_ptr<db::DB> db(db::GetDB(backend));
+    db->Open(filename, db::NEW);
+    scoped_ptr<db::Transaction> txn(db->NewTransaction());
+    for (int i = 0; i < 5; ++i) {
+      Datum datum;
+      datum.set_label(i);
+      datum.set_channels(1);
+      datum.set_height(1);
+      datum.set_width(1);
+      datum.set_data(string(1, static_cast<char>(i)));
+      std::ostringstream key;
+      key << i;
+      string out;
+      CHECK(datum.SerializeToString(&out));
+      txn->Put(key.str(), out);
+    }
+    txn->Commit();
+    db->Close();
+
+    LayerParameter param;
+    param.set_name("data");
+    param.set_phase(TRAIN);
+    DataParameter* data_param = param.mutable_data_param();
+    data_param->set_batch_size(5);
+    data_param->set_source(filename);
+    data_param->set_backend(backend);
+    data_param->set_partitions(2);
+    DataReader reader(param);
+    // Records 0-1 and 2-4 alternate, each range wrapping around on its own
+    const int first[] = {0, 2};
+    const int size[] = {2, 3};
+    int read[] = {0, 0};
+    for (int i = 0; i < 20; ++i) {
+      DataReader::Item* item = reader.full().pop();
+      const int shard = i % 2;
+      EXPECT_EQ(first[shard] + read[shard]++ % size[shard],
+          item->datum_.label());
+      reader.free().push(item);
+    }
+  }
+};
+
+TEST_F(DataReaderTest, TestReadPartitionsPacked) {
+  TestReadPartitions(DataParameter_DB_PACKED);
+}
+
+#ifdef USE_LEVELDB
+TEST_F(DataReaderTest, TestReadPartitionsLevelDB) {
+  TestReadPartitions(DataParameter_DB_LEVELDB);
+}
+#endif  // USE_LEVELDB
+
+#ifdef USE_LMDB
+TEST_F(DataReaderTest, TestReadPartitionsLMDB) {
+  TestReadPartitions(DataParameter_DB_LMDB);
+}
+#endif  // USE_LMDB
+
+}  // namespace caffe
@@ -303,6 +303,95 @@ TYPED_TEST(DataTransformTest, TestMeanValues) {
   }
 }
 
+TYPED_TEST(DataTransformTest, TestDeferredNormalization) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 3;
+  const int height = 4;
+  const int width = 5;
+  const int crop_size = 3;
+
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_mirror(true);
+  transform_param.set_scale(0.5);
+  transform_param.add_mean_value(1);
+  transform_param.add_mean_value(2);
+  transform_param.add_mean_value(3);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  const string& data = datum.data();
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  DataTransformer<TypeParam> deferred(transform_param, TRAIN);
+  Caffe::set_random_seed(this->seed_);
+  transformer.InitRand();
+  Caffe::set_random_seed(this->seed_);
+  deferred.InitRand();
+  Blob<TypeParam> blob(1, channels, crop_size, crop_size);
+  Blob<TypeParam> normalized(1, channels, crop_size, crop_size);
+  vector<uint8_t> pixels(blob.count());
+  int crop[3];
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    transformer.Transform(datum, &blob);
+    deferred.TransformPixels(datum, data.data(), data.size(), &pixels[0],
+        crop);
+    deferred.Normalize(&pixels[0], crop, &normalized);
+    for (int j = 0; j < blob.count(); ++j) {
+      EXPECT_EQ(blob.cpu_data()[j], normalized.cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(DataTransformTest, TestDeferredNormalizationMeanFile) {
+  TransformationParameter transform_param;
+  const bool unique_pixels = true;
+  const int label = 0;
+  const int channels = 2;
+  const int height = 4;
+  const int width = 5;
+  const int size = channels * height * width;
+  const int crop_size = 3;
+
+  // Create a mean file with a different value at every position
+  string mean_file;
+  MakeTempFilename(&mean_file);
+  BlobProto blob_mean;
+  blob_mean.set_num(1);
+  blob_mean.set_channels(channels);
+  blob_mean.set_height(height);
+  blob_mean.set_width(width);
+  for (int j = 0; j < size; ++j) {
+    blob_mean.add_data(j * j);
+  }
+  WriteProtoToBinaryFile(blob_mean, mean_file);
+
+  transform_param.set_mean_file(mean_file);
+  transform_param.set_crop_size(crop_size);
+  transform_param.set_mirror(true);
+  Datum datum;
+  FillDatum(label, channels, height, width, unique_pixels, &datum);
+  const string& data = datum.data();
+  DataTransformer<TypeParam> transformer(transform_param, TRAIN);
+  DataTransformer<TypeParam> deferred(transform_param, TRAIN);
+  Caffe::set_random_seed(this->seed_);
+  transformer.InitRand();
+  Caffe::set_random_seed(this->seed_);
+  deferred.InitRand();
+  Blob<TypeParam> blob(1, channels, crop_size, crop_size);
+  Blob<TypeParam> normalized(1, channels, crop_size, crop_size);
+  vector<uint8_t> pixels(blob.count());
+  int crop[3];
+  for (int iter = 0; iter < this->num_iter_; ++iter) {
+    transformer.Transform(datum, &blob);
+    deferred.TransformPixels(datum, data.data(), data.size(), &pixels[0],
+        crop);
+    deferred.Normalize(&pixels[0], crop, &normalized);
+    for (int j = 0; j < blob.count(); ++j) {
+      EXPECT_EQ(blob.cpu_data()[j], normalized.cpu_data()[j]);
+    }
+  }
+}
+
 TYPED_TEST(DataTransformTest, TestMeanFile) {
   TransformationParameter transform_param;
   const bool unique_pixels = true;  // pixels are consecutive ints [0,size]
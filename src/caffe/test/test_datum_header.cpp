@@ -0,0 +1,68 @@
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// ParseDatumHeader needs no OpenCV, unlike the rest of test_io
+class DatumHeaderTest : public ::testing::Test {};
+
+TEST_F(DatumHeaderTest, TestParseDatumHeader) {
+  Datum datum;
+  datum.set_channels(2);
+  datum.set_height(3);
+  datum.set_width(4);
+  datum.set_label(-7);
+  datum.mutable_data()->assign(24, 'x');
+  string out;
+  CHECK(datum.SerializeToString(&out));
+  Datum header;
+  const char* data;
+  size_t data_size;
+  EXPECT_TRUE(ParseDatumHeader(out.data(), out.size(), &header, &data,
+      &data_size));
+  EXPECT_EQ(header.channels(), 2);
+  EXPECT_EQ(header.height(), 3);
+  EXPECT_EQ(header.width(), 4);
+  EXPECT_EQ(header.label(), -7);
+  EXPECT_FALSE(header.encoded());
+  EXPECT_EQ(header.data().size(), 0);
+  // The payload is referenced in place
+  EXPECT_EQ(data_size, 24);
+  EXPECT_GE(data, out.data());
+  EXPECT_LE(data + data_size, out.data() + out.size());
+  EXPECT_EQ(string(data, data_size), datum.data());
+}
+
+TEST_F(DatumHeaderTest, TestParseDatumHeaderFloat) {
+  Datum datum;
+  datum.set_channels(1);
+  datum.set_height(1);
+  datum.set_width(3);
+  for (int i = 0; i < 3; ++i) {
+    datum.add_float_data(i + 0.5);
+  }
+  string out;
+  CHECK(datum.SerializeToString(&out));
+  Datum header;
+  const char* data;
+  size_t data_size;
+  EXPECT_TRUE(ParseDatumHeader(out.data(), out.size(), &header, &data,
+      &data_size));
+  EXPECT_TRUE(data == NULL);
+  EXPECT_EQ(data_size, 0);
+  ASSERT_EQ(header.float_data_size(), 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(header.float_data(i), i + 0.5);
+  }
+  // Truncated records are rejected
+  EXPECT_FALSE(ParseDatumHeader(out.data(), out.size() - 1, &header, &data,
+      &data_size));
+}
+
+}  // namespace caffe
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <utility>
 #include <vector>
@@ -7,6 +8,7 @@
 
 #include "gtest/gtest.h"
 
+#include "caffe/adaptive_probabilistic_pruning.hpp"
 #include "caffe/common.hpp"
 #include "caffe/parallel.hpp"
 #include "caffe/proto/caffe.pb.h"
@@ -26,7 +28,9 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
  protected:
   GradientBasedSolverTest() :
       seed_(1701), num_(4), channels_(3), height_(10), width_(10),
-      share_(false) {
+      share_(false), fused_update_(true), update_threads_(1),
+      bucket_size_(1), async_snapshot_(false),
+      incremental_snapshot_(false), clip_gradients_(-1) {
         input_file_ = new string(
         CMAKE_SOURCE_DIR "caffe/test/test_data/solver_data_list.txt" CMAKE_EXT);
       }
@@ -42,6 +46,12 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
   // TODO this is brittle and the hdf5 file should be checked instead.
   int num_, channels_, height_, width_;
   bool share_;
+  bool fused_update_;
+  int update_threads_;
+  size_t bucket_size_;  // Of CPU replicas, 1 reduces each layer in backward
+  bool async_snapshot_;
+  bool incremental_snapshot_;
+  Dtype clip_gradients_;  // Negative does not clip
   Dtype delta_;  // Stability constant for RMSProp, AdaGrad, AdaDelta and Adam
 
   // Test data: check out generate_sample_data.py in the same directory.
@@ -63,6 +73,8 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       default:
         LOG(FATAL) << "Unknown Caffe mode: " << Caffe::mode();
     }
+    // Convolutions of earlier nets stay registered for pruning otherwise
+    APP::Reset();
     InitSolver(param);
     delta_ = param.delta();
   }
@@ -176,11 +188,26 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
     if (momentum != 0) {
       proto << "momentum: " << momentum << " ";
     }
+    if (!fused_update_) {
+      proto << "fused_update: false ";
+    }
+    if (update_threads_ > 1) {
+      proto << "update_threads: " << update_threads_ << " ";
+    }
+    if (clip_gradients_ >= 0) {
+      proto << "clip_gradients: " << clip_gradients_ << " ";
+    }
     MakeTempDir(&snapshot_prefix_);
     proto << "snapshot_prefix: '" << snapshot_prefix_ << "/' ";
-    if (snapshot) {
+    if (snapshot && incremental_snapshot_) {
+      // Snapshot every iteration for the later ones to be deltas
+      proto << "snapshot: 1 incremental_snapshot: true ";
+    } else if (snapshot) {
       proto << "snapshot: " << num_iters << " ";
     }
+    if (async_snapshot_) {
+      proto << "async_snapshot: true ";
+    }
     Caffe::set_random_seed(this->seed_);
     this->InitSolverFromProtoString(proto.str());
     if (from_snapshot != NULL) {
@@ -191,6 +218,12 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
     }
     if (devices == 1) {
       this->solver_->Solve();
+    } else if (Caffe::mode() == Caffe::CPU) {
+      LOG(INFO) << "Multi-threaded CPU test on " << devices << " replicas";
+      Caffe::set_solver_count(devices);
+      CPUSync<Dtype> sync(this->solver_, NULL, 0);
+      sync.Run(devices, bucket_size_);
+      Caffe::set_solver_count(1);
     } else {
       LOG(INFO) << "Multi-GPU test on " << devices << " devices";
       vector<int> gpus;
@@ -211,6 +244,15 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       ostringstream resume_file;
       resume_file << snapshot_prefix_ << "/_iter_" << num_iters
                   << ".solverstate";
+      if (incremental_snapshot_ && num_iters > 1) {
+        resume_file << ".delta";
+      }
+      // Training ends with a full snapshot, even after deltas
+      ostringstream model_file;
+      model_file << snapshot_prefix_ << "/_iter_" << num_iters
+                 << ".caffemodel";
+      EXPECT_TRUE(std::ifstream(model_file.str().c_str()).good())
+          << model_file.str() << " was not written";
       string resume_filename = resume_file.str();
       return resume_filename;
     }
@@ -462,6 +504,10 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       CUDA_CHECK(cudaGetDeviceCount(&available_devices));
     }
 #endif
+    // In CPU mode, devices are replicas on threads
+    if (Caffe::mode() == Caffe::CPU) {
+      available_devices = 2;
+    }
     for (int devices = 1; devices <= available_devices; ++devices) {
       // Configure batch size for single / multi device equivalence.
       // Constant data is needed for multi device as for accumulation.
@@ -556,6 +602,44 @@ class GradientBasedSolverTest : public MultiDeviceTest<TypeParam> {
       }
     }
   }
+
+  // Checks that the fused update matches the step by step one with clipped
+  // gradients and, as if pruned, the history of a third of the weights
+  // cleared by their masks.
+  void CheckFusedUpdateWithMasksAndClipping(const Dtype learning_rate,
+      const Dtype weight_decay, const Dtype momentum) {
+    const int kNumIters = 3;
+    clip_gradients_ = 0.5;
+    vector<shared_ptr<Blob<Dtype> > > fused_params;
+    for (int fused = 1; fused >= 0; --fused) {
+      fused_update_ = fused;
+      // Sets up the solver only, the masks go in before the updates
+      RunLeastSquaresSolver(learning_rate, weight_decay, momentum, 0);
+      const shared_ptr<Layer<Dtype> > layer =
+          solver_->net()->layer_by_name("innerprod");
+      const int count = layer->blobs()[0]->count();
+      layer->masks_.assign(count, true);
+      for (int i = 0; i < count; i += 3) {
+        layer->masks_[i] = false;
+      }
+      solver_->Step(kNumIters);
+      const vector<Blob<Dtype>*>& params = solver_->net()->learnable_params();
+      for (int i = 0; i < params.size(); ++i) {
+        if (fused) {
+          fused_params.push_back(shared_ptr<Blob<Dtype> >(new Blob<Dtype>()));
+          fused_params[i]->CopyFrom(*params[i], false, true);
+          continue;
+        }
+        for (int j = 0; j < params[i]->count(); ++j) {
+          const Dtype expected = fused_params[i]->cpu_data()[j];
+          const Dtype error_margin = std::max(Dtype(1), fabs(expected)) *
+              (sizeof(Dtype) == sizeof(float) ? 1e-4 : 1e-9);
+          EXPECT_NEAR(expected, params[i]->cpu_data()[j], error_margin)
+              << "param " << i << " differed at dim " << j;
+        }
+      }
+    }
+  }
 };
 
 
@@ -636,6 +720,52 @@ TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest, TestFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest,
+      TestLeastSquaresUpdateWithEverythingReducedAfterBackward) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.5;
+  const int kNumIters = 4;
+  this->bucket_size_ = 0;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(SGDSolverTest, TestLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
   const Dtype kLearningRate = 0.01;
@@ -682,6 +812,30 @@ TYPED_TEST(SGDSolverTest, TestSnapshot) {
   }
 }
 
+TYPED_TEST(SGDSolverTest, TestSnapshotAsync) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->async_snapshot_ = true;
+  for (int i = 1; i <= kNumIters; ++i) {
+    this->TestSnapshot(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(SGDSolverTest, TestSnapshotIncremental) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->incremental_snapshot_ = true;
+  for (int i = 1; i <= kNumIters; ++i) {
+    this->TestSnapshot(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(SGDSolverTest, TestSnapshotShare) {
   typedef typename TypeParam::Dtype Dtype;
   const Dtype kLearningRate = 0.01;
@@ -735,6 +889,41 @@ TYPED_TEST(AdaGradSolverTest, TestAdaGradLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(AdaGradSolverTest,
+      TestAdaGradLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(AdaGradSolverTest, TestAdaGradFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(AdaGradSolverTest,
+      TestAdaGradLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(AdaGradSolverTest,
       TestAdaGradLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
@@ -869,6 +1058,41 @@ TYPED_TEST(NesterovSolverTest, TestNesterovLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(NesterovSolverTest,
+      TestNesterovLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(NesterovSolverTest, TestNesterovFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(NesterovSolverTest,
+      TestNesterovLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(NesterovSolverTest,
            TestNesterovLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
@@ -998,6 +1222,41 @@ TYPED_TEST(AdaDeltaSolverTest, TestAdaDeltaLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(AdaDeltaSolverTest,
+      TestAdaDeltaLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.1;
+  const Dtype kWeightDecay = 0.1;
+  const Dtype kMomentum = 0.95;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(AdaDeltaSolverTest, TestAdaDeltaFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.1;
+  const Dtype kWeightDecay = 0.1;
+  const Dtype kMomentum = 0.95;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(AdaDeltaSolverTest,
+      TestAdaDeltaLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.1;
+  const Dtype kWeightDecay = 0.1;
+  const Dtype kMomentum = 0.95;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(AdaDeltaSolverTest,
            TestAdaDeltaLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
@@ -1101,6 +1360,39 @@ TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(AdamSolverTest, TestAdamFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.9;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(AdamSolverTest, TestAdamLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
   const Dtype kLearningRate = 0.01;
@@ -1203,6 +1495,41 @@ TYPED_TEST(RMSPropSolverTest, TestRMSPropLeastSquaresUpdateWithEverything) {
   }
 }
 
+TYPED_TEST(RMSPropSolverTest,
+      TestRMSPropLeastSquaresUpdateWithEverythingUnfused) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.0;
+  const int kNumIters = 4;
+  this->fused_update_ = false;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
+TYPED_TEST(RMSPropSolverTest, TestRMSPropFusedUpdateWithMasksAndClipping) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.0;
+  this->CheckFusedUpdateWithMasksAndClipping(kLearningRate, kWeightDecay,
+      kMomentum);
+}
+
+TYPED_TEST(RMSPropSolverTest,
+      TestRMSPropLeastSquaresUpdateWithEverythingThreaded) {
+  typedef typename TypeParam::Dtype Dtype;
+  const Dtype kLearningRate = 0.01;
+  const Dtype kWeightDecay = 0.5;
+  const Dtype kMomentum = 0.0;
+  const int kNumIters = 4;
+  this->update_threads_ = 3;
+  for (int i = 0; i <= kNumIters; ++i) {
+    this->TestLeastSquaresUpdate(kLearningRate, kWeightDecay, kMomentum, i);
+  }
+}
+
 TYPED_TEST(RMSPropSolverTest,
       TestRMSPropLeastSquaresUpdateWithEverythingShare) {
   typedef typename TypeParam::Dtype Dtype;
@@ -1262,4 +1589,157 @@ TYPED_TEST(RMSPropSolverTest, TestSnapshotShare) {
   }
 }
 
+// Data-parallel training on CPU threads, with nets other than the least
+// squares one above
+template <typename Dtype>
+class CPUSyncTest : public CPUDeviceTest<Dtype> {
+ protected:
+  shared_ptr<SGDSolver<Dtype> > RunReplicas(const string& net_proto,
+      const int replicas, const size_t bucket_size, const int num_iters) {
+    ostringstream proto;
+    proto << "base_lr: 0.01 lr_policy: 'fixed' momentum: 0.9 "
+        << "weight_decay: 0.001 snapshot_after_train: false "
+        << "random_seed: 1701 "
+        << "max_iter: " << num_iters << " net_param { " << net_proto << " }";
+    SolverParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(proto.str(), &param));
+    param.set_solver_mode(SolverParameter_SolverMode_CPU);
+    Caffe::set_random_seed(1701);
+    shared_ptr<SGDSolver<Dtype> > solver(new SGDSolver<Dtype>(param));
+    Caffe::set_solver_count(replicas);
+    CPUSync<Dtype> sync(solver, NULL, 0);
+    sync.Run(replicas, bucket_size);
+    Caffe::set_solver_count(1);
+    return solver;
+  }
+};
+
+TYPED_TEST_CASE(CPUSyncTest, TestDtypes);
+
+TYPED_TEST(CPUSyncTest, TestBatchNormStatisticsUpdatedOnce) {
+  typedef TypeParam Dtype;
+  const string net_proto =
+      "name: 'BatchNormNetwork' "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'DummyData' "
+      "  dummy_data_param { "
+      "    shape { dim: 4 dim: 5 } "
+      "    shape { dim: 4 dim: 1 } "
+      "    data_filler { type: 'uniform' } "
+      "    data_filler { type: 'constant' } "
+      "  } "
+      "  top: 'data' "
+      "  top: 'label' "
+      "} "
+      "layer { "
+      "  name: 'innerprod' "
+      "  type: 'InnerProduct' "
+      "  inner_product_param { "
+      "    num_output: 1 "
+      "    weight_filler { type: 'gaussian' std: 0.1 } "
+      "  } "
+      "  bottom: 'data' "
+      "  top: 'innerprod' "
+      "} "
+      "layer { "
+      "  name: 'bn' "
+      "  type: 'BatchNorm' "
+      "  bottom: 'innerprod' "
+      "  top: 'bn' "
+      "} "
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'bn' "
+      "  bottom: 'label' "
+      "} ";
+  const int kNumIters = 3;
+  shared_ptr<SGDSolver<Dtype> > solver =
+      this->RunReplicas(net_proto, 2, 1, kNumIters);
+  // Replicas keep their own statistics, only the root's forward updates the
+  // root's moving average, once per iteration
+  const Dtype fraction = 0.999;
+  Dtype expected = 0;
+  for (int i = 0; i < kNumIters; ++i) {
+    expected = expected * fraction + 1;
+  }
+  const Blob<Dtype>& scale =
+      *solver->net()->layer_by_name("bn")->blobs()[2];
+  EXPECT_NEAR(expected, scale.cpu_data()[0], 1e-5);
+}
+
+TYPED_TEST(CPUSyncTest, TestBucketsMatchReducingAfterBackward) {
+  typedef TypeParam Dtype;
+  ostringstream net_proto;
+  net_proto <<
+      "name: 'MultiLayerNetwork' "
+      "layer { "
+      "  name: 'data' "
+      "  type: 'DummyData' "
+      "  dummy_data_param { "
+      "    shape { dim: 4 dim: 2 dim: 3 dim: 3 } "
+      "    shape { dim: 4 dim: 1 } "
+      "    data_filler { type: 'gaussian' } "
+      "    data_filler { type: 'uniform' } "
+      "  } "
+      "  top: 'data' "
+      "  top: 'label' "
+      "} ";
+  const char* tops[] = {"data", "ip1", "ip2", "ip3"};
+  const int outputs[] = {16, 8, 1};
+  for (int i = 0; i < 3; ++i) {
+    net_proto <<
+        "layer { "
+        "  name: '" << tops[i + 1] << "' "
+        "  type: 'InnerProduct' "
+        "  inner_product_param { "
+        "    num_output: " << outputs[i] << " "
+        "    weight_filler { type: 'gaussian' std: 0.1 } "
+        "    bias_filler { type: 'gaussian' std: 0.1 } "
+        "  } "
+        "  bottom: '" << tops[i] << "' "
+        "  top: '" << tops[i + 1] << "' "
+        "} ";
+    if (i < 2) {
+      net_proto <<
+          "layer { "
+          "  name: 'relu" << i + 1 << "' "
+          "  type: 'ReLU' "
+          "  bottom: '" << tops[i + 1] << "' "
+          "  top: '" << tops[i + 1] << "' "
+          "} ";
+    }
+  }
+  net_proto <<
+      "layer { "
+      "  name: 'loss' "
+      "  type: 'EuclideanLoss' "
+      "  bottom: 'ip3' "
+      "  bottom: 'label' "
+      "} ";
+  const int kNumIters = 4;
+  const int kReplicas = 3;
+  // Reduced after backward, then in a bucket per layer, and in buckets
+  // that merge the smaller last layers
+  shared_ptr<SGDSolver<Dtype> > reference =
+      this->RunReplicas(net_proto.str(), kReplicas, 0, kNumIters);
+  const size_t bucket_sizes[] = {1, 48 * sizeof(Dtype)};
+  for (int b = 0; b < 2; ++b) {
+    shared_ptr<SGDSolver<Dtype> > solver = this->RunReplicas(
+        net_proto.str(), kReplicas, bucket_sizes[b], kNumIters);
+    const vector<Blob<Dtype>*>& expected =
+        reference->net()->learnable_params();
+    const vector<Blob<Dtype>*>& params = solver->net()->learnable_params();
+    ASSERT_EQ(expected.size(), params.size());
+    for (int i = 0; i < params.size(); ++i) {
+      for (int j = 0; j < params[i]->count(); ++j) {
+        EXPECT_NEAR(expected[i]->cpu_data()[j], params[i]->cpu_data()[j],
+            1e-6) << "bucket size " << bucket_sizes[b] << ", param " << i
+            << " differed at dim " << j;
+      }
+    }
+  }
+}
+
 }  // namespace caffe
@@ -133,4 +133,84 @@ TYPED_TEST(HDF5DataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(HDF5DataLayerTest, TestReadChunked) {
+  typedef typename TypeParam::Dtype Dtype;
+  // Chunks of 3 rows straddle batches and the ends of the files.
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+  param.add_top("label2");
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  const int batch_size = 4;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_chunk_size(3);
+  hdf5_data_param->set_source(*(this->filename));
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+
+  // Rows are read in order, file after file (see TestRead).
+  const int data_size = 8 * 6 * 5;
+  for (int iter = 0; iter < 15; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < batch_size; ++i) {
+      const int n = iter * batch_size + i;
+      const int row = n % 10;
+      const int file_offset = (n % 20 < 10) ? 0 : 2400;
+      EXPECT_EQ(row + 1, this->blob_top_label_->cpu_data()[i]);
+      EXPECT_EQ(row + 2, this->blob_top_label2_->cpu_data()[i]);
+      for (int j = 0; j < data_size; ++j) {
+        EXPECT_EQ(file_offset + row * data_size + j,
+            this->blob_top_data_->cpu_data()[i * data_size + j]);
+      }
+    }
+  }
+}
+
+TYPED_TEST(HDF5DataLayerTest, TestReadChunkedShuffled) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  param.add_top("data");
+  param.add_top("label");
+  param.add_top("label2");
+  HDF5DataParameter* hdf5_data_param = param.mutable_hdf5_data_param();
+  const int batch_size = 5;
+  hdf5_data_param->set_batch_size(batch_size);
+  hdf5_data_param->set_chunk_size(3);
+  hdf5_data_param->set_shuffle(true);
+  hdf5_data_param->set_source(*(this->filename));
+  HDF5DataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+
+  // Each epoch outputs all the rows of a file, shuffled, then all the rows
+  // of the other file.
+  const int data_size = 8 * 6 * 5;
+  for (int epoch = 0; epoch < 3; ++epoch) {
+    vector<int> first_file(2, -1);
+    vector<bool> seen(20, false);
+    bool in_order = true;
+    for (int iter = 0; iter < 4; ++iter) {
+      layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+      for (int i = 0; i < batch_size; ++i) {
+        const int row = this->blob_top_label_->cpu_data()[i] - 1;
+        EXPECT_EQ(row + 2, this->blob_top_label2_->cpu_data()[i]);
+        const Dtype* data = this->blob_top_data_->cpu_data() + i * data_size;
+        const int file = data[0] >= 2400 ? 1 : 0;
+        EXPECT_EQ(file * 2400 + row * data_size, data[0]);
+        EXPECT_EQ(file * 2400 + row * data_size + data_size - 1,
+            data[data_size - 1]);
+        EXPECT_FALSE(seen[file * 10 + row]);
+        seen[file * 10 + row] = true;
+        const int n = iter * batch_size + i;
+        if (first_file[n / 10] < 0) {
+          first_file[n / 10] = file;
+        }
+        EXPECT_EQ(first_file[n / 10], file);
+        in_order &= row == n % 10;
+      }
+    }
+    EXPECT_NE(first_file[0], first_file[1]);
+    EXPECT_FALSE(in_order);
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,139 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/image_cache.hpp"
+#include "caffe/util/io.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class ImageCacheTest : public ::testing::Test {
+ protected:
+  // An image with a different value at every pixel
+  cv::Mat MakeImage(int rows, int cols) {
+    cv::Mat image(rows, cols, CV_8UC3);
+    for (int h = 0; h < rows; ++h) {
+      uchar* ptr = image.ptr<uchar>(h);
+      for (int i = 0; i < cols * 3; ++i) {
+        ptr[i] = static_cast<uchar>(h * 7 + i);
+      }
+    }
+    return image;
+  }
+
+  bool Equal(const cv::Mat& a, const cv::Mat& b) {
+    if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type()) {
+      return false;
+    }
+    for (int h = 0; h < a.rows; ++h) {
+      for (int i = 0; i < a.cols * a.channels(); ++i) {
+        if (a.ptr<uchar>(h)[i] != b.ptr<uchar>(h)[i]) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+TEST_F(ImageCacheTest, TestPutGet) {
+  ImageCacheParameter param;
+  param.set_size_mb(16);
+  ImageCache cache(param);
+  string filename = EXAMPLES_SOURCE_DIR "images/cat.jpg";
+  cv::Mat image = ReadImageToCVMat(filename);
+  cv::Mat cached;
+  EXPECT_FALSE(cache.Get(filename, &cached));
+  cache.Put(filename, image);
+  EXPECT_TRUE(cache.Get(filename, &cached));
+  EXPECT_TRUE(Equal(image, cached));
+  EXPECT_EQ(cache.hits(), 1);
+  EXPECT_EQ(cache.misses(), 1);
+  EXPECT_GE(cache.bytes(), image.total() * image.elemSize());
+}
+
+TEST_F(ImageCacheTest, TestEvictLeastRecentlyUsed) {
+  ImageCacheParameter param;
+  param.set_size_mb(1);
+  param.set_shards(1);
+  ImageCache cache(param);
+  // Each image takes 300 KB, so the cache holds three
+  cv::Mat image = MakeImage(320, 320);
+  cache.Put("a", image);
+  cache.Put("b", image);
+  cache.Put("c", image);
+  cv::Mat cached;
+  EXPECT_TRUE(cache.Get("a", &cached));
+  cache.Put("d", image);
+  EXPECT_TRUE(cache.Get("a", &cached));
+  EXPECT_FALSE(cache.Get("b", &cached));
+  EXPECT_TRUE(cache.Get("c", &cached));
+  EXPECT_TRUE(cache.Get("d", &cached));
+  EXPECT_LE(cache.bytes(), 1 << 20);
+}
+
+TEST_F(ImageCacheTest, TestBudgetAcrossShards) {
+  ImageCacheParameter param;
+  param.set_size_mb(1);
+  param.set_shards(16);
+  ImageCache cache(param);
+  // Larger than the budget of a shard, but not of the cache
+  cv::Mat image = MakeImage(320, 320);
+  cache.Put("a", image);
+  cv::Mat cached;
+  EXPECT_TRUE(cache.Get("a", &cached));
+  const char* paths[] = {"b", "c", "d", "e", "f", "g"};
+  for (int i = 0; i < 6; ++i) {
+    cache.Put(paths[i], image);
+    EXPECT_TRUE(cache.Get(paths[i], &cached));
+    EXPECT_LE(cache.bytes(), 1 << 20);
+  }
+  // Too large for the whole cache
+  cache.Put("large", MakeImage(640, 640));
+  EXPECT_FALSE(cache.Get("large", &cached));
+}
+
+TEST_F(ImageCacheTest, TestEncoded) {
+  ImageCacheParameter param;
+  param.set_size_mb(16);
+  param.set_encoding(".png");
+  ImageCache cache(param);
+  cv::Mat image = MakeImage(40, 60);
+  cache.Put("image", image);
+  EXPECT_LT(cache.bytes(), image.total() * image.elemSize());
+  cv::Mat cached;
+  EXPECT_TRUE(cache.Get("image", &cached));
+  EXPECT_TRUE(Equal(image, cached));
+}
+
+TEST_F(ImageCacheTest, TestDownscaled) {
+  ImageCacheParameter param;
+  param.set_size_mb(16);
+  param.set_max_side(30);
+  ImageCache cache(param);
+  cv::Mat image = MakeImage(40, 60);
+  cache.Put("image", image);
+  EXPECT_LE(cache.bytes(), 20 * 30 * 3 + 5);
+  cv::Mat cached;
+  EXPECT_TRUE(cache.Get("image", &cached));
+  EXPECT_EQ(cached.rows, 40);
+  EXPECT_EQ(cached.cols, 60);
+  EXPECT_EQ(cached.type(), image.type());
+}
+
+TEST_F(ImageCacheTest, TestShared) {
+  ImageCacheParameter param;
+  param.set_size_mb(16);
+  shared_ptr<ImageCache> a = ImageCache::Shared("a", param);
+  EXPECT_EQ(a.get(), ImageCache::Shared("a", param).get());
+  EXPECT_NE(a.get(), ImageCache::Shared("b", param).get());
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
@@ -97,6 +97,37 @@ TYPED_TEST(ImageDataLayerTest, TestRead) {
   }
 }
 
+TYPED_TEST(ImageDataLayerTest, TestReadCached) {
+  typedef typename TypeParam::Dtype Dtype;
+  LayerParameter param;
+  ImageDataParameter* image_data_param = param.mutable_image_data_param();
+  image_data_param->set_batch_size(5);
+  image_data_param->set_source(this->filename_reshape_.c_str());
+  image_data_param->set_new_height(64);
+  image_data_param->set_new_width(64);
+  image_data_param->set_shuffle(false);
+  image_data_param->mutable_image_cache()->set_size_mb(16);
+  ImageDataLayer<Dtype> layer(param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // Images read from the cache after the first epoch must not change. The
+  // two images alternate, so item i of the first batch shows image i % 2.
+  layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+  Blob<Dtype> first;
+  first.CopyFrom(*this->blob_top_data_, false, true);
+  const int item_count = first.count(1);
+  for (int iter = 1; iter < 4; ++iter) {
+    layer.Forward(this->blob_bottom_vec_, this->blob_top_vec_);
+    for (int i = 0; i < 5; ++i) {
+      const int label = (iter * 5 + i) % 2;
+      EXPECT_EQ(label, this->blob_top_label_->cpu_data()[i]);
+      for (int j = 0; j < item_count; ++j) {
+        EXPECT_EQ(first.cpu_data()[label * item_count + j],
+            this->blob_top_data_->cpu_data()[i * item_count + j]);
+      }
+    }
+  }
+}
+
 TYPED_TEST(ImageDataLayerTest, TestResize) {
   typedef typename TypeParam::Dtype Dtype;
   LayerParameter param;
@@ -0,0 +1,153 @@
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "caffe/adaptive_probabilistic_pruning.hpp"
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layers/conv_layer.hpp"
+#include "caffe/layers/inner_product_layer.hpp"
+#include "caffe/layers/pooling_layer.hpp"
+#include "caffe/layers/relu_layer.hpp"
+#include "caffe/util/layer_cost.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+class LayerCostTest : public CPUDeviceTest<Dtype> {
+ protected:
+  LayerCostTest()
+      : blob_bottom_(new Blob<Dtype>(2, 3, 6, 4)),
+        blob_top_(new Blob<Dtype>()) {
+    blob_bottom_vec_.push_back(blob_bottom_);
+    blob_top_vec_.push_back(blob_top_);
+  }
+  virtual ~LayerCostTest() {
+    delete blob_bottom_;
+    delete blob_top_;
+  }
+  // Convolution layers in TRAIN register for pruning in the process-wide APP
+  // state, which solvers of earlier tests leave behind. Start and end with
+  // no layer registered.
+  virtual void SetUp() { APP::Reset(); }
+  virtual void TearDown() { APP::Reset(); }
+  Blob<Dtype>* const blob_bottom_;
+  Blob<Dtype>* const blob_top_;
+  vector<Blob<Dtype>*> blob_bottom_vec_;
+  vector<Blob<Dtype>*> blob_top_vec_;
+};
+
+TYPED_TEST_CASE(LayerCostTest, TestDtypes);
+
+TYPED_TEST(LayerCostTest, TestConvolution) {
+  LayerParameter layer_param;
+  ConvolutionParameter* convolution_param =
+      layer_param.mutable_convolution_param();
+  convolution_param->add_kernel_size(3);
+  convolution_param->set_num_output(4);
+  ConvolutionLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  // 2 x 4 x 4 x 2 outputs of 3 x 3 x 3 multiply-adds and a bias
+  const LayerCost forward = ForwardCost(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+  EXPECT_EQ(forward.flops, 64 * (2 * 27 + 1));
+  EXPECT_EQ(forward.bytes, (144 + 64 + 4 * 27 + 4) * sizeof(TypeParam));
+  const LayerCost backward = BackwardCost(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+  EXPECT_EQ(backward.flops, 2 * forward.flops);
+  EXPECT_EQ(backward.bytes, 2 * forward.bytes);
+}
+
+TYPED_TEST(LayerCostTest, TestInnerProduct) {
+  LayerParameter layer_param;
+  layer_param.mutable_inner_product_param()->set_num_output(10);
+  layer_param.mutable_inner_product_param()->set_bias_term(false);
+  layer_param.mutable_inner_product_param()->set_transpose(true);
+  InnerProductLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const LayerCost forward = ForwardCost(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+  EXPECT_EQ(forward.flops, 2 * 2 * 72 * 10);
+}
+
+TYPED_TEST(LayerCostTest, TestPooling) {
+  LayerParameter layer_param;
+  PoolingParameter* pooling_param = layer_param.mutable_pooling_param();
+  pooling_param->set_kernel_h(3);
+  pooling_param->set_kernel_w(2);
+  PoolingLayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const LayerCost forward = ForwardCost(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+  EXPECT_EQ(forward.flops, this->blob_top_->count() * 6);
+}
+
+TYPED_TEST(LayerCostTest, TestElementwise) {
+  LayerParameter layer_param;
+  ReLULayer<TypeParam> layer(layer_param);
+  layer.SetUp(this->blob_bottom_vec_, this->blob_top_vec_);
+  const LayerCost forward = ForwardCost(&layer, this->blob_bottom_vec_,
+      this->blob_top_vec_);
+  EXPECT_EQ(forward.flops, 144);
+  EXPECT_EQ(forward.bytes, 2 * 144 * sizeof(TypeParam));
+}
+
+// Synthetic counts under roofs of 100 GFLOP/s and 10 GB/s, with the ridge at
+// 10 flop/byte, a cache line being 64 bytes
+class RooflineTest : public ::testing::Test {
+ protected:
+  PassCounters Analyze(double flops, double ms, double dram_bytes) {
+    const LayerCost cost = {flops, 0};
+    double counts[PerfCounters::NUM_EVENTS] = {};
+    counts[PerfCounters::CYCLES] = 2e6;
+    counts[PerfCounters::INSTRUCTIONS] = 3e6;
+    counts[PerfCounters::LLC_MISSES] = dram_bytes / 64;
+    const Roofline roof = {100, 10};
+    return AnalyzeCounters(cost, ms, counts, roof);
+  }
+};
+
+TEST_F(RooflineTest, TestComputeBound) {
+  // 50 GFLOP/s at 100 flop/byte
+  const PassCounters analysis = Analyze(1e9, 20, 1e7);
+  EXPECT_DOUBLE_EQ(analysis.ipc, 1.5);
+  EXPECT_DOUBLE_EQ(analysis.gflops, 50);
+  EXPECT_DOUBLE_EQ(analysis.dram_gbps, 0.5);
+  EXPECT_DOUBLE_EQ(analysis.intensity, 100);
+  EXPECT_STREQ(analysis.bound, "compute-bound");
+}
+
+TEST_F(RooflineTest, TestMemoryBound) {
+  // 8 GB/s at 1 flop/byte, under a roof of 10 GFLOP/s
+  const PassCounters analysis = Analyze(1e8, 12.5, 1e8);
+  EXPECT_DOUBLE_EQ(analysis.gflops, 8);
+  EXPECT_DOUBLE_EQ(analysis.dram_gbps, 8);
+  EXPECT_DOUBLE_EQ(analysis.intensity, 1);
+  EXPECT_STREQ(analysis.bound, "memory-bound");
+}
+
+TEST_F(RooflineTest, TestLatencyBound) {
+  // 0.1 GFLOP/s and 0.1 GB/s, far below both roofs
+  const PassCounters analysis = Analyze(1e6, 10, 1e6);
+  EXPECT_DOUBLE_EQ(analysis.gflops, 0.1);
+  EXPECT_DOUBLE_EQ(analysis.dram_gbps, 0.1);
+  EXPECT_STREQ(analysis.bound, "latency-bound");
+}
+
+TEST_F(RooflineTest, TestNoMisses) {
+  const PassCounters analysis = Analyze(1e9, 20, 0);
+  EXPECT_EQ(analysis.dram_gbps, 0);
+  EXPECT_GT(analysis.intensity, 1e300);
+  EXPECT_STREQ(analysis.bound, "compute-bound");
+}
+
+TEST_F(RooflineTest, TestUnmeasured) {
+  const PassCounters analysis = Analyze(1e9, 0, 1e7);
+  EXPECT_DOUBLE_EQ(analysis.ipc, 1.5);
+  EXPECT_EQ(analysis.gflops, 0);
+  EXPECT_STREQ(analysis.bound, "unmeasured");
+}
+
+}  // namespace caffe
@@ -22,11 +22,12 @@ class NetTest : public MultiDeviceTest<TypeParam> {
   typedef typename TypeParam::Dtype Dtype;
 
  protected:
-  NetTest() : seed_(1701) {}
+  NetTest() : seed_(1701), contiguous_params_(false) {}
 
   virtual void InitNetFromProtoString(const string& proto) {
     NetParameter param;
     CHECK(google::protobuf::TextFormat::ParseFromString(proto, &param));
+    param.set_contiguous_params(contiguous_params_);
     net_.reset(new Net<Dtype>(param));
   }
 
@@ -840,6 +841,7 @@ class NetTest : public MultiDeviceTest<TypeParam> {
   }
 
   int seed_;
+  bool contiguous_params_;
   shared_ptr<Net<Dtype> > net_;
 };
 
@@ -906,6 +908,32 @@ TYPED_TEST(NetTest, TestBottomNeedBackwardForce) {
   EXPECT_EQ(false, bottom_need_backward[2][1]);
 }
 
+// Counts the layers done by Backward
+template <typename Dtype>
+class CountingCallback : public Net<Dtype>::Callback {
+ public:
+  CountingCallback() : count_(0) {}
+  int count_;
+
+ protected:
+  virtual void run(int layer) { ++count_; }
+};
+
+TYPED_TEST(NetTest, TestAfterBackward) {
+  typedef typename TypeParam::Dtype Dtype;
+  this->InitTinyNet(true);
+  CountingCallback<Dtype> callback;
+  this->net_->add_after_backward(&callback);
+  this->net_->Forward();
+  this->net_->Backward();
+  const int layers = this->net_->layers().size();
+  EXPECT_EQ(layers, callback.count_);
+  this->net_->remove_after_backward(&callback);
+  EXPECT_EQ(0, this->net_->after_backward().size());
+  this->net_->Backward();
+  EXPECT_EQ(layers, callback.count_);
+}
+
 TYPED_TEST(NetTest, TestBottomNeedBackwardEuclideanForce) {
   const bool force_backward = true;
   this->InitTinyNetEuclidean(force_backward);
@@ -1297,6 +1325,62 @@ TYPED_TEST(NetTest, TestSharedWeightsUpdate) {
   }
 }
 
+TYPED_TEST(NetTest, TestContiguousParamsUpdate) {
+  typedef typename TypeParam::Dtype Dtype;
+  Caffe::set_random_seed(this->seed_);
+  this->InitDiffDataUnsharedWeightsNet();
+  EXPECT_TRUE(this->net_->flat_params().get() == NULL);
+  const Dtype loss = this->net_->ForwardBackward();
+  const vector<Blob<Dtype>*> params = this->net_->learnable_params();
+  vector<shared_ptr<Blob<Dtype> > > expected(params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    expected[i].reset(new Blob<Dtype>());
+    expected[i]->CopyFrom(*params[i], false, true);
+    expected[i]->CopyFrom(*params[i], true, true);
+  }
+  this->net_->Update();
+
+  this->contiguous_params_ = true;
+  Caffe::set_random_seed(this->seed_);
+  this->InitDiffDataUnsharedWeightsNet();
+  const shared_ptr<Blob<Dtype> > flat = this->net_->flat_params();
+  ASSERT_TRUE(flat.get() != NULL);
+  const vector<Blob<Dtype>*>& flat_params = this->net_->learnable_params();
+  ASSERT_EQ(params.size(), flat_params.size());
+  // Params are aligned views on the flat blob
+  const Dtype* flat_data = flat->cpu_data();
+  const Dtype* flat_diff = flat->cpu_diff();
+  for (int i = 0; i < flat_params.size(); ++i) {
+    const Dtype* data = flat_params[i]->cpu_data();
+    const Dtype* diff = flat_params[i]->cpu_diff();
+    EXPECT_GE(data, flat_data);
+    EXPECT_LE(data + flat_params[i]->count(), flat_data + flat->count());
+    EXPECT_EQ(data - flat_data, diff - flat_diff);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(data) % 64);
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(diff) % 64);
+  }
+  EXPECT_EQ(loss, this->net_->ForwardBackward());
+  for (int i = 0; i < flat_params.size(); ++i) {
+    const int count = flat_params[i]->count();
+    for (int j = 0; j < count; ++j) {
+      EXPECT_EQ(expected[i]->cpu_diff()[j], flat_params[i]->cpu_diff()[j]);
+    }
+  }
+  this->net_->Update();
+  for (int i = 0; i < flat_params.size(); ++i) {
+    const int count = flat_params[i]->count();
+    caffe_axpy(count, Dtype(-1), expected[i]->cpu_diff(),
+        expected[i]->mutable_cpu_data());
+    for (int j = 0; j < count; ++j) {
+      EXPECT_EQ(expected[i]->cpu_data()[j], flat_params[i]->cpu_data()[j]);
+    }
+  }
+  this->net_->ClearParamDiffs();
+  for (int i = 0; i < flat_params.size(); ++i) {
+    EXPECT_EQ(0, flat_params[i]->asum_diff());
+  }
+}
+
 TYPED_TEST(NetTest, TestSharedWeightsResume) {
   typedef typename TypeParam::Dtype Dtype;
 
@@ -0,0 +1,63 @@
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/perf_counters.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+// Counters are often not allowed, e.g. in VMs and containers, so the tests
+// only check the counts when they are available.
+class PerfCountersTest : public ::testing::Test {};
+
+TEST_F(PerfCountersTest, TestNames) {
+  for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+    const char* name = PerfCounters::name(PerfCounters::Event(e));
+    ASSERT_TRUE(name != NULL);
+    EXPECT_GT(strlen(name), 0);
+  }
+}
+
+TEST_F(PerfCountersTest, TestCount) {
+  PerfCounters counters;
+  counters.Start();
+  volatile double sum = 0;
+  for (int i = 0; i < 1000000; ++i) {
+    sum += i;
+  }
+  counters.Stop();
+  for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+    EXPECT_GE(counters.count(PerfCounters::Event(e)), 0);
+  }
+  if (counters.available()) {
+    EXPECT_GT(counters.count(PerfCounters::CYCLES), 0);
+    // Some CPUs lack the other counters, which then read 0
+    if (counters.count(PerfCounters::INSTRUCTIONS) > 0) {
+      EXPECT_GT(counters.count(PerfCounters::INSTRUCTIONS), 1000000);
+    }
+  } else {
+    for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+      EXPECT_EQ(0, counters.count(PerfCounters::Event(e)));
+    }
+  }
+}
+
+TEST_F(PerfCountersTest, TestRestart) {
+  PerfCounters counters;
+  counters.Start();
+  volatile double sum = 0;
+  for (int i = 0; i < 1000000; ++i) {
+    sum += i;
+  }
+  counters.Stop();
+  const double first = counters.count(PerfCounters::INSTRUCTIONS);
+  // Start resets the counts
+  counters.Start();
+  counters.Stop();
+  EXPECT_LE(counters.count(PerfCounters::INSTRUCTIONS), first);
+}
+
+}  // namespace caffe
@@ -5,10 +5,12 @@
 #include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
 
+#include "caffe/adaptive_probabilistic_pruning.hpp"
 #include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
 #include "caffe/sgd_solvers.hpp"
 #include "caffe/solver.hpp"
+#include "caffe/util/io.hpp"
 
 #include "caffe/test/test_caffe_main.hpp"
 
@@ -35,9 +37,78 @@ class SolverTest : public MultiDeviceTest<TypeParam> {
       default:
         LOG(FATAL) << "Unknown Caffe mode: " << Caffe::mode();
     }
+    // Convolutions of earlier nets stay registered for pruning otherwise
+    APP::Reset();
     solver_.reset(new SGDSolver<Dtype>(param));
   }
 
+  // Trains a seeded net for a few iterations with the given solver options,
+  // and returns its params, to check that the options leave training as is
+  vector<Dtype> TrainedParams(const string& options) {
+    string snapshot_prefix;
+    MakeTempDir(&snapshot_prefix);
+    ostringstream proto;
+    proto <<
+       "base_lr: 0.01 "
+       "lr_policy: 'fixed' "
+       "max_iter: 4 "
+       "random_seed: 1701 "
+       "snapshot_after_train: false "
+       "snapshot_prefix: '" << snapshot_prefix << "/' "
+       "net_param { "
+       "  name: 'TestNetwork' "
+       "  layer { "
+       "    name: 'data' "
+       "    type: 'DummyData' "
+       "    dummy_data_param { "
+       "      shape { dim: 5 dim: 2 dim: 3 dim: 4 } "
+       "      shape { dim: 5 } "
+       "      data_filler { type: 'gaussian' } "
+       "      data_filler { type: 'constant' } "
+       "    } "
+       "    top: 'data' "
+       "    top: 'label' "
+       "    include: { phase: TRAIN } "
+       "  } "
+       // Tested on constants, so that tests draw no random numbers
+       "  layer { "
+       "    name: 'data' "
+       "    type: 'DummyData' "
+       "    dummy_data_param { "
+       "      shape { dim: 5 dim: 2 dim: 3 dim: 4 } "
+       "      shape { dim: 5 } "
+       "      data_filler { type: 'constant' value: 1 } "
+       "      data_filler { type: 'constant' } "
+       "    } "
+       "    top: 'data' "
+       "    top: 'label' "
+       "    include: { phase: TEST } "
+       "  } "
+       "  layer { "
+       "    name: 'innerprod' "
+       "    type: 'InnerProduct' "
+       "    inner_product_param { "
+       "      num_output: 10 "
+       "      weight_filler { type: 'gaussian' } "
+       "    } "
+       "    bottom: 'data' "
+       "    top: 'innerprod' "
+       "  } "
+       "  layer { "
+       "    name: 'loss' "
+       "    type: 'SoftmaxWithLoss' "
+       "    bottom: 'innerprod' "
+       "    bottom: 'label' "
+       "  } "
+       "} " << options;
+    InitSolverFromProtoString(proto.str());
+    solver_->Solve();
+    const Blob<Dtype>& weights =
+        *solver_->net()->layer_by_name("innerprod")->blobs()[0];
+    return vector<Dtype>(weights.cpu_data(),
+        weights.cpu_data() + weights.count());
+  }
+
   shared_ptr<Solver<Dtype> > solver_;
 };
 
@@ -106,4 +177,97 @@ TYPED_TEST(SolverTest, TestInitTrainTestNets) {
   EXPECT_TRUE(this->solver_->test_nets()[1]->has_layer("accuracy"));
 }
 
+TYPED_TEST(SolverTest, TestAsyncTestNets) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string& proto =
+     "base_lr: 0.01 "
+     "lr_policy: 'fixed' "
+     "max_iter: 3 "
+     "snapshot_after_train: false "
+     "test_interval: 1 "
+     "test_iter: 2 "
+     "async_test: true "
+     "net_param { "
+     "  name: 'TestNetwork' "
+     "  layer { "
+     "    name: 'data' "
+     "    type: 'DummyData' "
+     "    dummy_data_param { "
+     "      shape { "
+     "        dim: 5 "
+     "        dim: 2 "
+     "        dim: 3 "
+     "        dim: 4 "
+     "      } "
+     "      shape { "
+     "        dim: 5 "
+     "      } "
+     "      data_filler { "
+     "        type: 'gaussian' "
+     "      } "
+     "      data_filler { "
+     "        type: 'constant' "
+     "      } "
+     "    } "
+     "    top: 'data' "
+     "    top: 'label' "
+     "  } "
+     "  layer { "
+     "    name: 'innerprod' "
+     "    type: 'InnerProduct' "
+     "    inner_product_param { "
+     "      num_output: 10 "
+     "      weight_filler { "
+     "        type: 'gaussian' "
+     "      } "
+     "    } "
+     "    bottom: 'data' "
+     "    top: 'innerprod' "
+     "  } "
+     "  layer { "
+     "    name: 'loss' "
+     "    type: 'SoftmaxWithLoss' "
+     "    bottom: 'innerprod' "
+     "    bottom: 'label' "
+     "  } "
+     "} ";
+  this->InitSolverFromProtoString(proto);
+  this->solver_->Solve();
+  // The test net was last tested on a copy of the final params
+  const vector<shared_ptr<Blob<Dtype> > >& params =
+      this->solver_->net()->layer_by_name("innerprod")->blobs();
+  const vector<shared_ptr<Blob<Dtype> > >& test_params =
+      this->solver_->test_nets()[0]->layer_by_name("innerprod")->blobs();
+  ASSERT_EQ(params.size(), test_params.size());
+  for (int i = 0; i < params.size(); ++i) {
+    EXPECT_NE(params[i]->cpu_data(), test_params[i]->cpu_data());
+    ASSERT_EQ(params[i]->count(), test_params[i]->count());
+    for (int j = 0; j < params[i]->count(); ++j) {
+      EXPECT_EQ(params[i]->cpu_data()[j], test_params[i]->cpu_data()[j]);
+    }
+  }
+}
+
+TYPED_TEST(SolverTest, TestAsyncSnapshotSameTraining) {
+  typedef typename TypeParam::Dtype Dtype;
+  const vector<Dtype> sync = this->TrainedParams("snapshot: 1 ");
+  const vector<Dtype> async =
+      this->TrainedParams("snapshot: 1 async_snapshot: true ");
+  ASSERT_EQ(sync.size(), async.size());
+  for (int i = 0; i < sync.size(); ++i) {
+    EXPECT_EQ(sync[i], async[i]);
+  }
+}
+
+TYPED_TEST(SolverTest, TestAsyncTestSameTraining) {
+  typedef typename TypeParam::Dtype Dtype;
+  const string test = "test_interval: 1 test_iter: 2 ";
+  const vector<Dtype> sync = this->TrainedParams(test);
+  const vector<Dtype> async = this->TrainedParams(test + "async_test: true ");
+  ASSERT_EQ(sync.size(), async.size());
+  for (int i = 0; i < sync.size(); ++i) {
+    EXPECT_EQ(sync[i], async[i]);
+  }
+}
+
 }  // namespace caffe
@@ -0,0 +1,106 @@
+#include <boost/thread.hpp>
+
+#include <fstream>  // NOLINT(readability/streams)
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "caffe/common.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/trace.hpp"
+
+#include "caffe/test/test_caffe_main.hpp"
+
+namespace caffe {
+
+class TraceTest : public ::testing::Test {
+ protected:
+  string Read(const string& filename) {
+    std::ifstream file(filename.c_str());
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+  }
+
+  int Count(const string& text, const string& pattern) {
+    int count = 0;
+    for (size_t i = text.find(pattern); i != string::npos;
+        i = text.find(pattern, i + 1)) {
+      ++count;
+    }
+    return count;
+  }
+};
+
+static void RecordOnThread() {
+  TraceScope trace("thread", "test");
+}
+
+TEST_F(TraceTest, TestDisabled) {
+  EXPECT_FALSE(Trace::enabled());
+  TraceScope trace("disabled", "test");
+}
+
+TEST_F(TraceTest, TestRecordThreads) {
+  string filename;
+  MakeTempFilename(&filename);
+  Trace::Start(filename, 4);
+  EXPECT_TRUE(Trace::enabled());
+  {
+    TraceScope trace(string("main"), "test");
+    boost::thread thread(RecordOnThread);
+    thread.join();
+  }
+  // Only the last 4 spans of a thread are kept
+  for (int i = 0; i < 5; ++i) {
+    TraceScope trace("loop", "test");
+  }
+  Trace::Stop();
+  EXPECT_FALSE(Trace::enabled());
+  const string trace = Read(filename);
+  EXPECT_EQ(Count(trace, "\"name\": \"thread\""), 1);
+  EXPECT_EQ(Count(trace, "\"name\": \"main\""), 0);
+  EXPECT_EQ(Count(trace, "\"name\": \"loop\""), 4);
+  EXPECT_EQ(Count(trace, "\"ph\": \"X\""), 5);
+  EXPECT_EQ(trace.find("{\"displayTimeUnit\""), 0);
+}
+
+TEST_F(TraceTest, TestTemporaryName) {
+  string filename;
+  MakeTempFilename(&filename);
+  Trace::Start(filename);
+  {
+    // The name is copied, the temporary string is gone when recording
+    TraceScope trace(string("tempo") + "rary", "test");
+  }
+  Trace::Stop();
+  EXPECT_EQ(Count(Read(filename), "\"name\": \"temporary\""), 1);
+}
+
+static void RecordUntilInterrupted() {
+  try {
+    while (true) {
+      TraceScope trace("spin", "test");
+      boost::this_thread::interruption_point();
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+TEST_F(TraceTest, TestStopWhileRecording) {
+  string filename;
+  MakeTempFilename(&filename);
+  Trace::Start(filename, 16);
+  boost::thread thread(RecordUntilInterrupted);
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  Trace::Stop();
+  thread.interrupt();
+  thread.join();
+  const string trace = Read(filename);
+  EXPECT_LE(Count(trace, "\"name\": \"spin\""), 16);
+  EXPECT_EQ(trace.find("{\"displayTimeUnit\""), 0);
+}
+
+}  // namespace caffe
@@ -1,5 +1,9 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include "caffe/common.hpp"
 #include "caffe/util/benchmark.hpp"
 
@@ -166,4 +170,34 @@ float CPUTimer::MicroSeconds() {
   return this->elapsed_microseconds_;
 }
 
+static double Percentile(const std::vector<double>& sorted, double p) {
+  const double rank = p / 100 * (sorted.size() - 1);
+  const size_t below = static_cast<size_t>(rank);
+  if (below + 1 >= sorted.size()) {
+    return sorted.back();
+  }
+  return sorted[below] + (rank - below) * (sorted[below + 1] - sorted[below]);
+}
+
+TimeStats ComputeTimeStats(const std::vector<double>& samples) {
+  CHECK(!samples.empty()) << "No time samples";
+  std::vector<double> sorted(samples);
+  std::sort(sorted.begin(), sorted.end());
+  TimeStats stats;
+  double sum = 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    sum += sorted[i];
+  }
+  stats.mean = sum / sorted.size();
+  double square_sum = 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    square_sum += (sorted[i] - stats.mean) * (sorted[i] - stats.mean);
+  }
+  stats.stddev = std::sqrt(square_sum / sorted.size());
+  stats.median = Percentile(sorted, 50);
+  stats.p90 = Percentile(sorted, 90);
+  stats.p99 = Percentile(sorted, 99);
+  return stats;
+}
+
 }  // namespace caffe
@@ -1,3 +1,4 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <string>
 
@@ -45,11 +46,20 @@ template<typename T>
 T BlockingQueue<T>::pop(const string& log_on_wait) {
   boost::mutex::scoped_lock lock(sync_->mutex_);
 
-  while (queue_.empty()) {
-    if (!log_on_wait.empty()) {
-      LOG_EVERY_N(INFO, 1000)<< log_on_wait;
+  ++stats_.pops_;
+  stats_.occupancy_ += queue_.size();
+  if (queue_.empty()) {
+    ++stats_.waits_;
+    const boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+    while (queue_.empty()) {
+      if (!log_on_wait.empty()) {
+        LOG_EVERY_N(INFO, 1000)<< log_on_wait;
+      }
+      sync_->condition_.wait(lock);
     }
-    sync_->condition_.wait(lock);
+    stats_.wait_ms_ += (boost::posix_time::microsec_clock::universal_time()
+        - start).total_microseconds() / 1000.;
   }
 
   T t = queue_.front();
@@ -86,9 +96,17 @@ size_t BlockingQueue<T>::size() const {
   return queue_.size();
 }
 
+template<typename T>
+BlockingQueueStats BlockingQueue<T>::stats() const {
+  boost::mutex::scoped_lock lock(sync_->mutex_);
+  return stats_;
+}
+
 template class BlockingQueue<Batch<float>*>;
 template class BlockingQueue<Batch<double>*>;
 template class BlockingQueue<Datum*>;
+template class BlockingQueue<DataReader::Item*>;
+template class BlockingQueue<int>;
 template class BlockingQueue<shared_ptr<DataReader::QueuePair> >;
 template class BlockingQueue<P2PSync<float>*>;
 template class BlockingQueue<P2PSync<double>*>;
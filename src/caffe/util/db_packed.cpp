@@ -0,0 +1,208 @@
+#include "caffe/util/db_packed.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace caffe { namespace db {
+
+static const char kPackedMagic[8] = {'C', 'A', 'F', 'F', 'E', 'P', 'K', 'D'};
+static const uint32_t kPackedVersion = 1;
+
+static inline int PackedDim(const PackedHeader& header) {
+  return header.channels * header.height * header.width;
+}
+
+void PackedCursor::Seek(const string& key) {
+  // Keys are sorted, find the first not less than key
+  size_t begin = 0, end = header_.count;
+  while (begin < end) {
+    index_ = begin + (end - begin) / 2;
+    if (this->key() < key) {
+      begin = index_ + 1;
+    } else {
+      end = index_;
+    }
+  }
+  index_ = begin;
+}
+
+string PackedCursor::key() {
+  char key[32];
+  snprintf(key, sizeof(key), "%010llu",
+      static_cast<unsigned long long>(index_));  // NOLINT(runtime/int)
+  return string(key);
+}
+
+string PackedCursor::value() {
+  Datum datum;
+  const char* data;
+  size_t size;
+  record(&datum, &data, &size);
+  if (data) {
+    datum.set_data(data, size);
+  }
+  string value;
+  datum.SerializeToString(&value);
+  return value;
+}
+
+bool PackedCursor::record(Datum* datum, const char** data, size_t* size) {
+  CHECK(valid());
+  const char* record = records_ + index_ * header_.stride;
+  int32_t label;
+  memcpy(&label, record, sizeof(label));
+  datum->Clear();
+  datum->set_channels(header_.channels);
+  datum->set_height(header_.height);
+  datum->set_width(header_.width);
+  datum->set_label(label);
+  const int dim = PackedDim(header_);
+  if (header_.type == PackedHeader::UINT8) {
+    *data = record + sizeof(label);
+    *size = dim;
+  } else {
+    *data = NULL;
+    *size = 0;
+    datum->mutable_float_data()->Resize(dim, 0);
+    memcpy(datum->mutable_float_data()->mutable_data(), record + sizeof(label),
+        dim * sizeof(float));
+  }
+  return true;
+}
+
+void PackedTransaction::Put(const string& key, const string& value) {
+  Datum datum;
+  CHECK(datum.ParseFromString(value)) << "Could not parse datum " << key;
+  db_->Pack(datum, &records_);
+}
+
+void PackedTransaction::Commit() {
+  db_->Append(records_);
+  records_.clear();
+}
+
+void PackedDB::Open(const string& source, Mode mode) {
+  source_ = source;
+  if (mode == NEW) {
+    file_ = fopen(source.c_str(), "w+b");
+    CHECK(file_) << "Failed to create " << source;
+    memset(&header_, 0, sizeof(header_));
+    memcpy(header_.magic, kPackedMagic, sizeof(kPackedMagic));
+    header_.version = kPackedVersion;
+    WriteHeader();
+  } else if (mode == WRITE) {
+    file_ = fopen(source.c_str(), "r+b");
+    CHECK(file_) << "Failed to open " << source;
+    CHECK_EQ(fread(&header_, sizeof(header_), 1, file_), 1)
+        << "Failed to read header of " << source;
+  } else {
+    int fd = open(source.c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "Failed to open " << source;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0) << "Failed to stat " << source;
+    map_size_ = st.st_size;
+    CHECK_GE(map_size_, sizeof(header_)) << "Truncated database " << source;
+    void* map = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(map != MAP_FAILED) << "Failed to map " << source;
+    map_ = static_cast<char*>(map);
+    memcpy(&header_, map_, sizeof(header_));
+  }
+  CHECK_EQ(memcmp(header_.magic, kPackedMagic, sizeof(kPackedMagic)), 0)
+      << source << " is not a packed database";
+  CHECK_EQ(header_.version, kPackedVersion)
+      << "Unsupported packed database version in " << source;
+  if (map_) {
+    CHECK_GE(map_size_, sizeof(header_) + header_.count * header_.stride)
+        << "Truncated database " << source;
+  }
+  LOG(INFO) << "Opened packed database " << source << " of "
+      << header_.count << " records";
+}
+
+void PackedDB::Close() {
+  if (file_) {
+    CHECK_EQ(fclose(file_), 0) << "Failed to close " << source_;
+    file_ = NULL;
+  }
+  if (map_) {
+    munmap(map_, map_size_);
+    map_ = NULL;
+  }
+}
+
+PackedCursor* PackedDB::NewCursor() {
+  CHECK(map_) << "Packed database " << source_ << " not opened for reading";
+  return new PackedCursor(header_, map_ + sizeof(header_));
+}
+
+PackedTransaction* PackedDB::NewTransaction() {
+  CHECK(file_) << "Packed database " << source_ << " not opened for writing";
+  return new PackedTransaction(this);
+}
+
+void PackedDB::Pack(const Datum& datum, vector<char>* records) {
+  CHECK(!datum.encoded()) << "Packed databases hold raw pixels, not encoded "
+      << "images";
+  const PackedHeader::Type type = datum.data().size() ?
+      PackedHeader::UINT8 : PackedHeader::FLOAT;
+  if (header_.stride == 0) {
+    header_.type = type;
+    header_.channels = datum.channels();
+    header_.height = datum.height();
+    header_.width = datum.width();
+    const size_t elem = type == PackedHeader::UINT8 ? 1 : sizeof(float);
+    // Keep labels and float values aligned
+    header_.stride = (sizeof(int32_t) + PackedDim(header_) * elem + 3) & ~3;
+  }
+  CHECK(header_.type == type && header_.channels == datum.channels() &&
+      header_.height == datum.height() && header_.width == datum.width())
+      << "Records of a packed database must all have the same shape and "
+      << "type, got " << datum.channels() << "x" << datum.height() << "x"
+      << datum.width() << " after " << header_.channels << "x"
+      << header_.height << "x" << header_.width;
+  const int dim = PackedDim(header_);
+  const size_t offset = records->size();
+  records->resize(offset + header_.stride, 0);
+  char* record = &(*records)[offset];
+  const int32_t label = datum.label();
+  memcpy(record, &label, sizeof(label));
+  if (type == PackedHeader::UINT8) {
+    CHECK_EQ(datum.data().size(), dim);
+    memcpy(record + sizeof(label), datum.data().data(), dim);
+  } else {
+    CHECK_EQ(datum.float_data_size(), dim);
+    memcpy(record + sizeof(label), datum.float_data().data(),
+        dim * sizeof(float));
+  }
+}
+
+void PackedDB::Append(const vector<char>& records) {
+  if (records.empty()) {
+    return;
+  }
+  CHECK_EQ(records.size() % header_.stride, 0);
+  CHECK_EQ(fseeko(file_, sizeof(header_) + header_.count * header_.stride,
+      SEEK_SET), 0);
+  CHECK_EQ(fwrite(&records[0], records.size(), 1, file_), 1)
+      << "Failed to write to " << source_;
+  header_.count += records.size() / header_.stride;
+  // Records are only visible once the header counts them
+  WriteHeader();
+}
+
+void PackedDB::WriteHeader() {
+  CHECK_EQ(fseeko(file_, 0, SEEK_SET), 0);
+  CHECK_EQ(fwrite(&header_, sizeof(header_), 1, file_), 1)
+      << "Failed to write to " << source_;
+  CHECK_EQ(fflush(file_), 0) << "Failed to write to " << source_;
+}
+
+}  // namespace db
+}  // namespace caffe
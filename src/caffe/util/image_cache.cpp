@@ -0,0 +1,186 @@
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/highgui/highgui_c.h>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <boost/thread.hpp>
+#include <stdint.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/util/image_cache.hpp"
+
+namespace caffe {
+
+using boost::weak_ptr;
+using std::list;
+
+map<const string, weak_ptr<ImageCache> > ImageCache::caches_;
+static boost::mutex caches_mutex_;
+
+class ImageCache::Shard {
+ public:
+  Shard() : hits_(0), misses_(0) {}
+
+  struct Entry {
+    string path;
+    cv::Mat image;          // Decoded, possibly downscaled, image
+    vector<uchar> encoded;  // Or its encoded bytes
+    cv::Size size;          // Size of the original image
+    size_t bytes;
+  };
+
+  list<Entry> lru_;  // Most recently used first
+  map<string, list<Entry>::iterator> index_;
+  size_t hits_;
+  size_t misses_;
+  boost::mutex mutex_;
+};
+
+ImageCache::ImageCache(const ImageCacheParameter& param)
+    : param_(param), capacity_(static_cast<size_t>(param.size_mb()) << 20),
+      bytes_(0) {
+  CHECK_GT(param_.shards(), 0);
+  for (int i = 0; i < param_.shards(); ++i) {
+    shards_.push_back(shared_ptr<Shard>(new Shard()));
+  }
+}
+
+ImageCache::~ImageCache() {
+}
+
+shared_ptr<ImageCache> ImageCache::Shared(const string& key,
+    const ImageCacheParameter& param) {
+  boost::mutex::scoped_lock lock(caches_mutex_);
+  weak_ptr<ImageCache>& weak = caches_[key];
+  shared_ptr<ImageCache> cache = weak.lock();
+  if (!cache) {
+    cache.reset(new ImageCache(param));
+    weak = cache;
+    LOG(INFO) << "Caching up to " << param.size_mb() << " MB of images for "
+        << key;
+  }
+  return cache;
+}
+
+int ImageCache::shard_index(const string& path) const {
+  // FNV-1a, spreads similar paths over shards
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < path.size(); ++i) {
+    hash = (hash ^ static_cast<uint8_t>(path[i])) * 16777619u;
+  }
+  return hash % shards_.size();
+}
+
+bool ImageCache::Get(const string& path, cv::Mat* image) {
+  Shard* shard = shards_[shard_index(path)].get();
+  Shard::Entry entry;
+  {
+    boost::mutex::scoped_lock lock(shard->mutex_);
+    map<string, list<Shard::Entry>::iterator>::iterator it =
+        shard->index_.find(path);
+    if (it == shard->index_.end()) {
+      ++shard->misses_;
+      return false;
+    }
+    ++shard->hits_;
+    shard->lru_.splice(shard->lru_.begin(), shard->lru_, it->second);
+    entry = *it->second;
+  }
+  // Decode and upscale outside of the lock
+  *image = entry.encoded.empty() ? entry.image :
+      cv::imdecode(entry.encoded, CV_LOAD_IMAGE_UNCHANGED);
+  if (image->size() != entry.size) {
+    cv::Mat restored;
+    cv::resize(*image, restored, entry.size, 0, 0, cv::INTER_LINEAR);
+    *image = restored;
+  }
+  return true;
+}
+
+void ImageCache::Put(const string& path, const cv::Mat& image) {
+  const int index = shard_index(path);
+  Shard* shard = shards_[index].get();
+  Shard::Entry entry;
+  entry.path = path;
+  entry.size = image.size();
+  entry.image = image;
+  const int max_side = param_.max_side();
+  if (max_side && std::max(image.rows, image.cols) > max_side) {
+    const double scale = static_cast<double>(max_side) /
+        std::max(image.rows, image.cols);
+    cv::Size size(std::max(1, static_cast<int>(image.cols * scale)),
+        std::max(1, static_cast<int>(image.rows * scale)));
+    cv::resize(image, entry.image, size, 0, 0, cv::INTER_AREA);
+  }
+  if (!param_.encoding().empty()) {
+    CHECK(cv::imencode(param_.encoding(), entry.image, entry.encoded))
+        << "Could not encode " << path << " to " << param_.encoding();
+    entry.image = cv::Mat();
+    entry.bytes = entry.encoded.size();
+  } else {
+    entry.bytes = entry.image.total() * entry.image.elemSize();
+  }
+  entry.bytes += path.size();
+  if (entry.bytes > capacity_) {
+    LOG_FIRST_N(WARNING, 1) << "Not caching " << path << ", its "
+        << entry.bytes << " bytes exceed the image cache budget of "
+        << param_.size_mb() << " MB, nor any larger image";
+    return;
+  }
+  {
+    boost::mutex::scoped_lock lock(shard->mutex_);
+    if (shard->index_.count(path)) {
+      return;
+    }
+    shard->lru_.push_front(entry);
+    shard->index_[path] = shard->lru_.begin();
+  }
+  __atomic_add_fetch(&bytes_, entry.bytes, __ATOMIC_RELAXED);
+  // The budget is shared by all shards, evict from the shard of the image
+  // first, keeping the image, then from the next ones. Only one shard is
+  // locked at a time.
+  for (int i = 0; i < shards_.size() &&
+      __atomic_load_n(&bytes_, __ATOMIC_RELAXED) > capacity_; ++i) {
+    Shard* evicted = shards_[(index + i) % shards_.size()].get();
+    const size_t keep = i == 0 ? 1 : 0;
+    boost::mutex::scoped_lock lock(evicted->mutex_);
+    while (evicted->lru_.size() > keep &&
+        __atomic_load_n(&bytes_, __ATOMIC_RELAXED) > capacity_) {
+      const Shard::Entry& last = evicted->lru_.back();
+      __atomic_sub_fetch(&bytes_, last.bytes, __ATOMIC_RELAXED);
+      evicted->index_.erase(last.path);
+      evicted->lru_.pop_back();
+    }
+  }
+}
+
+size_t ImageCache::hits() const {
+  size_t hits = 0;
+  for (int i = 0; i < shards_.size(); ++i) {
+    boost::mutex::scoped_lock lock(shards_[i]->mutex_);
+    hits += shards_[i]->hits_;
+  }
+  return hits;
+}
+
+size_t ImageCache::misses() const {
+  size_t misses = 0;
+  for (int i = 0; i < shards_.size(); ++i) {
+    boost::mutex::scoped_lock lock(shards_[i]->mutex_);
+    misses += shards_[i]->misses_;
+  }
+  return misses;
+}
+
+size_t ImageCache::bytes() const {
+  return __atomic_load_n(&bytes_, __ATOMIC_RELAXED);
+}
+
+}  // namespace caffe
+#endif  // USE_OPENCV
@@ -11,6 +11,7 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <cstring>
 #include <fstream>  // NOLINT(readability/streams)
 #include <string>
 #include <vector>
@@ -116,15 +117,24 @@ static bool matchExt(const std::string & fn,
   return false;
 }
 
-bool ReadImageToDatum(const string& filename, const int label,
-    const int height, const int width, const bool is_color,
-    const std::string & encoding, Datum* datum) {
-  cv::Mat cv_img = ReadImageToCVMat(filename, height, width, is_color);
+// Stores an image read from filename to datum. If file_content is given, it
+// is stored as is when it has the right encoding, instead of reading the file
+// again.
+static bool ImageToDatum(const cv::Mat& cv_img, const string& filename,
+    const string* file_content, const int label, const int height,
+    const int width, const bool is_color, const std::string & encoding,
+    Datum* datum) {
   if (cv_img.data) {
     if (encoding.size()) {
       if ( (cv_img.channels() == 3) == is_color && !height && !width &&
-          matchExt(filename, encoding) )
-        return ReadFileToDatum(filename, label, datum);
+          matchExt(filename, encoding) ) {
+        if (!file_content)
+          return ReadFileToDatum(filename, label, datum);
+        datum->set_data(*file_content);
+        datum->set_label(label);
+        datum->set_encoded(true);
+        return true;
+      }
       std::vector<uchar> buf;
       cv::imencode("."+encoding, cv_img, buf);
       datum->set_data(std::string(reinterpret_cast<char*>(&buf[0]),
@@ -140,6 +150,32 @@ bool ReadImageToDatum(const string& filename, const int label,
     return false;
   }
 }
+
+bool ReadImageToDatum(const string& filename, const int label,
+    const int height, const int width, const bool is_color,
+    const std::string & encoding, Datum* datum) {
+  cv::Mat cv_img = ReadImageToCVMat(filename, height, width, is_color);
+  return ImageToDatum(cv_img, filename, NULL, label, height, width, is_color,
+      encoding, datum);
+}
+
+bool DecodeImageToDatum(const string& filename, const string& file_content,
+    const int label, const int height, const int width, const bool is_color,
+    const std::string & encoding, Datum* datum) {
+  cv::Mat cv_img = DecodeDatumToCVMat(file_content.data(),
+      file_content.size(), is_color);
+  if (!cv_img.data) {
+    LOG(ERROR) << "Could not decode file " << filename;
+    return false;
+  }
+  if (height > 0 && width > 0) {
+    cv::Mat cv_img_resized;
+    cv::resize(cv_img, cv_img_resized, cv::Size(width, height));
+    cv_img = cv_img_resized;
+  }
+  return ImageToDatum(cv_img, filename, &file_content, label, height, width,
+      is_color, encoding, datum);
+}
 #endif  // USE_OPENCV
 
 bool ReadFileToDatum(const string& filename, const int label,
@@ -162,31 +198,132 @@ bool ReadFileToDatum(const string& filename, const int label,
   }
 }
 
+// Skips a field of the given wire type; groups are not used by Datum.
+static bool SkipDatumField(CodedInputStream* input, uint32_t tag) {
+  uint64_t varint;
+  uint32_t length;
+  switch (tag & 7) {
+  case 0:
+    return input->ReadVarint64(&varint);
+  case 1:
+    return input->ReadLittleEndian64(&varint);
+  case 2:
+    return input->ReadVarint32(&length) && input->Skip(length);
+  case 5:
+    return input->ReadLittleEndian32(&length);
+  default:
+    return false;
+  }
+}
+
+static bool ReadDatumFloat(CodedInputStream* input, Datum* datum) {
+  uint32_t bits;
+  if (!input->ReadLittleEndian32(&bits)) {
+    return false;
+  }
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  datum->add_float_data(value);
+  return true;
+}
+
+bool ParseDatumHeader(const char* buffer, size_t size, Datum* datum,
+    const char** data, size_t* data_size) {
+  CodedInputStream input(reinterpret_cast<const uint8_t*>(buffer), size);
+  datum->Clear();
+  *data = NULL;
+  *data_size = 0;
+  uint32_t tag, value;
+  while ((tag = input.ReadTag()) != 0) {
+    const int field = tag >> 3;
+    const int wire_type = tag & 7;
+    if (field == Datum::kDataFieldNumber && wire_type == 2) {
+      // Point at the payload instead of copying it
+      if (!input.ReadVarint32(&value)) {
+        return false;
+      }
+      *data = buffer + input.CurrentPosition();
+      *data_size = value;
+      if (!input.Skip(value)) {
+        return false;
+      }
+    } else if (field == Datum::kFloatDataFieldNumber && wire_type == 5) {
+      if (!ReadDatumFloat(&input, datum)) {
+        return false;
+      }
+    } else if (field == Datum::kFloatDataFieldNumber && wire_type == 2) {
+      // Packed encoding
+      if (!input.ReadVarint32(&value)) {
+        return false;
+      }
+      CodedInputStream::Limit limit = input.PushLimit(value);
+      while (input.BytesUntilLimit() > 0) {
+        if (!ReadDatumFloat(&input, datum)) {
+          return false;
+        }
+      }
+      input.PopLimit(limit);
+    } else if (wire_type == 0) {
+      if (!input.ReadVarint32(&value)) {
+        return false;
+      }
+      switch (field) {
+      case Datum::kChannelsFieldNumber:
+        datum->set_channels(value);
+        break;
+      case Datum::kHeightFieldNumber:
+        datum->set_height(value);
+        break;
+      case Datum::kWidthFieldNumber:
+        datum->set_width(value);
+        break;
+      case Datum::kLabelFieldNumber:
+        datum->set_label(value);
+        break;
+      case Datum::kEncodedFieldNumber:
+        datum->set_encoded(value != 0);
+        break;
+      default:
+        break;
+      }
+    } else if (!SkipDatumField(&input, tag)) {
+      return false;
+    }
+  }
+  return input.ConsumedEntireMessage();
+}
+
 #ifdef USE_OPENCV
-cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
-  cv::Mat cv_img;
-  CHECK(datum.encoded()) << "Datum not encoded";
-  const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
-  cv_img = cv::imdecode(vec_data, -1);
+cv::Mat DecodeDatumToCVMatNative(const char* data, size_t data_size) {
+  // Wrap the encoded bytes, imdecode does not modify them
+  const cv::Mat raw(1, data_size, CV_8UC1, const_cast<char*>(data));
+  cv::Mat cv_img = cv::imdecode(raw, -1);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
   return cv_img;
 }
-cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
-  cv::Mat cv_img;
-  CHECK(datum.encoded()) << "Datum not encoded";
-  const string& data = datum.data();
-  std::vector<char> vec_data(data.c_str(), data.c_str() + data.size());
+cv::Mat DecodeDatumToCVMat(const char* data, size_t data_size,
+    bool is_color) {
+  const cv::Mat raw(1, data_size, CV_8UC1, const_cast<char*>(data));
   int cv_read_flag = (is_color ? CV_LOAD_IMAGE_COLOR :
     CV_LOAD_IMAGE_GRAYSCALE);
-  cv_img = cv::imdecode(vec_data, cv_read_flag);
+  cv::Mat cv_img = cv::imdecode(raw, cv_read_flag);
   if (!cv_img.data) {
     LOG(ERROR) << "Could not decode datum ";
   }
   return cv_img;
 }
+cv::Mat DecodeDatumToCVMatNative(const Datum& datum) {
+  CHECK(datum.encoded()) << "Datum not encoded";
+  const string& data = datum.data();
+  return DecodeDatumToCVMatNative(data.data(), data.size());
+}
+cv::Mat DecodeDatumToCVMat(const Datum& datum, bool is_color) {
+  CHECK(datum.encoded()) << "Datum not encoded";
+  const string& data = datum.data();
+  return DecodeDatumToCVMat(data.data(), data.size(), is_color);
+}
 
 // If Datum is encoded will decoded using DecodeDatumToCVMat and CVMatToDatum
 // If Datum is not encoded will do nothing
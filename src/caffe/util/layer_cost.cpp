@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/layer_cost.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+template <typename Dtype>
+static double TotalCount(const vector<Blob<Dtype>*>& blobs) {
+  double count = 0;
+  for (int i = 0; i < blobs.size(); ++i) {
+    count += blobs[i]->count();
+  }
+  return count;
+}
+
+// Layers whose cost is in products of their weights with their inputs
+static bool IsWeighted(const string& type) {
+  return type == "Convolution" || type == "ConvolutionDepthwise" ||
+      type == "Deconvolution" || type == "InnerProduct";
+}
+
+static bool IsView(const string& type) {
+  return type == "Split" || type == "Reshape" || type == "Flatten" ||
+      type == "Silence";
+}
+
+template <typename Dtype>
+LayerCost ForwardCost(Layer<Dtype>* layer, const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  const string type = layer->type();
+  const LayerParameter& param = layer->layer_param();
+  const vector<shared_ptr<Blob<Dtype> > >& blobs = layer->blobs();
+  const double bottom_count = TotalCount(bottom);
+  const double top_count = TotalCount(top);
+  double param_count = 0;
+  for (int i = 0; i < blobs.size(); ++i) {
+    param_count += blobs[i]->count();
+  }
+  LayerCost cost;
+  cost.bytes = (bottom_count + top_count + param_count) * sizeof(Dtype);
+  cost.flops = top_count;
+  if (IsView(type)) {
+    cost.flops = 0;
+    cost.bytes = 0;
+  } else if (bottom.empty() || type == "Embed") {
+    // Data layers copy, an embedding looks its weights up
+    cost.flops = 0;
+  } else if (IsWeighted(type)) {
+    // A multiply-add per output and weight of its kernel, plus the bias. The
+    // outputs of a deconvolution are its inputs for the kernel.
+    const Blob<Dtype>& weight = *blobs[0];
+    const bool transposed = type == "InnerProduct" &&
+        param.inner_product_param().transpose();
+    const int outputs = weight.shape(transposed ? 1 : 0);
+    const double kernel_outputs =
+        type == "Deconvolution" ? bottom_count : top_count;
+    cost.flops = 2 * kernel_outputs * weight.count() / outputs;
+    if (blobs.size() > 1) {
+      cost.flops += top_count;
+    }
+  } else if (type == "Pooling") {
+    const PoolingParameter& pool = param.pooling_param();
+    if (pool.global_pooling()) {
+      cost.flops = bottom_count;
+    } else if (pool.has_kernel_size()) {
+      cost.flops = top_count * pool.kernel_size() * pool.kernel_size();
+    } else {
+      cost.flops = top_count * pool.kernel_h() * pool.kernel_w();
+    }
+  } else if (type == "LRN") {
+    // Sums of squares over the window, then a power and a product
+    const LRNParameter& lrn = param.lrn_param();
+    double window = lrn.local_size();
+    if (lrn.norm_region() == LRNParameter_NormRegion_WITHIN_CHANNEL) {
+      window *= lrn.local_size();
+    }
+    cost.flops = bottom_count * (2 * window + 3);
+  } else if (type == "Softmax" || type == "SoftmaxWithLoss" ||
+      type == "BatchNorm" || type == "MVN") {
+    // Reductions over an axis, then a normalization of each value
+    cost.flops = 5 * bottom[0]->count();
+  }
+  return cost;
+}
+
+template <typename Dtype>
+LayerCost BackwardCost(Layer<Dtype>* layer, const vector<Blob<Dtype>*>& bottom,
+    const vector<Blob<Dtype>*>& top) {
+  LayerCost cost = ForwardCost(layer, bottom, top);
+  // Data and diffs, of the blobs and of the params
+  cost.bytes *= 2;
+  if (IsWeighted(layer->type())) {
+    cost.flops *= 2;
+  }
+  return cost;
+}
+
+template LayerCost ForwardCost<float>(Layer<float>* layer,
+    const vector<Blob<float>*>& bottom, const vector<Blob<float>*>& top);
+template LayerCost ForwardCost<double>(Layer<double>* layer,
+    const vector<Blob<double>*>& bottom, const vector<Blob<double>*>& top);
+template LayerCost BackwardCost<float>(Layer<float>* layer,
+    const vector<Blob<float>*>& bottom, const vector<Blob<float>*>& top);
+template LayerCost BackwardCost<double>(Layer<double>* layer,
+    const vector<Blob<double>*>& bottom, const vector<Blob<double>*>& top);
+
+// Bytes a last level cache miss reads from memory
+static const int kCacheLineBytes = 64;
+
+Roofline MeasureRoofline(double gflops, double gbps) {
+  Roofline roof = {gflops, gbps};
+  Timer timer;
+  if (roof.gflops <= 0) {
+    const int n = 512;
+    Blob<float> a(1, 1, n, n), b(1, 1, n, n), c(1, 1, n, n);
+    caffe_set(a.count(), 1.f, a.mutable_cpu_data());
+    caffe_set(b.count(), 1.f, b.mutable_cpu_data());
+    for (int i = 0; i < 3; ++i) {
+      timer.Start();
+      caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, n, n, n, 1.f,
+          a.cpu_data(), b.cpu_data(), 0.f, c.mutable_cpu_data());
+      roof.gflops = std::max(roof.gflops,
+          2. * n * n * n / timer.MicroSeconds() / 1e3);
+    }
+  }
+  if (roof.gbps <= 0) {
+    const int n = 1 << 24;
+    Blob<float> a(1, 1, 1, n), b(1, 1, 1, n);
+    caffe_set(a.count(), 1.f, a.mutable_cpu_data());
+    caffe_set(b.count(), 0.f, b.mutable_cpu_data());
+    for (int i = 0; i < 3; ++i) {
+      timer.Start();
+      caffe_copy(n, a.cpu_data(), b.mutable_cpu_data());
+      roof.gbps = std::max(roof.gbps,
+          2. * n * sizeof(float) / timer.MicroSeconds() / 1e3);
+    }
+  }
+  LOG(INFO) << "Roofline: " << roof.gflops << " GFLOP/s, " << roof.gbps
+      << " GB/s, ridge at " << roof.gflops / roof.gbps << " flop/byte.";
+  return roof;
+}
+
+PassCounters AnalyzeCounters(const LayerCost& cost, double mean_ms,
+    const double* counts, const Roofline& roof) {
+  PassCounters analysis = {};
+  const double cycles = counts[PerfCounters::CYCLES];
+  analysis.ipc = cycles > 0 ? counts[PerfCounters::INSTRUCTIONS] / cycles : 0;
+  const double seconds = mean_ms / 1000;
+  if (seconds <= 0) {
+    analysis.bound = "unmeasured";
+    return analysis;
+  }
+  const double dram_bytes = counts[PerfCounters::LLC_MISSES] * kCacheLineBytes;
+  analysis.gflops = cost.flops / seconds / 1e9;
+  analysis.dram_gbps = dram_bytes / seconds / 1e9;
+  analysis.intensity = dram_bytes > 0 ? cost.flops / dram_bytes :
+      (cost.flops > 0 ? HUGE_VAL : 0);
+  const double attainable =
+      std::min(roof.gflops, analysis.intensity * roof.gbps);
+  if (analysis.gflops < attainable / 4 && analysis.dram_gbps < roof.gbps / 4) {
+    analysis.bound = "latency-bound";
+  } else if (analysis.intensity < roof.gflops / roof.gbps) {
+    analysis.bound = "memory-bound";
+  } else {
+    analysis.bound = "compute-bound";
+  }
+  return analysis;
+}
+
+}  // namespace caffe
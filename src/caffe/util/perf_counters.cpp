@@ -0,0 +1,98 @@
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+
+#include "caffe/util/perf_counters.hpp"
+
+namespace caffe {
+
+#ifdef __linux__
+static const uint64_t kConfigs[PerfCounters::NUM_EVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_REFERENCES,
+  PERF_COUNT_HW_CACHE_MISSES,
+};
+#endif
+
+PerfCounters::PerfCounters() {
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    fds_[i] = -1;
+    counts_[i] = 0;
+  }
+#ifdef __linux__
+  // One group, for the counters to cover the same instructions
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));  // NOLINT(caffe/alt_fn)
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = kConfigs[i];
+    attr.disabled = i == CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    fds_[i] = syscall(__NR_perf_event_open, &attr, 0, -1, fds_[CYCLES], 0);
+    if (fds_[CYCLES] < 0) {
+      LOG(WARNING) << "Hardware counters unavailable (" << strerror(errno)
+          << "), see /proc/sys/kernel/perf_event_paranoid";
+      return;
+    }
+    LOG_IF(WARNING, fds_[i] < 0) << "Counter " << name(Event(i))
+        << " unavailable";
+  }
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+  for (int i = NUM_EVENTS - 1; i >= 0; --i) {
+    if (fds_[i] >= 0) {
+      close(fds_[i]);
+    }
+  }
+#endif
+}
+
+void PerfCounters::Start() {
+#ifdef __linux__
+  if (available()) {
+    ioctl(fds_[CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+void PerfCounters::Stop() {
+#ifdef __linux__
+  if (!available()) {
+    return;
+  }
+  ioctl(fds_[CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  for (int i = 0; i < NUM_EVENTS; ++i) {
+    // The count, then the times the counter was enabled and running
+    uint64_t values[3];
+    if (fds_[i] < 0 || read(fds_[i], values, sizeof(values)) !=
+        sizeof(values) || values[2] == 0) {
+      counts_[i] = 0;
+      continue;
+    }
+    counts_[i] = static_cast<double>(values[0]) * values[1] / values[2];
+  }
+#endif
+}
+
+const char* PerfCounters::name(Event event) {
+  static const char* names[NUM_EVENTS] = {
+    "cycles", "instructions", "llc_references", "llc_misses"};
+  return names[event];
+}
+
+}  // namespace caffe
@@ -0,0 +1,75 @@
+#include <boost/thread.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+
+#include "caffe/util/rng.hpp"
+#include "caffe/util/snapshot_writer.hpp"
+#include "caffe/util/trace.hpp"
+
+namespace caffe {
+
+SnapshotWriter::SnapshotWriter(int pending)
+    : files_(pending) {
+  CHECK_GT(pending, 0);
+  for (int i = 0; i < pending; ++i) {
+    free_.push(i);
+  }
+}
+
+SnapshotWriter::~SnapshotWriter() {
+  Wait();
+  StopInternalThread();
+}
+
+void SnapshotWriter::Write(const shared_ptr<google::protobuf::Message>& proto,
+    const string& filename) {
+  if (!is_started()) {
+    // Starting the thread draws its seed from the caller's generator, restore
+    // it so that training does not depend on async snapshots
+    const rng_t state = *caffe_rng();
+    StartInternalThread();
+    *caffe_rng() = state;
+  }
+  const int i = free_.pop("Waiting for a snapshot to be written");
+  files_[i].proto = proto;
+  files_[i].filename = filename;
+  full_.push(i);
+}
+
+void SnapshotWriter::Wait() {
+  for (int i = 0; i < files_.size(); ++i) {
+    free_.pop("Waiting for snapshots to be written");
+  }
+  for (int i = 0; i < files_.size(); ++i) {
+    free_.push(i);
+  }
+}
+
+void SnapshotWriter::InternalThreadEntry() {
+  try {
+    while (!must_stop()) {
+      const int i = full_.pop();
+      File& file = files_[i];
+      TraceScope trace("WriteSnapshot", "snapshot");
+      const string temp = file.filename + ".tmp";
+      int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      CHECK_GE(fd, 0) << "Cannot write snapshot " << temp;
+      CHECK(file.proto->SerializeToFileDescriptor(fd))
+          << "Failed to write snapshot " << temp;
+      CHECK_EQ(fsync(fd), 0) << "Failed to sync snapshot " << temp;
+      CHECK_EQ(close(fd), 0) << "Failed to write snapshot " << temp;
+      CHECK_EQ(rename(temp.c_str(), file.filename.c_str()), 0)
+          << "Failed to rename snapshot " << temp;
+      DLOG(INFO) << "Snapshot " << file.filename << " written";
+      file.proto.reset();
+      free_.push(i);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+}  // namespace caffe
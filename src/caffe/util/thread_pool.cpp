@@ -0,0 +1,54 @@
+#include <boost/thread.hpp>
+
+#include "caffe/util/thread_pool.hpp"
+
+namespace caffe {
+
+ThreadPool::ThreadPool(int size)
+    : task_(NULL) {
+  CHECK_GT(size, 0) << "Thread pool needs at least one worker";
+  for (int i = 0; i < size; ++i) {
+    workers_.push_back(shared_ptr<Worker>(new Worker(this, i)));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  // Workers are joined before the queues they wait on go away
+  workers_.clear();
+}
+
+void ThreadPool::Run(const Task& task) {
+  task_ = &task;
+  for (int i = 0; i < workers_.size(); ++i) {
+    workers_[i]->start_.push(i);
+  }
+  for (int i = 0; i < workers_.size(); ++i) {
+    done_.pop();
+  }
+  task_ = NULL;
+}
+
+//
+
+ThreadPool::Worker::Worker(ThreadPool* pool, int index)
+    : pool_(pool), index_(index) {
+  StartInternalThread();
+}
+
+ThreadPool::Worker::~Worker() {
+  StopInternalThread();
+}
+
+void ThreadPool::Worker::InternalThreadEntry() {
+  try {
+    while (!must_stop()) {
+      start_.pop();
+      (*pool_->task_)(index_);
+      pool_->done_.push(index_);
+    }
+  } catch (boost::thread_interrupted&) {
+    // Interrupted exception is expected on shutdown
+  }
+}
+
+}  // namespace caffe
@@ -0,0 +1,158 @@
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "caffe/util/trace.hpp"
+
+namespace caffe {
+
+namespace {
+
+struct TraceEvent {
+  char name[Trace::kNameSize];
+  const char* category;
+  int64_t begin;
+  int64_t end;
+};
+
+// The ring buffer of a thread, which only that thread writes while recording.
+// An event is announced by incrementing started, written, then published by
+// incrementing count, so that Stop reads the events published without a
+// lock, and drops those the thread overwrote meanwhile.
+struct ThreadEvents {
+  int tid;
+  vector<TraceEvent> ring;
+  uint64_t count;  // Of events recorded, the last ring.size() ones are kept
+  uint64_t started;  // Of events recorded or being recorded
+};
+
+// Buffers outlive their threads, for threads that ended to be written too
+void KeepEvents(ThreadEvents* events) {}
+
+boost::mutex mutex_;  // Guards the list of buffers, starting and stopping
+vector<shared_ptr<ThreadEvents> > threads_;
+boost::thread_specific_ptr<ThreadEvents> current_(KeepEvents);
+boost::posix_time::ptime start_;
+string filename_;  // NOLINT(runtime/string)
+int events_per_thread_;
+
+void WriteJsonString(std::ostream* out, const char* value) {
+  *out << '"';
+  for (const char* c = value; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      *out << '\\' << *c;
+    } else if (static_cast<unsigned char>(*c) >= 0x20) {
+      *out << *c;
+    }
+  }
+  *out << '"';
+}
+
+}  // namespace
+
+bool Trace::enabled_ = false;
+const int Trace::kNameSize;
+
+void Trace::Start(const string& filename, int events_per_thread) {
+  CHECK_GT(events_per_thread, 0);
+  boost::mutex::scoped_lock lock(mutex_);
+  CHECK(!enabled_) << "Trace already started";
+  filename_ = filename;
+  events_per_thread_ = events_per_thread;
+  // Threads only record once enabled, and are done recording since Stop
+  for (int i = 0; i < threads_.size(); ++i) {
+    threads_[i]->ring.resize(events_per_thread);
+    __atomic_store_n(&threads_[i]->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&threads_[i]->started, 0, __ATOMIC_RELAXED);
+  }
+  start_ = boost::posix_time::microsec_clock::universal_time();
+  __atomic_store_n(&enabled_, true, __ATOMIC_RELEASE);
+  LOG(INFO) << "Tracing to " << filename;
+}
+
+void Trace::Stop() {
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!enabled()) {
+    return;
+  }
+  __atomic_store_n(&enabled_, false, __ATOMIC_RELEASE);
+  std::ofstream out(filename_.c_str());
+  CHECK(out) << "Failed to open trace file " << filename_;
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+  int written = 0;
+  vector<TraceEvent> ring;
+  for (int i = 0; i < threads_.size(); ++i) {
+    ThreadEvents& events = *threads_[i];
+    // Threads that saw the trace enabled may still be recording, over the
+    // oldest events read, which are dropped
+    const uint64_t count = __atomic_load_n(&events.count, __ATOMIC_ACQUIRE);
+    ring = events.ring;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const uint64_t started =
+        __atomic_load_n(&events.started, __ATOMIC_RELAXED);
+    const uint64_t size = ring.size();
+    const uint64_t first = std::min(count,
+        started > size ? started - size : 0);
+    for (uint64_t j = first; j < count; ++j) {
+      const TraceEvent& event = ring[j % size];
+      out << (written++ ? ",\n" : "\n") << "{\"name\": ";
+      WriteJsonString(&out, event.name);
+      out << ", \"cat\": \"" << event.category << "\", \"ph\": \"X\", "
+          << "\"ts\": " << event.begin << ", \"dur\": "
+          << event.end - event.begin << ", \"pid\": 0, \"tid\": "
+          << events.tid << "}";
+    }
+  }
+  out << "\n]}\n";
+  CHECK(out) << "Failed to write trace file " << filename_;
+  LOG(INFO) << "Wrote " << written << " trace events to " << filename_;
+}
+
+int64_t Trace::Now() {
+  return (boost::posix_time::microsec_clock::universal_time() - start_)
+      .total_microseconds();
+}
+
+void Trace::Record(const char* name, const char* category, int64_t begin,
+    int64_t end) {
+  if (!enabled()) {
+    return;
+  }
+  ThreadEvents* events = current_.get();
+  if (!events) {
+    boost::mutex::scoped_lock lock(mutex_);
+    shared_ptr<ThreadEvents> created(new ThreadEvents());
+    created->tid = threads_.size();
+    created->ring.resize(events_per_thread_);
+    created->count = 0;
+    created->started = 0;
+    threads_.push_back(created);
+    events = created.get();
+    current_.reset(events);
+  }
+  // Only this thread writes the counts, Stop reads them
+  const uint64_t count = events->count;
+  __atomic_store_n(&events->started, count + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  TraceEvent& event = events->ring[count % events->ring.size()];
+  strncpy(event.name, name, sizeof(event.name) - 1);
+  event.name[sizeof(event.name) - 1] = '\0';
+  event.category = category;
+  event.begin = begin;
+  event.end = end;
+  __atomic_store_n(&events->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void TraceScope::Begin(const char* name, const char* category) {
+  strncpy(name_, name, sizeof(name_) - 1);
+  name_[sizeof(name_) - 1] = '\0';
+  category_ = category;
+  begin_ = Trace::Now();
+}
+
+}  // namespace caffe
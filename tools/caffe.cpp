@@ -6,14 +6,21 @@ namespace bp = boost::python;
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
 #include "caffe/caffe.hpp"
+#include "caffe/util/layer_cost.hpp"
+#include "caffe/util/perf_counters.hpp"
 #include "caffe/util/signal_handler.h"
+#include "caffe/util/trace.hpp"
 
 using caffe::Blob;
 using caffe::Caffe;
@@ -30,6 +37,15 @@ DEFINE_string(gpu, "",
     "Optional; run in GPU mode on given device IDs separated by ','."
     "Use '-gpu all' to run on all available GPUs. The effective training "
     "batch size is multiplied by the number of devices.");
+DEFINE_int32(replicas, 1,
+    "Optional; in CPU mode, train that many solver replicas, each on its own "
+    "thread. The effective training batch size is multiplied by the number "
+    "of replicas. BLAS should then be single-threaded, e.g. with "
+    "OMP_NUM_THREADS=1. Not supported with pruning.");
+DEFINE_int32(bucket_kb, 1024,
+    "Optional; with replicas, reduce the gradients of the last layers while "
+    "the first ones are still back-propagating, in buckets of at least that "
+    "many KB. 0 reduces all gradients after backward.");
 DEFINE_string(solver, "",
     "The solver definition protocol buffer text file.");
 DEFINE_string(model, "",
@@ -48,6 +64,32 @@ DEFINE_string(weights, "",
     "separated by ','. Cannot be set simultaneously with snapshot.");
 DEFINE_int32(iterations, 50,
     "The number of iterations to run.");
+DEFINE_int32(warmup, 1,
+    "Optional; the number of iterations to run before timing. Only used for "
+    "'time'.");
+DEFINE_bool(forward_only, false,
+    "Optional; time only the forward pass, as in inference, which phase TEST "
+    "implies. Only used for 'time'.");
+DEFINE_string(json, "",
+    "Optional; the file to write the times, per layer and of the net, and "
+    "their flops and bytes to as JSON. Only used for 'time'.");
+DEFINE_bool(counters, false,
+    "Optional; also count the cycles, instructions and cache misses of each "
+    "layer with hardware counters, and tell whether it is compute, memory or "
+    "latency-bound. Counts only the calling thread: set OMP_NUM_THREADS=1. "
+    "The times of the net leave out reading the counters. Only used for "
+    "'time' on the CPU.");
+DEFINE_double(peak_gflops, 0,
+    "Optional; the GFLOP/s a thread attains, that --counters classifies "
+    "layers against. Measured with a gemm if 0.");
+DEFINE_double(peak_gbps, 0,
+    "Optional; the memory GB/s a thread attains, that --counters classifies "
+    "layers against. Measured with a copy if 0.");
+DEFINE_string(trace, "",
+    "Optional; record layers, data loading, solver steps, gradient "
+    "reductions and snapshots to that file as Chrome trace events, for "
+    "chrome://tracing or Perfetto. Defaults to the CAFFE_TRACE environment "
+    "variable.");
 DEFINE_string(sigint_effect, "stop",
              "Optional; action to take when a SIGINT signal is received: "
               "snapshot, stop or none.");
@@ -206,10 +248,14 @@ int train() {
 
   vector<int> gpus;
   get_gpus(&gpus);
+  CHECK_GE(FLAGS_replicas, 1);
   if (gpus.size() == 0) {
     LOG(INFO) << "Use CPU.";
     Caffe::set_mode(Caffe::CPU);
+    Caffe::set_solver_count(FLAGS_replicas);
   } else {
+    CHECK_EQ(FLAGS_replicas, 1) << "Replicas are for CPU mode, give several "
+        << "GPUs to train on them in parallel.";
     ostringstream s;
     for (int i = 0; i < gpus.size(); ++i) {
       s << (i ? ", " : "") << gpus[i];
@@ -247,6 +293,10 @@ int train() {
   if (gpus.size() > 1) {
     caffe::P2PSync<float> sync(solver, NULL, solver->param());
     sync.Run(gpus);
+  } else if (FLAGS_replicas > 1) {
+    caffe::CPUSync<float> sync(solver, NULL, 0);
+    CHECK_GE(FLAGS_bucket_kb, 0);
+    sync.Run(FLAGS_replicas, FLAGS_bucket_kb * 1024);
   } else {
     LOG(INFO) << "Starting Optimization";
     solver->Solve();
@@ -330,12 +380,108 @@ int test() {
 RegisterBrewFunction(test);
 
 
+// Per-pass stats of a layer or of the net, for the time report
+struct PassTimes {
+  caffe::TimeStats ms;
+  caffe::LayerCost cost;
+  double counts[caffe::PerfCounters::NUM_EVENTS];  // Per iteration
+};
+
+// Adds the counts of a pass, divided by the iterations
+static void AccumulateCounts(const caffe::PerfCounters& counters,
+    PassTimes* times) {
+  for (int e = 0; e < caffe::PerfCounters::NUM_EVENTS; ++e) {
+    times->counts[e] +=
+        counters.count(caffe::PerfCounters::Event(e)) / FLAGS_iterations;
+  }
+}
+
+static void AddCounts(const PassTimes& part, PassTimes* total) {
+  for (int e = 0; e < caffe::PerfCounters::NUM_EVENTS; ++e) {
+    total->counts[e] += part.counts[e];
+  }
+}
+
+// The counts are means per iteration, so are the times they are divided by
+static caffe::PassCounters AnalyzeCounters(const PassTimes& times,
+    const caffe::Roofline& roof) {
+  return caffe::AnalyzeCounters(times.cost, times.ms.mean, times.counts,
+      roof);
+}
+
+static void LogPassCounters(const string& name, const char* pass,
+    const PassTimes& times, const caffe::Roofline& roof) {
+  const caffe::PassCounters analysis = AnalyzeCounters(times, roof);
+  LOG(INFO) << std::setfill(' ') << std::setw(10) << name << "\t" << pass
+      << ": IPC " << analysis.ipc << ", " << analysis.gflops << " GFLOP/s, "
+      << analysis.dram_gbps << " DRAM GB/s, " << analysis.intensity
+      << " flop/byte, " << analysis.bound << ".";
+}
+
+static void LogPassTimes(const string& name, const char* pass,
+    const PassTimes& times) {
+  LOG(INFO) << std::setfill(' ') << std::setw(10) << name << "\t" << pass
+      << ": " << times.ms.mean << " ms, median " << times.ms.median
+      << ", p90 " << times.ms.p90 << ", p99 " << times.ms.p99 << ", "
+      << times.cost.flops / times.ms.median / 1e6 << " GFLOP/s, "
+      << times.cost.bytes / times.ms.median / 1e6 << " GB/s.";
+}
+
+static string JsonString(const string& value) {
+  ostringstream json;
+  json << '"';
+  for (int i = 0; i < value.size(); ++i) {
+    if (value[i] == '"' || value[i] == '\\') {
+      json << '\\' << value[i];
+    } else if (static_cast<unsigned char>(value[i]) < 0x20) {
+      json << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+          << static_cast<int>(value[i]) << std::dec;
+    } else {
+      json << value[i];
+    }
+  }
+  json << '"';
+  return json.str();
+}
+
+// The roofline is NULL without counters
+static void WritePassTimes(std::ostream* json, const char* pass,
+    const PassTimes& times, const caffe::Roofline* roof) {
+  *json << JsonString(pass) << ": {\"mean_ms\": " << times.ms.mean
+      << ", \"stddev_ms\": " << times.ms.stddev
+      << ", \"median_ms\": " << times.ms.median
+      << ", \"p90_ms\": " << times.ms.p90
+      << ", \"p99_ms\": " << times.ms.p99
+      << ", \"flops\": " << times.cost.flops
+      << ", \"bytes\": " << times.cost.bytes;
+  if (roof) {
+    using caffe::PerfCounters;
+    const caffe::PassCounters analysis = AnalyzeCounters(times, *roof);
+    *json << ", \"counters\": {";
+    for (int e = 0; e < PerfCounters::NUM_EVENTS; ++e) {
+      *json << JsonString(PerfCounters::name(PerfCounters::Event(e))) << ": "
+          << times.counts[e] << ", ";
+    }
+    // JSON has no infinity
+    *json << "\"ipc\": " << analysis.ipc
+        << ", \"gflops\": " << analysis.gflops
+        << ", \"dram_gbps\": " << analysis.dram_gbps
+        << ", \"intensity\": "
+        << std::min(analysis.intensity, std::numeric_limits<double>::max())
+        << ", \"bound\": " << JsonString(analysis.bound) << "}";
+  }
+  *json << "}";
+}
+
 // Time: benchmark the execution time of a model.
 int time() {
-    
   CHECK_GT(FLAGS_model.size(), 0) << "Need a model definition to time.";
+  CHECK_GT(FLAGS_iterations, 0) << "Need iterations to time.";
+  CHECK_GE(FLAGS_warmup, 0);
   caffe::Phase phase = get_phase_from_flags(caffe::TRAIN);
   vector<string> stages = get_stages_from_flags();
+  // Inference does not back-propagate
+  const bool forward_only = FLAGS_forward_only || phase == caffe::TEST;
 
   // Set device id and mode
   vector<int> gpus;
@@ -348,19 +494,37 @@ int time() {
     LOG(INFO) << "Use CPU.";
     Caffe::set_mode(Caffe::CPU);
   }
+  // Hardware counters count the CPU passes of this thread
+  shared_ptr<caffe::PerfCounters> counters;
+  caffe::Roofline roof = {};
+  if (FLAGS_counters) {
+    CHECK_EQ(gpus.size(), 0) << "Counters only count layers on the CPU.";
+    counters.reset(new caffe::PerfCounters());
+    if (counters->available()) {
+      roof = caffe::MeasureRoofline(FLAGS_peak_gflops, FLAGS_peak_gbps);
+    } else {
+      LOG(WARNING) << "No hardware counters, timing without them.";
+      counters.reset();
+    }
+  }
   // Instantiate the caffe net.
   Net<float> caffe_net(FLAGS_model, phase, FLAGS_level, &stages);
 
-  // Do a clean forward and backward pass, so that memory allocation are done
-  // and future iterations will be more stable.
-  LOG(INFO) << "Performing Forward";
+  // Do clean passes, so that memory allocation are done and caches and clocks
+  // settle, and future iterations will be more stable.
   // Note that for the speed benchmark, we will assume that the network does
   // not take any input blobs.
-  float initial_loss;
-  caffe_net.Forward(&initial_loss);
-  LOG(INFO) << "Initial loss: " << initial_loss;
-  LOG(INFO) << "Performing Backward";
-  caffe_net.Backward();
+  LOG(INFO) << "Performing " << FLAGS_warmup << " warmup iterations";
+  for (int j = 0; j < FLAGS_warmup; ++j) {
+    float loss;
+    caffe_net.Forward(&loss);
+    if (j == 0) {
+      LOG(INFO) << "Initial loss: " << loss;
+    }
+    if (!forward_only) {
+      caffe_net.Backward();
+    }
+  }
 
   const vector<shared_ptr<Layer<float> > >& layers = caffe_net.layers();
   const vector<vector<Blob<float>*> >& bottom_vecs = caffe_net.bottom_vecs();
@@ -368,57 +532,164 @@ int time() {
   const vector<vector<bool> >& bottom_need_backward =
       caffe_net.bottom_need_backward();
   LOG(INFO) << "*** Benchmark begins ***";
-  LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations.";
-  Timer total_timer;
-  total_timer.Start();
+  LOG(INFO) << "Testing for " << FLAGS_iterations << " iterations"
+      << (forward_only ? ", forward only." : ".");
   Timer forward_timer;
   Timer backward_timer;
   Timer timer;
-  std::vector<double> forward_time_per_layer(layers.size(), 0.0);
-  std::vector<double> backward_time_per_layer(layers.size(), 0.0);
-  double forward_time = 0.0;
-  double backward_time = 0.0;
+  // Milliseconds per iteration, of each layer and of the net
+  vector<vector<double> > forward_layer_ms(layers.size());
+  vector<vector<double> > backward_layer_ms(layers.size());
+  vector<double> forward_ms, backward_ms, iter_ms;
+  vector<PassTimes> forward_layer(layers.size()), backward_layer(layers.size());
+  PassTimes forward = {}, backward = {}, forward_backward = {};
   for (int j = 0; j < FLAGS_iterations; ++j) {
     Timer iter_timer;
     iter_timer.Start();
     forward_timer.Start();
+    // Milliseconds spent starting, stopping and reading the counters, which
+    // are left out of the times of the net too
+    double forward_counters_ms = 0, backward_counters_ms = 0;
     for (int i = 0; i < layers.size(); ++i) {
+      if (counters) {
+        timer.Start();
+        counters->Start();
+        forward_counters_ms += timer.MicroSeconds() / 1000;
+      }
       timer.Start();
       layers[i]->Forward(bottom_vecs[i], top_vecs[i]);
-      forward_time_per_layer[i] += timer.MicroSeconds();
+      forward_layer_ms[i].push_back(timer.MicroSeconds() / 1000);
+      if (counters) {
+        timer.Start();
+        counters->Stop();
+        AccumulateCounts(*counters, &forward_layer[i]);
+        forward_counters_ms += timer.MicroSeconds() / 1000;
+      }
     }
-    forward_time += forward_timer.MicroSeconds();
-    backward_timer.Start();
-    for (int i = layers.size() - 1; i >= 0; --i) {
-      timer.Start();
-      layers[i]->Backward(top_vecs[i], bottom_need_backward[i],
-                          bottom_vecs[i]);
-      backward_time_per_layer[i] += timer.MicroSeconds();
+    forward_ms.push_back(forward_timer.MicroSeconds() / 1000 -
+        forward_counters_ms);
+    if (!forward_only) {
+      backward_timer.Start();
+      for (int i = layers.size() - 1; i >= 0; --i) {
+        if (counters) {
+          timer.Start();
+          counters->Start();
+          backward_counters_ms += timer.MicroSeconds() / 1000;
+        }
+        timer.Start();
+        layers[i]->Backward(top_vecs[i], bottom_need_backward[i],
+                            bottom_vecs[i]);
+        backward_layer_ms[i].push_back(timer.MicroSeconds() / 1000);
+        if (counters) {
+          timer.Start();
+          counters->Stop();
+          AccumulateCounts(*counters, &backward_layer[i]);
+          backward_counters_ms += timer.MicroSeconds() / 1000;
+        }
+      }
+      backward_ms.push_back(backward_timer.MicroSeconds() / 1000 -
+          backward_counters_ms);
     }
-    backward_time += backward_timer.MicroSeconds();
-    LOG(INFO) << "Iteration: " << j + 1 << " forward-backward time: "
-      << iter_timer.MilliSeconds() << " ms.";
+    iter_ms.push_back(iter_timer.MicroSeconds() / 1000 - forward_counters_ms -
+        backward_counters_ms);
+    LOG(INFO) << "Iteration: " << j + 1
+      << (forward_only ? " forward" : " forward-backward") << " time: "
+      << iter_ms.back() << " ms.";
   }
-  LOG(INFO) << "Average time per layer: ";
+
+  LOG(INFO) << "Time per layer: ";
   for (int i = 0; i < layers.size(); ++i) {
     const caffe::string& layername = layers[i]->layer_param().name();
-    LOG(INFO) << std::setfill(' ') << std::setw(10) << layername <<
-      "\tforward: " << forward_time_per_layer[i] / 1000 /
-      FLAGS_iterations << " ms.";
-    LOG(INFO) << std::setfill(' ') << std::setw(10) << layername  <<
-      "\tbackward: " << backward_time_per_layer[i] / 1000 /
-      FLAGS_iterations << " ms.";
+    forward_layer[i].ms = caffe::ComputeTimeStats(forward_layer_ms[i]);
+    forward_layer[i].cost = caffe::ForwardCost(layers[i].get(),
+        bottom_vecs[i], top_vecs[i]);
+    forward.cost.flops += forward_layer[i].cost.flops;
+    forward.cost.bytes += forward_layer[i].cost.bytes;
+    LogPassTimes(layername, "forward", forward_layer[i]);
+    AddCounts(forward_layer[i], &forward);
+    if (!forward_only) {
+      backward_layer[i].ms = caffe::ComputeTimeStats(backward_layer_ms[i]);
+      backward_layer[i].cost = caffe::BackwardCost(layers[i].get(),
+          bottom_vecs[i], top_vecs[i]);
+      backward.cost.flops += backward_layer[i].cost.flops;
+      backward.cost.bytes += backward_layer[i].cost.bytes;
+      LogPassTimes(layername, "backward", backward_layer[i]);
+      AddCounts(backward_layer[i], &backward);
+    }
+  }
+  forward.ms = caffe::ComputeTimeStats(forward_ms);
+  LogPassTimes("net", "forward", forward);
+  if (!forward_only) {
+    backward.ms = caffe::ComputeTimeStats(backward_ms);
+    LogPassTimes("net", "backward", backward);
+    forward_backward.ms = caffe::ComputeTimeStats(iter_ms);
+    forward_backward.cost.flops = forward.cost.flops + backward.cost.flops;
+    forward_backward.cost.bytes = forward.cost.bytes + backward.cost.bytes;
+    AddCounts(forward, &forward_backward);
+    AddCounts(backward, &forward_backward);
+    LogPassTimes("net", "forward-backward", forward_backward);
+  }
+  if (counters) {
+    LOG(INFO) << "Counters per layer: ";
+    for (int i = 0; i < layers.size(); ++i) {
+      const caffe::string& layername = layers[i]->layer_param().name();
+      LogPassCounters(layername, "forward", forward_layer[i], roof);
+      if (!forward_only) {
+        LogPassCounters(layername, "backward", backward_layer[i], roof);
+      }
+    }
+    LogPassCounters("net", "forward", forward, roof);
+    if (!forward_only) {
+      LogPassCounters("net", "backward", backward, roof);
+      LogPassCounters("net", "forward-backward", forward_backward, roof);
+    }
   }
-  total_timer.Stop();
-  LOG(INFO) << "Average Forward pass: " << forward_time / 1000 /
-    FLAGS_iterations << " ms.";
-  LOG(INFO) << "Average Backward pass: " << backward_time / 1000 /
-    FLAGS_iterations << " ms.";
-  LOG(INFO) << "Average Forward-Backward: " << total_timer.MilliSeconds() /
-    FLAGS_iterations << " ms.";
-  LOG(INFO) << "Total Time: " << total_timer.MilliSeconds() << " ms.";
+  double total_ms = 0;
+  for (int j = 0; j < iter_ms.size(); ++j) {
+    total_ms += iter_ms[j];
+  }
+  LOG(INFO) << "Total Time: " << total_ms << " ms.";
   LOG(INFO) << "*** Benchmark ends ***";
 
+  if (FLAGS_json.size()) {
+    std::ofstream json(FLAGS_json.c_str());
+    CHECK(json) << "Failed to open " << FLAGS_json;
+    const caffe::Roofline* json_roof = counters ? &roof : NULL;
+    json << "{\"model\": " << JsonString(FLAGS_model)
+        << ", \"phase\": " << JsonString(caffe::Phase_Name(phase))
+        << ", \"mode\": " << JsonString(gpus.size() ? "GPU" : "CPU")
+        << ", \"warmup\": " << FLAGS_warmup
+        << ", \"iterations\": " << FLAGS_iterations
+        << ", \"forward_only\": " << (forward_only ? "true" : "false");
+    if (counters) {
+      json << ", \"peak_gflops\": " << roof.gflops
+          << ", \"peak_gbps\": " << roof.gbps;
+    }
+    json << ",\n \"net\": {";
+    WritePassTimes(&json, "forward", forward, json_roof);
+    if (!forward_only) {
+      json << ", ";
+      WritePassTimes(&json, "backward", backward, json_roof);
+      json << ", ";
+      WritePassTimes(&json, "forward_backward", forward_backward,
+          json_roof);
+    }
+    json << "},\n \"layers\": [";
+    for (int i = 0; i < layers.size(); ++i) {
+      json << (i ? ",\n  " : "\n  ") << "{\"name\": "
+          << JsonString(layers[i]->layer_param().name()) << ", \"type\": "
+          << JsonString(layers[i]->type()) << ", ";
+      WritePassTimes(&json, "forward", forward_layer[i], json_roof);
+      if (!forward_only) {
+        json << ", ";
+        WritePassTimes(&json, "backward", backward_layer[i], json_roof);
+      }
+      json << "}";
+    }
+    json << "]}\n";
+    CHECK(json) << "Failed to write " << FLAGS_json;
+    LOG(INFO) << "Wrote the times to " << FLAGS_json;
+  }
   return 0;
 }
 RegisterBrewFunction(time);
@@ -439,16 +710,25 @@ int main(int argc, char** argv) {
   // Run tool or show usage.
   caffe::GlobalInit(&argc, &argv);
   if (argc == 2) {
+    if (FLAGS_trace.empty() && getenv("CAFFE_TRACE")) {
+      FLAGS_trace = getenv("CAFFE_TRACE");
+    }
+    if (FLAGS_trace.size()) {
+      caffe::Trace::Start(FLAGS_trace);
+    }
+    int result;
 #ifdef WITH_PYTHON_LAYER
     try {
 #endif
-      return GetBrewFunction(caffe::string(argv[1]))();
+      result = GetBrewFunction(caffe::string(argv[1]))();
 #ifdef WITH_PYTHON_LAYER
     } catch (bp::error_already_set) {
       PyErr_Print();
       return 1;
     }
 #endif
+    caffe::Trace::Stop();
+    return result;
   } else {
     gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/caffe");
   }
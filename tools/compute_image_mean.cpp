@@ -1,14 +1,18 @@
 #include <stdint.h>
 #include <algorithm>
+#include <cmath>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
@@ -19,7 +23,113 @@ using std::pair;
 using boost::scoped_ptr;
 
 DEFINE_string(backend, "lmdb",
-        "The backend {leveldb, lmdb} containing the images");
+        "The backend {leveldb, lmdb, packed} containing the images");
+DEFINE_int32(threads, 0,
+    "Number of threads, each summing a range of the images, 0 for one per "
+    "core");
+DEFINE_string(transform_param, "",
+    "Optional: also compute the standard deviation of each channel, and "
+    "write a transform_param with the mean of each channel and a scale "
+    "normalizing their average standard deviation to 1 to this file");
+
+#ifdef USE_OPENCV
+// Sums of a range of the images, computed by one thread
+struct Shard {
+  string key;  // First key of the range
+  size_t begin;
+  size_t count;
+
+  int images;
+  // uint8 pixels are summed as integers, and flushed to the double sums
+  // before they could overflow
+  vector<uint32_t> sum8;
+  int pending8;
+  vector<double> sum;
+  vector<double> channel_squares;  // Sums of squares of each channel
+};
+
+static const int kMaxPending8 = (1 << 24) - 1;  // 255 * 2^24 < 2^32
+
+static void flush8(Shard* shard) {
+  for (int i = 0; i < shard->sum.size(); ++i) {
+    shard->sum[i] += shard->sum8[i];
+    shard->sum8[i] = 0;
+  }
+  shard->pending8 = 0;
+}
+
+static void SumImages(db::Cursor* cursor, const vector<int>& shape,
+    bool squares, Shard* shard) {
+  const int channels = shape[0];
+  const int dim = shape[1] * shape[2];
+  const int data_size = channels * dim;
+  shard->images = 0;
+  shard->sum8.assign(data_size, 0);
+  shard->pending8 = 0;
+  shard->sum.assign(data_size, 0.);
+  shard->channel_squares.assign(channels, 0.);
+  if (cursor->size() > 0) {
+    cursor->SeekToIndex(shard->begin);
+  } else {
+    cursor->Seek(shard->key);
+  }
+  Datum datum;
+  for (; shard->images < shard->count; cursor->Next()) {
+    CHECK(cursor->valid());
+    // Raw records of packed databases are summed in place, and values are
+    // parsed without a copy when the backend allows it
+    const char* data;
+    size_t size;
+    if (!cursor->record(&datum, &data, &size)) {
+      const char* value = cursor->pinned_value(&size);
+      if (value) {
+        datum.ParseFromArray(value, size);
+      } else {
+        datum.ParseFromString(cursor->value());
+      }
+      DecodeDatumNative(&datum);
+      data = datum.data().data();
+      size = datum.data().size();
+    }
+    const int size_in_datum = std::max<int>(size, datum.float_data_size());
+    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
+        size_in_datum;
+    if (size != 0) {
+      const uint8_t* pixels = reinterpret_cast<const uint8_t*>(data);
+      uint32_t* sum8 = &shard->sum8[0];
+      for (int i = 0; i < data_size; ++i) {
+        sum8[i] += pixels[i];
+      }
+      if (++shard->pending8 == kMaxPending8) {
+        flush8(shard);
+      }
+      for (int c = 0; squares && c < channels; ++c) {
+        const uint8_t* channel = pixels + c * dim;
+        uint64_t channel_squares = 0;
+        for (int i = 0; i < dim; ++i) {
+          channel_squares += static_cast<uint32_t>(channel[i]) * channel[i];
+        }
+        shard->channel_squares[c] += channel_squares;
+      }
+    } else {
+      const float* values = datum.float_data().data();
+      for (int i = 0; i < data_size; ++i) {
+        shard->sum[i] += values[i];
+      }
+      for (int c = 0; squares && c < channels; ++c) {
+        const float* channel = values + c * dim;
+        double channel_squares = 0;
+        for (int i = 0; i < dim; ++i) {
+          channel_squares += channel[i] * channel[i];
+        }
+        shard->channel_squares[c] += channel_squares;
+      }
+    }
+    ++shard->images;
+  }
+  flush8(shard);
+}
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
   ::google::InitGoogleLogging(argv[0]);
@@ -45,8 +155,6 @@ int main(int argc, char** argv) {
   db->Open(argv[1], db::READ);
   scoped_ptr<db::Cursor> cursor(db->NewCursor());
 
-  BlobProto sum_blob;
-  int count = 0;
   // load first datum
   Datum datum;
   datum.ParseFromString(cursor->value());
@@ -55,51 +163,80 @@ int main(int argc, char** argv) {
     LOG(INFO) << "Decoding Datum";
   }
 
+  BlobProto sum_blob;
   sum_blob.set_num(1);
   sum_blob.set_channels(datum.channels());
   sum_blob.set_height(datum.height());
   sum_blob.set_width(datum.width());
-  const int data_size = datum.channels() * datum.height() * datum.width();
-  int size_in_datum = std::max<int>(datum.data().size(),
-                                    datum.float_data_size());
-  for (int i = 0; i < size_in_datum; ++i) {
-    sum_blob.add_data(0.);
+  vector<int> shape(3);
+  shape[0] = datum.channels();
+  shape[1] = datum.height();
+  shape[2] = datum.width();
+
+  // Split the images in contiguous ranges, one per thread. Only keys are
+  // visited to find the ranges, and backends with random access are not
+  // scanned at all.
+  const bool random_access = cursor->size() > 0;
+  size_t total = cursor->size();
+  for (; !random_access && cursor->valid(); cursor->Next()) {
+    ++total;
   }
-  LOG(INFO) << "Starting Iteration";
-  while (cursor->valid()) {
-    Datum datum;
-    datum.ParseFromString(cursor->value());
-    DecodeDatumNative(&datum);
-
-    const std::string& data = datum.data();
-    size_in_datum = std::max<int>(datum.data().size(),
-        datum.float_data_size());
-    CHECK_EQ(size_in_datum, data_size) << "Incorrect data field size " <<
-        size_in_datum;
-    if (data.size() != 0) {
-      CHECK_EQ(data.size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) + (uint8_t)data[i]);
-      }
-    } else {
-      CHECK_EQ(datum.float_data_size(), size_in_datum);
-      for (int i = 0; i < size_in_datum; ++i) {
-        sum_blob.set_data(i, sum_blob.data(i) +
-            static_cast<float>(datum.float_data(i)));
+  const int threads = std::max<int>(1, std::min<size_t>(total,
+      FLAGS_threads > 0 ? FLAGS_threads :
+      boost::thread::hardware_concurrency()));
+  vector<Shard> shards(threads);
+  cursor->SeekToFirst();
+  size_t index = 0;
+  for (int t = 0; t < threads; ++t) {
+    shards[t].begin = total * t / threads;
+    shards[t].count = total * (t + 1) / threads - shards[t].begin;
+    if (!random_access) {
+      for (; index < shards[t].begin; ++index) {
+        cursor->Next();
       }
+      shards[t].key = cursor->key();
     }
-    ++count;
-    if (count % 10000 == 0) {
-      LOG(INFO) << "Processed " << count << " files.";
-    }
-    cursor->Next();
   }
+  cursor.reset();
 
-  if (count % 10000 != 0) {
-    LOG(INFO) << "Processed " << count << " files.";
+  LOG(INFO) << "Starting Iteration over " << total << " images with "
+      << threads << " threads";
+  const bool squares = !FLAGS_transform_param.empty();
+  CPUTimer timer;
+  timer.Start();
+  // Cursors are made here, as making one is not thread safe for every
+  // backend, e.g. LMDB
+  vector<shared_ptr<db::Cursor> > cursors(threads);
+  for (int t = 0; t < threads; ++t) {
+    cursors[t].reset(db->NewCursor());
+  }
+  boost::thread_group group;
+  for (int t = 0; t < threads; ++t) {
+    group.create_thread(boost::bind(&SumImages, cursors[t].get(), shape,
+        squares, &shards[t]));
+  }
+  group.join_all();
+  cursors.clear();
+
+  // Reduce the shards
+  int count = 0;
+  const int data_size = shape[0] * shape[1] * shape[2];
+  vector<double> sum(data_size, 0.);
+  vector<double> channel_squares(shape[0], 0.);
+  for (int t = 0; t < threads; ++t) {
+    count += shards[t].images;
+    for (int i = 0; i < data_size; ++i) {
+      sum[i] += shards[t].sum[i];
+    }
+    for (int c = 0; c < shape[0]; ++c) {
+      channel_squares[c] += shards[t].channel_squares[c];
+    }
   }
-  for (int i = 0; i < sum_blob.data_size(); ++i) {
-    sum_blob.set_data(i, sum_blob.data(i) / count);
+  LOG(INFO) << "Processed " << count << " files, "
+      << count / (timer.MilliSeconds() / 1000) << " images/s.";
+  CHECK_GT(count, 0) << "No images in " << argv[1];
+  for (int i = 0; i < data_size; ++i) {
+    sum_blob.add_data(sum[i] / count);
   }
   // Write to disk
   if (argc == 3) {
@@ -116,6 +253,24 @@ int main(int argc, char** argv) {
     }
     LOG(INFO) << "mean_value channel [" << c << "]:" << mean_values[c] / dim;
   }
+  if (squares) {
+    TransformationParameter transform_param;
+    double average_std = 0;
+    for (int c = 0; c < channels; ++c) {
+      const double mean = mean_values[c] / dim;
+      const double variance = std::max(0.,
+          channel_squares[c] / (static_cast<double>(count) * dim) -
+          mean * mean);
+      LOG(INFO) << "std channel [" << c << "]:" << sqrt(variance);
+      transform_param.add_mean_value(mean);
+      average_std += sqrt(variance) / channels;
+    }
+    if (average_std > 0) {
+      transform_param.set_scale(1. / average_std);
+    }
+    LOG(INFO) << "Write transform_param to " << FLAGS_transform_param;
+    WriteProtoToTextFile(transform_param, FLAGS_transform_param);
+  }
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -1,5 +1,5 @@
-// This program converts a set of images to a lmdb/leveldb by storing them
-// as Datum proto buffers.
+// This program converts a set of images to a lmdb/leveldb/packed db by storing
+// them as Datum proto buffers, or raw records for packed dbs.
 // Usage:
 //   convert_imageset [FLAGS] ROOTFOLDER/ LISTFILE DB_NAME
 //
@@ -7,6 +7,10 @@
 // should be a list of files as well as their labels, in the format as
 //   subfolder1/file1.JPEG 7
 //   ....
+//
+// Images are read, decoded and resized in parallel, and written in the order
+// of LISTFILE: reader threads load the files, worker threads decode them,
+// and the main thread writes them, committing in large transactions.
 
 #include <algorithm>
 #include <fstream>  // NOLINT(readability/streams)
@@ -15,10 +19,14 @@
 #include <vector>
 
 #include "boost/scoped_ptr.hpp"
+#include "boost/thread.hpp"
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "caffe/common.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
@@ -33,7 +41,9 @@ DEFINE_bool(gray, false,
 DEFINE_bool(shuffle, false,
     "Randomly shuffle the order of images and their labels");
 DEFINE_string(backend, "lmdb",
-        "The backend {lmdb, leveldb} for storing the result");
+        "The backend {lmdb, leveldb, packed} for storing the result. Packed "
+        "databases hold raw images of a single shape, see resize_height and "
+        "resize_width");
 DEFINE_int32(resize_width, 0, "Width images are resized to");
 DEFINE_int32(resize_height, 0, "Height images are resized to");
 DEFINE_bool(check_size, false,
@@ -42,6 +52,95 @@ DEFINE_bool(encoded, false,
     "When this option is on, the encoded image will be save in datum");
 DEFINE_string(encode_type, "",
     "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_int32(threads, 0,
+    "Number of threads decoding and resizing images, 0 for one per core");
+DEFINE_int32(readers, 2, "Number of threads reading image files");
+DEFINE_int32(commit_mb, 64,
+    "Size of the database transactions, in MB of serialized images");
+
+#ifdef USE_OPENCV
+// An image being converted
+struct Slot {
+  Datum datum;
+  string value;  // Serialized datum
+  bool status;
+};
+
+// State shared by the reader and worker threads. Images go through a window
+// of slots, image i using slot i % slots.size(). Readers take a token from
+// free_slots for each image they start, and the writer gives it back once
+// the image is written, so at most slots.size() images are in flight.
+struct Pipeline {
+  string root_folder;
+  vector<std::pair<string, int> > lines;
+  string encode_type;
+  bool encoded;
+  bool is_color;
+  int resize_height;
+  int resize_width;
+
+  vector<Slot> slots;
+  boost::mutex mutex;
+  int next_line;  // Next image to read
+  BlockingQueue<int> free_slots;
+  BlockingQueue<int> read;  // Images read, -1 to stop the workers
+  BlockingQueue<int> done;  // Images converted
+};
+
+static void ReadImages(Pipeline* pipeline) {
+  while (true) {
+    pipeline->free_slots.pop();
+    int line_id;
+    {
+      boost::mutex::scoped_lock lock(pipeline->mutex);
+      line_id = pipeline->next_line++;
+    }
+    if (line_id >= pipeline->lines.size()) {
+      return;
+    }
+    Slot& slot = pipeline->slots[line_id % pipeline->slots.size()];
+    slot.datum.Clear();
+    slot.status = ReadFileToDatum(pipeline->root_folder +
+        pipeline->lines[line_id].first, &slot.datum);
+    pipeline->read.push(line_id);
+  }
+}
+
+static void ConvertImages(Pipeline* pipeline) {
+  string content;
+  while (true) {
+    const int line_id = pipeline->read.pop();
+    if (line_id < 0) {
+      return;
+    }
+    Slot& slot = pipeline->slots[line_id % pipeline->slots.size()];
+    const string& fn = pipeline->lines[line_id].first;
+    if (slot.status) {
+      std::string enc = pipeline->encode_type;
+      if (pipeline->encoded && !enc.size()) {
+        // Guess the encoding type from the file name
+        size_t p = fn.rfind('.');
+        if ( p == fn.npos )
+          LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+        enc = fn.substr(p);
+        std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+      }
+      content.clear();
+      slot.datum.mutable_data()->swap(content);
+      slot.status = DecodeImageToDatum(pipeline->root_folder + fn, content,
+          pipeline->lines[line_id].second, pipeline->resize_height,
+          pipeline->resize_width, pipeline->is_color, enc, &slot.datum);
+    } else {
+      LOG(ERROR) << "Could not open or find file "
+          << pipeline->root_folder + fn;
+    }
+    if (slot.status) {
+      CHECK(slot.datum.SerializeToString(&slot.value));
+    }
+    pipeline->done.push(line_id);
+  }
+}
+#endif  // USE_OPENCV
 
 int main(int argc, char** argv) {
 #ifdef USE_OPENCV
@@ -66,13 +165,18 @@ int main(int argc, char** argv) {
     return 1;
   }
 
-  const bool is_color = !FLAGS_gray;
   const bool check_size = FLAGS_check_size;
   const bool encoded = FLAGS_encoded;
   const string encode_type = FLAGS_encode_type;
+  const int threads = FLAGS_threads > 0 ? FLAGS_threads :
+      std::max<int>(1, boost::thread::hardware_concurrency());
+  const int readers = std::max<int>(1, FLAGS_readers);
+  const size_t commit_size = static_cast<size_t>(
+      std::max<int>(1, FLAGS_commit_mb)) << 20;
 
+  Pipeline pipeline;
   std::ifstream infile(argv[2]);
-  std::vector<std::pair<std::string, int> > lines;
+  std::vector<std::pair<std::string, int> >& lines = pipeline.lines;
   std::string line;
   size_t pos;
   int label;
@@ -90,68 +194,97 @@ int main(int argc, char** argv) {
 
   if (encode_type.size() && !encoded)
     LOG(INFO) << "encode_type specified, assuming encoded=true.";
+  CHECK(FLAGS_backend != "packed" || (!encoded && encode_type.empty()))
+      << "Packed databases hold raw pixels, images cannot be encoded";
 
-  int resize_height = std::max<int>(0, FLAGS_resize_height);
-  int resize_width = std::max<int>(0, FLAGS_resize_width);
+  pipeline.root_folder = argv[1];
+  pipeline.encode_type = encode_type;
+  pipeline.encoded = encoded;
+  pipeline.is_color = !FLAGS_gray;
+  pipeline.resize_height = std::max<int>(0, FLAGS_resize_height);
+  pipeline.resize_width = std::max<int>(0, FLAGS_resize_width);
 
   // Create new DB
   scoped_ptr<db::DB> db(db::GetDB(FLAGS_backend));
   db->Open(argv[3], db::NEW);
   scoped_ptr<db::Transaction> txn(db->NewTransaction());
 
-  // Storing to db
-  std::string root_folder(argv[1]);
-  Datum datum;
+  // Start converting
+  pipeline.slots.resize(4 * (readers + threads));
+  for (int i = 0; i < pipeline.slots.size(); ++i) {
+    pipeline.free_slots.push(i);
+  }
+  pipeline.next_line = 0;
+  LOG(INFO) << "Converting with " << readers << " readers and " << threads
+      << " threads.";
+  boost::thread_group reader_threads, worker_threads;
+  for (int i = 0; i < readers; ++i) {
+    reader_threads.create_thread(boost::bind(&ReadImages, &pipeline));
+  }
+  for (int i = 0; i < threads; ++i) {
+    worker_threads.create_thread(boost::bind(&ConvertImages, &pipeline));
+  }
+
+  // Storing to db, in order
+  CPUTimer timer;
+  timer.Start();
+  vector<bool> ready(pipeline.slots.size(), false);
   int count = 0;
   int data_size = 0;
   bool data_size_initialized = false;
+  size_t txn_size = 0;
 
   for (int line_id = 0; line_id < lines.size(); ++line_id) {
-    bool status;
-    std::string enc = encode_type;
-    if (encoded && !enc.size()) {
-      // Guess the encoding type from the file name
-      string fn = lines[line_id].first;
-      size_t p = fn.rfind('.');
-      if ( p == fn.npos )
-        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
-      enc = fn.substr(p);
-      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    const int s = line_id % pipeline.slots.size();
+    while (!ready[s]) {
+      ready[pipeline.done.pop() % pipeline.slots.size()] = true;
     }
-    status = ReadImageToDatum(root_folder + lines[line_id].first,
-        lines[line_id].second, resize_height, resize_width, is_color,
-        enc, &datum);
-    if (status == false) continue;
-    if (check_size) {
-      if (!data_size_initialized) {
-        data_size = datum.channels() * datum.height() * datum.width();
-        data_size_initialized = true;
-      } else {
-        const std::string& data = datum.data();
-        CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
-            << data.size();
+    ready[s] = false;
+    Slot& slot = pipeline.slots[s];
+    if (slot.status) {
+      if (check_size) {
+        if (!data_size_initialized) {
+          data_size = slot.datum.channels() * slot.datum.height() *
+              slot.datum.width();
+          data_size_initialized = true;
+        } else {
+          const std::string& data = slot.datum.data();
+          CHECK_EQ(data.size(), data_size) << "Incorrect data field size "
+              << data.size();
+        }
       }
-    }
-    // sequential
-    string key_str = caffe::format_int(line_id, 8) + "_" + lines[line_id].first;
+      // sequential
+      string key_str = caffe::format_int(line_id, 8) + "_" +
+          lines[line_id].first;
 
-    // Put in db
-    string out;
-    CHECK(datum.SerializeToString(&out));
-    txn->Put(key_str, out);
+      // Put in db
+      txn->Put(key_str, slot.value);
+      txn_size += slot.value.size();
+      ++count;
+    }
+    pipeline.free_slots.push(s);
 
-    if (++count % 1000 == 0) {
+    if (txn_size >= commit_size) {
       // Commit db
       txn->Commit();
       txn.reset(db->NewTransaction());
-      LOG(INFO) << "Processed " << count << " files.";
+      txn_size = 0;
+      LOG(INFO) << "Processed " << count << " files, "
+          << count / (timer.MilliSeconds() / 1000) << " images/s.";
     }
   }
   // write the last batch
-  if (count % 1000 != 0) {
+  if (txn_size > 0) {
     txn->Commit();
-    LOG(INFO) << "Processed " << count << " files.";
   }
+  LOG(INFO) << "Processed " << count << " files, "
+      << count / (timer.MilliSeconds() / 1000) << " images/s.";
+
+  reader_threads.join_all();
+  for (int i = 0; i < threads; ++i) {
+    pipeline.read.push(-1);
+  }
+  worker_threads.join_all();
 #else
   LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
 #endif  // USE_OPENCV
@@ -1,24 +1,256 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
 #include <string>
 #include <vector>
 
 #include "boost/algorithm/string.hpp"
+#include "boost/thread.hpp"
 #include "google/protobuf/text_format.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
 #include "caffe/net.hpp"
 #include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blocking_queue.hpp"
 #include "caffe/util/db.hpp"
 #include "caffe/util/format.hpp"
 #include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
 
 using caffe::Blob;
+using caffe::BlockingQueue;
 using caffe::Caffe;
 using caffe::Datum;
 using caffe::Net;
 using std::string;
+using std::vector;
 namespace db = caffe::db;
 
+// Rounds to the nearest IEEE half precision value
+static uint16_t float_to_half(float value) {
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  const uint32_t sign = (f >> 16) & 0x8000;
+  const int exponent = static_cast<int>((f >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = f & 0x7fffff;
+  if (((f >> 23) & 0xff) == 0xff) {  // Inf or NaN
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  if (exponent >= 31) {  // Overflow
+    return sign | 0x7c00;
+  }
+  if (exponent <= 0) {  // Subnormal or zero
+    if (exponent < -10) {
+      return sign;
+    }
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) {
+      ++half;
+    }
+    return sign | half;
+  }
+  uint32_t half = (exponent << 10) | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+    ++half;  // May carry into the exponent, up to infinity
+  }
+  return sign | half;
+}
+
+// Writes features as the rows of a float32 or float16 array in the npy
+// format, to a memory-mapped file sized for all the rows up front.
+class NpyFile {
+ public:
+  NpyFile(const string& filename, const vector<int>& shape, bool half)
+      : filename_(filename), half_(half), rows_(shape[0]), row_(0) {
+    std::ostringstream header;
+    header << "{'descr': '" << (half ? "<f2" : "<f4")
+        << "', 'fortran_order': False, 'shape': (";
+    dim_ = 1;
+    for (int i = 0; i < shape.size(); ++i) {
+      header << (i > 0 ? ", " : "") << shape[i];
+      dim_ *= i > 0 ? shape[i] : 1;
+    }
+    header << (shape.size() == 1 ? ",), }" : "), }");
+    // Magic, version 1.0, header length, header padded with spaces and
+    // terminated by a newline so that the data is aligned on 64 bytes
+    string preamble("\x93NUMPY\x01\x00\0\0", 10);
+    const size_t size = ((preamble.size() + header.str().size() + 1 + 63) /
+        64) * 64;
+    string text = header.str();
+    text.resize(size - preamble.size() - 1, ' ');
+    text += '\n';
+    preamble[8] = text.size() & 0xff;
+    preamble[9] = text.size() >> 8;
+    offset_ = preamble.size() + text.size();
+    size_ = offset_ + rows_ * dim_ * (half ? 2 : 4);
+
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0664);
+    CHECK_GE(fd, 0) << "Failed to create " << filename;
+    CHECK_EQ(ftruncate(fd, size_), 0) << "Failed to resize " << filename;
+    void* map = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(map != MAP_FAILED) << "Failed to map " << filename;
+    map_ = static_cast<char*>(map);
+    memcpy(map_, preamble.data(), preamble.size());
+    memcpy(map_ + preamble.size(), text.data(), text.size());
+  }
+  ~NpyFile() {
+    CHECK_EQ(row_, rows_) << "Missing rows in " << filename_;
+    CHECK_EQ(munmap(map_, size_), 0) << "Failed to write " << filename_;
+  }
+
+  // Appends rows of dim values
+  template <typename Dtype>
+  void Write(const Dtype* data, size_t rows) {
+    CHECK_LE(row_ + rows, rows_) << "Too many rows for " << filename_;
+    const size_t count = rows * dim_;
+    if (half_) {
+      uint16_t* out = reinterpret_cast<uint16_t*>(map_ + offset_) +
+          row_ * dim_;
+      for (size_t i = 0; i < count; ++i) {
+        out[i] = float_to_half(data[i]);
+      }
+    } else {
+      float* out = reinterpret_cast<float*>(map_ + offset_) + row_ * dim_;
+      std::copy(data, data + count, out);
+    }
+    row_ += rows;
+  }
+
+ private:
+  const string filename_;
+  const bool half_;
+  const size_t rows_;
+  size_t dim_;
+  size_t row_;
+  size_t offset_;
+  size_t size_;
+  char* map_;
+};
+
+// Writes the features extracted from a batch while the next batch is
+// forwarded, through two buffers.
+template <typename Dtype>
+class FeatureWriter {
+ public:
+  struct Buffer {
+    vector<vector<Dtype> > data;  // Features of each blob
+    vector<vector<int> > shapes;
+  };
+
+  FeatureWriter(const vector<string>& blob_names,
+      const vector<boost::shared_ptr<db::DB> >& dbs,
+      const vector<boost::shared_ptr<NpyFile> >& npys)
+      : blob_names_(blob_names), dbs_(dbs), npys_(npys),
+        image_indices_(blob_names.size(), 0), buffers_(2) {
+    for (int i = 0; i < dbs_.size(); ++i) {
+      txns_.push_back(boost::shared_ptr<db::Transaction>(
+          dbs_[i]->NewTransaction()));
+    }
+    for (int i = 0; i < buffers_.size(); ++i) {
+      buffers_[i].data.resize(blob_names.size());
+      buffers_[i].shapes.resize(blob_names.size());
+      free_.push(i);
+    }
+    thread_.reset(new boost::thread(&FeatureWriter::Run, this));
+  }
+
+  // Copies the features of the blobs, to be written in the background
+  void Push(const vector<boost::shared_ptr<Blob<Dtype> > >& blobs) {
+    const int b = free_.pop();
+    for (int i = 0; i < blobs.size(); ++i) {
+      buffers_[b].data[i].resize(blobs[i]->count());
+      caffe::caffe_copy(blobs[i]->count(), blobs[i]->cpu_data(),
+          &buffers_[b].data[i][0]);
+      buffers_[b].shapes[i] = blobs[i]->shape();
+    }
+    full_.push(b);
+  }
+
+  // Writes the last features and waits for the writer
+  void Finish() {
+    full_.push(-1);
+    thread_->join();
+  }
+
+ protected:
+  void Run() {
+    Datum datum;
+    while (true) {
+      const int b = full_.pop();
+      if (b < 0) {
+        break;
+      }
+      for (int i = 0; i < blob_names_.size(); ++i) {
+        Write(i, buffers_[b].data[i], buffers_[b].shapes[i], &datum);
+      }
+      free_.push(b);
+    }
+    // write the last batch
+    for (int i = 0; i < blob_names_.size(); ++i) {
+      if (txns_.size() && image_indices_[i] % 1000 != 0) {
+        txns_.at(i)->Commit();
+      }
+      LOG(ERROR)<< "Extracted features of " << image_indices_[i] <<
+          " query images for feature blob " << blob_names_[i];
+    }
+  }
+
+  void Write(int i, const vector<Dtype>& data, const vector<int>& shape,
+      Datum* datum) {
+    const int batch_size = shape[0];
+    const int dim_features = data.size() / batch_size;
+    if (npys_.size()) {
+      npys_[i]->Write(&data[0], batch_size);
+      image_indices_[i] += batch_size;
+      return;
+    }
+    datum->set_channels(shape.size() > 1 ? shape[1] : 1);
+    datum->set_height(shape.size() > 2 ? shape[2] : 1);
+    datum->set_width(shape.size() > 3 ? shape[3] : 1);
+    datum->clear_data();
+    datum->mutable_float_data()->Resize(dim_features, 0);
+    for (int n = 0; n < batch_size; ++n) {
+      const Dtype* feature_blob_data = &data[n * dim_features];
+      std::copy(feature_blob_data, feature_blob_data + dim_features,
+          datum->mutable_float_data()->mutable_data());
+      string key_str = caffe::format_int(image_indices_[i], 10);
+
+      string out;
+      CHECK(datum->SerializeToString(&out));
+      txns_.at(i)->Put(key_str, out);
+      ++image_indices_[i];
+      if (image_indices_[i] % 1000 == 0) {
+        txns_.at(i)->Commit();
+        txns_.at(i).reset(dbs_.at(i)->NewTransaction());
+        LOG(ERROR)<< "Extracted features of " << image_indices_[i] <<
+            " query images for feature blob " << blob_names_[i];
+      }
+    }
+  }
+
+  const vector<string> blob_names_;
+  vector<boost::shared_ptr<db::DB> > dbs_;
+  vector<boost::shared_ptr<db::Transaction> > txns_;
+  vector<boost::shared_ptr<NpyFile> > npys_;
+  vector<int> image_indices_;
+  vector<Buffer> buffers_;
+  BlockingQueue<int> free_;
+  BlockingQueue<int> full_;
+  boost::shared_ptr<boost::thread> thread_;
+};
+
 template<typename Dtype>
 int feature_extraction_pipeline(int argc, char** argv);
 
@@ -42,7 +274,10 @@ int feature_extraction_pipeline(int argc, char** argv) {
     "Note: you can extract multiple features in one pass by specifying"
     " multiple feature blob names and dataset names separated by ','."
     " The names cannot contain white space characters and the number of blobs"
-    " and datasets must be equal.";
+    " and datasets must be equal.\n"
+    "db_type npy or npy_fp16 writes each feature blob as a float32 or"
+    " float16 array, of shape num_mini_batches * batch size by the shape of"
+    " a feature, to the file named by the dataset name.";
     return 1;
   }
   int arg_pos = num_required_args;
@@ -119,64 +354,41 @@ int feature_extraction_pipeline(int argc, char** argv) {
   int num_mini_batches = atoi(argv[++arg_pos]);
 
   std::vector<boost::shared_ptr<db::DB> > feature_dbs;
-  std::vector<boost::shared_ptr<db::Transaction> > txns;
-  const char* db_type = argv[++arg_pos];
+  std::vector<boost::shared_ptr<NpyFile> > feature_npys;
+  std::vector<boost::shared_ptr<Blob<Dtype> > > feature_blobs;
+  const string db_type = argv[++arg_pos];
+  const bool npy = db_type == "npy" || db_type == "npy_fp16";
   for (size_t i = 0; i < num_features; ++i) {
     LOG(INFO)<< "Opening dataset " << dataset_names[i];
+    feature_blobs.push_back(
+        feature_extraction_net->blob_by_name(blob_names[i]));
+    if (npy) {
+      vector<int> shape = feature_blobs[i]->shape();
+      CHECK_GT(shape.size(), 0) << "Feature blob " << blob_names[i]
+          << " has no batch axis";
+      shape[0] *= num_mini_batches;
+      feature_npys.push_back(boost::shared_ptr<NpyFile>(new NpyFile(
+          dataset_names[i], shape, db_type == "npy_fp16")));
+      continue;
+    }
     boost::shared_ptr<db::DB> db(db::GetDB(db_type));
     db->Open(dataset_names.at(i), db::NEW);
     feature_dbs.push_back(db);
-    boost::shared_ptr<db::Transaction> txn(db->NewTransaction());
-    txns.push_back(txn);
   }
 
   LOG(ERROR)<< "Extracting Features";
 
-  Datum datum;
-  std::vector<int> image_indices(num_features, 0);
+  // Features are written while the next batch is forwarded
+  FeatureWriter<Dtype> writer(blob_names, feature_dbs, feature_npys);
   for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index) {
     feature_extraction_net->Forward();
-    for (int i = 0; i < num_features; ++i) {
-      const boost::shared_ptr<Blob<Dtype> > feature_blob =
-        feature_extraction_net->blob_by_name(blob_names[i]);
-      int batch_size = feature_blob->num();
-      int dim_features = feature_blob->count() / batch_size;
-      const Dtype* feature_blob_data;
-      for (int n = 0; n < batch_size; ++n) {
-        datum.set_height(feature_blob->height());
-        datum.set_width(feature_blob->width());
-        datum.set_channels(feature_blob->channels());
-        datum.clear_data();
-        datum.clear_float_data();
-        feature_blob_data = feature_blob->cpu_data() +
-            feature_blob->offset(n);
-        for (int d = 0; d < dim_features; ++d) {
-          datum.add_float_data(feature_blob_data[d]);
-        }
-        string key_str = caffe::format_int(image_indices[i], 10);
-
-        string out;
-        CHECK(datum.SerializeToString(&out));
-        txns.at(i)->Put(key_str, out);
-        ++image_indices[i];
-        if (image_indices[i] % 1000 == 0) {
-          txns.at(i)->Commit();
-          txns.at(i).reset(feature_dbs.at(i)->NewTransaction());
-          LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-              " query images for feature blob " << blob_names[i];
-        }
-      }  // for (int n = 0; n < batch_size; ++n)
-    }  // for (int i = 0; i < num_features; ++i)
+    writer.Push(feature_blobs);
   }  // for (int batch_index = 0; batch_index < num_mini_batches; ++batch_index)
-  // write the last batch
-  for (int i = 0; i < num_features; ++i) {
-    if (image_indices[i] % 1000 != 0) {
-      txns.at(i)->Commit();
-    }
-    LOG(ERROR)<< "Extracted features of " << image_indices[i] <<
-        " query images for feature blob " << blob_names[i];
+  writer.Finish();
+  for (int i = 0; i < feature_dbs.size(); ++i) {
     feature_dbs.at(i)->Close();
   }
+  feature_npys.clear();
 
   LOG(ERROR)<< "Successfully extracted the features!";
   return 0;
@@ -0,0 +1,514 @@
+// Microbenchmarks of the kernels, layers and pruning routines that dominate
+// training time, over sweeps of realistic shapes.
+// Usage:
+//    microbenchmark [--filter=gemm] [--iterations=20] [--json=out.json]
+//        [--baseline=earlier.json]
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <google/protobuf/text_format.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/adaptive_probabilistic_pruning.hpp"
+#include "caffe/caffe.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/layers/conv_layer.hpp"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/layer_cost.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::APP;
+using caffe::Blob;
+using caffe::Caffe;
+using caffe::Datum;
+using caffe::Layer;
+using caffe::LayerParameter;
+using caffe::shared_ptr;
+using caffe::string;
+using caffe::vector;
+using std::ostringstream;
+
+DEFINE_string(filter, "",
+    "Optional; only run the benchmarks whose name contains this.");
+DEFINE_int32(iterations, 20,
+    "The number of timed runs of each benchmark.");
+DEFINE_int32(warmup, 2,
+    "The number of untimed runs of each benchmark before timing.");
+DEFINE_int32(batch, 8,
+    "The batch size of the layer benchmarks.");
+DEFINE_int32(gpu, -1,
+    "Optional; run the layers and the SSL regularizer on this GPU. The "
+    "kernels named cpu always run on the CPU.");
+DEFINE_string(json, "",
+    "Optional; the file to write the results to as JSON.");
+DEFINE_string(baseline, "",
+    "Optional; the JSON results of an earlier run, to report the change of "
+    "each median against.");
+
+struct Result {
+  string name;
+  caffe::TimeStats ms;
+  double flops;
+  double bytes;
+};
+
+static vector<Result> results;
+static std::map<string, double> baseline_ms;  // Medians by name
+
+// Times run, unless filtered out, and logs its stats
+template <typename Run>
+static void Measure(const string& name, double flops, double bytes,
+    Run run) {
+  if (name.find(FLAGS_filter) == string::npos) {
+    return;
+  }
+  for (int i = 0; i < FLAGS_warmup; ++i) {
+    run();
+  }
+  vector<double> samples;
+  caffe::Timer timer;
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    timer.Start();
+    run();
+    samples.push_back(timer.MicroSeconds() / 1000);
+  }
+  Result result = {name, caffe::ComputeTimeStats(samples), flops, bytes};
+  ostringstream line;
+  line << name << ": median " << result.ms.median << " ms, p90 "
+      << result.ms.p90 << ", " << flops / result.ms.median / 1e6
+      << " GFLOP/s, " << bytes / result.ms.median / 1e6 << " GB/s";
+  std::map<string, double>::const_iterator base = baseline_ms.find(name);
+  if (base != baseline_ms.end()) {
+    line << ", " << std::showpos
+        << (result.ms.median / base->second - 1) * 100 << std::noshowpos
+        << "% vs baseline";
+  }
+  LOG(INFO) << line.str();
+  results.push_back(result);
+}
+
+static void Fill(Blob<float>* blob) {
+  caffe::caffe_rng_gaussian<float>(blob->count(), 0, 1,
+      blob->mutable_cpu_data());
+}
+
+struct Gemm {
+  int M, N, K;
+  const float* A;
+  const float* B;
+  float* C;
+  void operator()() const {
+    caffe::caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, M, N, K, 1, A, B,
+        0, C);
+  }
+};
+
+static void BenchmarkGemm() {
+  // Convolutions as products of M filters by N pixels of K = channels x
+  // kernel im2col rows, then a classifier on a batch
+  const int shapes[][3] = {
+    {96, 3025, 363}, {64, 3136, 576}, {128, 784, 1152}, {1000, 8, 1024}};
+  for (int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+    const int M = shapes[i][0], N = shapes[i][1], K = shapes[i][2];
+    Blob<float> a(1, 1, M, K), b(1, 1, K, N), c(1, 1, M, N);
+    Fill(&a);
+    Fill(&b);
+    Gemm gemm = {M, N, K, a.cpu_data(), b.cpu_data(), c.mutable_cpu_data()};
+    ostringstream name;
+    name << "caffe_cpu_gemm/M=" << M << ",N=" << N << ",K=" << K;
+    Measure(name.str(), 2. * M * N * K,
+        (a.count() + b.count() + c.count()) * sizeof(float), gemm);
+  }
+}
+
+struct Im2col {
+  int channels, height, width, kernel, pad, stride;
+  float* image;
+  float* col;
+  bool backward;
+  void operator()() const {
+    if (backward) {
+      caffe::col2im_cpu<float>(col, channels, height, width, kernel, kernel,
+          pad, pad, stride, stride, 1, 1, image);
+    } else {
+      caffe::im2col_cpu<float>(image, channels, height, width, kernel, kernel,
+          pad, pad, stride, stride, 1, 1, col);
+    }
+  }
+};
+
+static void BenchmarkIm2col() {
+  // Channels, height and width, kernel, pad and stride
+  const int shapes[][6] = {
+    {3, 227, 227, 11, 0, 4}, {64, 56, 56, 3, 1, 1}, {256, 13, 13, 3, 1, 1}};
+  for (int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+    const int* s = shapes[i];
+    const int out_h = (s[1] + 2 * s[4] - s[3]) / s[5] + 1;
+    const int out_w = (s[2] + 2 * s[4] - s[3]) / s[5] + 1;
+    Blob<float> image(1, s[0], s[1], s[2]);
+    Blob<float> col(1, s[0] * s[3] * s[3], out_h, out_w);
+    Fill(&image);
+    Fill(&col);
+    const double bytes = (image.count() + col.count()) * sizeof(float);
+    ostringstream shape;
+    shape << "/" << s[0] << "x" << s[1] << "x" << s[2] << ",k=" << s[3]
+        << ",s=" << s[5];
+    Im2col im2col = {s[0], s[1], s[2], s[3], s[4], s[5],
+        image.mutable_cpu_data(), col.mutable_cpu_data(), false};
+    Measure("im2col_cpu" + shape.str(), 0, bytes, im2col);
+    im2col.backward = true;
+    Measure("col2im_cpu" + shape.str(), col.count(), bytes, im2col);
+  }
+}
+
+struct Elementwise {
+  int n;
+  const float* a;
+  float* y;
+  bool power;
+  void operator()() const {
+    if (power) {
+      caffe::caffe_powx<float>(n, a, 0.75, y);
+    } else {
+      caffe::caffe_exp<float>(n, a, y);
+    }
+  }
+};
+
+static void BenchmarkElementwise() {
+  const int sizes[] = {1 << 16, 1 << 20, 1 << 23};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    Blob<float> a(1, 1, 1, sizes[i]), y(1, 1, 1, sizes[i]);
+    caffe::caffe_rng_uniform<float>(a.count(), 0, 1, a.mutable_cpu_data());
+    const double bytes = 2. * sizes[i] * sizeof(float);
+    ostringstream size;
+    size << "/n=" << sizes[i];
+    Elementwise elementwise = {sizes[i], a.cpu_data(), y.mutable_cpu_data(),
+        false};
+    Measure("caffe_exp" + size.str(), sizes[i], bytes, elementwise);
+    elementwise.power = true;
+    Measure("caffe_powx" + size.str(), sizes[i], bytes, elementwise);
+  }
+}
+
+struct Transform {
+  caffe::DataTransformer<float>* transformer;
+  const Datum* datum;
+  Blob<float>* blob;
+  void operator()() const {
+    transformer->Transform(*datum, blob);
+  }
+};
+
+static void BenchmarkTransform() {
+  // Random crops and mirrors of raw images, with mean subtraction
+  const int sizes[][2] = {{32, 28}, {256, 227}};
+  for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    const int size = sizes[i][0], crop = sizes[i][1];
+    caffe::TransformationParameter param;
+    param.set_crop_size(crop);
+    param.set_mirror(true);
+    param.set_scale(1. / 255);
+    for (int c = 0; c < 3; ++c) {
+      param.add_mean_value(128);
+    }
+    caffe::DataTransformer<float> transformer(param, caffe::TRAIN);
+    transformer.InitRand();
+    Datum datum;
+    datum.set_channels(3);
+    datum.set_height(size);
+    datum.set_width(size);
+    string data(3 * size * size, 0);
+    for (int j = 0; j < data.size(); ++j) {
+      data[j] = static_cast<char>(caffe::caffe_rng_rand());
+    }
+    datum.set_data(data);
+    Blob<float> blob(1, 3, crop, crop);
+    Transform transform = {&transformer, &datum, &blob};
+    ostringstream name;
+    name << "DataTransformer::Transform/" << size << "->" << crop;
+    Measure(name.str(), 3. * blob.count(),
+        data.size() + blob.count() * sizeof(float), transform);
+  }
+}
+
+struct LayerPass {
+  Layer<float>* layer;
+  const vector<Blob<float>*>* bottom;
+  const vector<Blob<float>*>* top;
+  const vector<bool>* propagate_down;  // NULL runs Forward
+  void operator()() const {
+    if (propagate_down) {
+      layer->Backward(*top, *propagate_down, *bottom);
+    } else {
+      layer->Forward(*bottom, *top);
+    }
+  }
+};
+
+static void BenchmarkLayers() {
+  // Layer parameters and the channels, height and width of their input
+  struct Shape {
+    const char* param;
+    int channels, height, width;
+  };
+  const Shape shapes[] = {
+    {"type: 'Convolution' convolution_param { num_output: 96 kernel_size: 11 "
+     "stride: 4 weight_filler { type: 'gaussian' std: 0.01 } }", 3, 227, 227},
+    {"type: 'Convolution' convolution_param { num_output: 64 kernel_size: 3 "
+     "pad: 1 weight_filler { type: 'gaussian' std: 0.01 } }", 64, 56, 56},
+    {"type: 'ConvolutionDepthwise' convolution_param { num_output: 128 "
+     "group: 128 kernel_size: 3 pad: 1 stride: 1 "
+     "weight_filler { type: 'gaussian' std: 0.01 } }", 128, 56, 56},
+    {"type: 'Pooling' pooling_param { pool: MAX kernel_size: 3 stride: 2 }",
+     96, 55, 55},
+    {"type: 'LRN' lrn_param { local_size: 5 }", 96, 55, 55},
+    {"type: 'BatchNorm'", 64, 56, 56},
+    {"type: 'Softmax'", 1000, 1, 1},
+    {"type: 'ShuffleChannel' shuffle_channel_param { group: 4 }",
+     128, 28, 28},
+  };
+  for (int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+    LayerParameter param;
+    CHECK(google::protobuf::TextFormat::ParseFromString(shapes[i].param,
+        &param));
+    ostringstream name;
+    name << "layer/" << param.type() << "/" << FLAGS_batch << "x"
+        << shapes[i].channels << "x" << shapes[i].height << "x"
+        << shapes[i].width;
+    if ((name.str() + "/forward").find(FLAGS_filter) == string::npos &&
+        (name.str() + "/backward").find(FLAGS_filter) == string::npos) {
+      continue;
+    }
+    // Names are unique, as convolutions register in the pruning state
+    param.set_name(name.str());
+    param.set_phase(caffe::TRAIN);
+    shared_ptr<Layer<float> > layer =
+        caffe::LayerRegistry<float>::CreateLayer(param);
+    Blob<float> bottom_blob(FLAGS_batch, shapes[i].channels,
+        shapes[i].height, shapes[i].width), top_blob;
+    vector<Blob<float>*> bottom(1, &bottom_blob), top(1, &top_blob);
+    Fill(&bottom_blob);
+    layer->SetUp(bottom, top);
+    layer->Forward(bottom, top);
+    caffe::caffe_rng_gaussian<float>(top_blob.count(), 0, 1,
+        top_blob.mutable_cpu_diff());
+    const caffe::LayerCost forward = caffe::ForwardCost(layer.get(), bottom,
+        top);
+    const caffe::LayerCost backward = caffe::BackwardCost(layer.get(), bottom,
+        top);
+    LayerPass pass = {layer.get(), &bottom, &top, NULL};
+    Measure(name.str() + "/forward", forward.flops, forward.bytes, pass);
+    const vector<bool> propagate_down(1, true);
+    pass.propagate_down = &propagate_down;
+    Measure(name.str() + "/backward", backward.flops, backward.bytes, pass);
+  }
+}
+
+// Exposes the probabilistic pruning step, which Forward_gpu runs
+class PruningLayer : public caffe::ConvolutionLayer<float> {
+ public:
+  explicit PruningLayer(const LayerParameter& param)
+      : caffe::ConvolutionLayer<float>(param) {}
+  void operator()() {
+    ProbPruneCol();
+  }
+  // Prunes every other column and keeps the others with probability 0.5,
+  // a layer midway through pruning
+  void SetHalfPruned() {
+    const int L = APP::layer_index[this->layer_param_.name()];
+    const int num_row = this->blobs_[0]->shape(0);
+    const int num_col = this->blobs_[0]->count() / num_row;
+    float* weights = this->blobs_[0]->mutable_cpu_data();
+    for (int j = 0; j < num_col; ++j) {
+      const bool pruned = j % 2 == 0;
+      APP::history_prob[L][j] = pruned ? 0 : 0.5;
+      for (int g = 0; g < this->group_; ++g) {
+        APP::IF_col_pruned[L][j][g] = pruned;
+      }
+      if (pruned) {
+        for (int i = 0; i < num_row; ++i) {
+          weights[i * num_col + j] = 0;
+        }
+        APP::num_pruned_col[L] += 1;
+      }
+    }
+  }
+};
+
+struct Prune {
+  PruningLayer* layer;
+  void operator()() const {
+    (*layer)();
+  }
+};
+
+static void BenchmarkPruning() {
+  // Filters and channels of 3x3 convolutions
+  const int shapes[][2] = {{64, 64}, {256, 128}, {512, 512}};
+  for (int i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i) {
+    ostringstream name;
+    name << "ProbPruneCol/" << shapes[i][0] << "x" << shapes[i][1] * 9;
+    if (name.str().find(FLAGS_filter) == string::npos) {
+      continue;
+    }
+    // Neither recover columns nor lower their probabilities, which would
+    // prune more columns at each run, so that all runs do the same work on
+    // a fixed, half pruned layer
+    APP::prune_method = "PPc";
+    APP::step_ = 0;
+    APP::iter_size = 1;
+    APP::rgamma = 0;
+    APP::rpower = 1;
+    APP::cgamma = 0;
+    APP::cpower = 1;
+    LayerParameter param;
+    param.set_name(name.str());
+    param.set_phase(caffe::TRAIN);
+    param.mutable_convolution_param()->set_num_output(shapes[i][0]);
+    param.mutable_convolution_param()->add_kernel_size(3);
+    param.mutable_convolution_param()->mutable_weight_filler()->set_type(
+        "gaussian");
+    param.mutable_prune_param()->set_prune_ratio(0.5);
+    PruningLayer layer(param);
+    Blob<float> bottom_blob(1, shapes[i][1], 7, 7), top_blob;
+    vector<Blob<float>*> bottom(1, &bottom_blob), top(1, &top_blob);
+    layer.SetUp(bottom, top);
+    layer.SetHalfPruned();
+    Prune prune = {&layer};
+    const int count = layer.blobs()[0]->count();
+    Measure(name.str(), 4. * count, 4. * count * sizeof(float), prune);
+    APP::Reset();
+  }
+}
+
+#ifndef CPU_ONLY
+// Exposes the regularization of the solver, which only has SSL on GPU
+class RegularizingSolver : public caffe::SGDSolver<float> {
+ public:
+  explicit RegularizingSolver(const caffe::SolverParameter& param)
+      : caffe::SGDSolver<float>(param) {}
+  void operator()() {
+    Regularize(0);
+  }
+};
+
+struct Regularize {
+  RegularizingSolver* solver;
+  void operator()() const {
+    (*solver)();
+  }
+};
+
+static void BenchmarkSSL() {
+  const string name = "SSL/256x1152";
+  if (Caffe::mode() != Caffe::GPU ||
+      name.find(FLAGS_filter) == string::npos) {
+    return;
+  }
+  caffe::SolverParameter param;
+  CHECK(google::protobuf::TextFormat::ParseFromString(
+      "base_lr: 0.01 lr_policy: 'fixed' weight_decay: 0.0005 "
+      "regularization_type: 'SSL' net_param { "
+      "layer { name: 'data' type: 'DummyData' top: 'data' "
+      "dummy_data_param { shape { dim: 1 dim: 128 dim: 7 dim: 7 } } } "
+      "layer { name: 'ssl' type: 'Convolution' bottom: 'data' top: 'ssl' "
+      "convolution_param { num_output: 256 kernel_size: 3 "
+      "weight_filler { type: 'gaussian' std: 0.01 } } "
+      "prune_param { prune_ratio: 0.5 } } }", &param));
+  RegularizingSolver solver(param);
+  Regularize regularize = {&solver};
+  Measure(name, 10. * 256 * 1152, 6. * 256 * 1152 * sizeof(float),
+      regularize);
+}
+#endif
+
+// Reads the medians of the JSON results written by this tool
+static void ReadBaseline(const string& filename) {
+  std::ifstream file(filename.c_str());
+  CHECK(file) << "Failed to open baseline " << filename;
+  const string name_key = "\"name\": \"", median_key = "\"median_ms\": ";
+  string line;
+  while (std::getline(file, line)) {
+    const size_t name = line.find(name_key);
+    const size_t median = line.find(median_key);
+    if (name == string::npos || median == string::npos) {
+      continue;
+    }
+    const size_t begin = name + name_key.size();
+    baseline_ms[line.substr(begin, line.find('"', begin) - begin)] =
+        atof(line.c_str() + median + median_key.size());
+  }
+  LOG(INFO) << "Read " << baseline_ms.size() << " baseline results from "
+      << filename;
+}
+
+static void WriteResults(const string& filename) {
+  std::ofstream json(filename.c_str());
+  CHECK(json) << "Failed to open " << filename;
+  json << "{\"iterations\": " << FLAGS_iterations << ", \"warmup\": "
+      << FLAGS_warmup << ", \"batch\": " << FLAGS_batch
+      << ", \"benchmarks\": [";
+  for (int i = 0; i < results.size(); ++i) {
+    const Result& result = results[i];
+    // One result per line, as ReadBaseline expects
+    json << (i ? ",\n" : "\n") << "{\"name\": \"" << result.name
+        << "\", \"mean_ms\": " << result.ms.mean
+        << ", \"stddev_ms\": " << result.ms.stddev
+        << ", \"median_ms\": " << result.ms.median
+        << ", \"p90_ms\": " << result.ms.p90
+        << ", \"p99_ms\": " << result.ms.p99
+        << ", \"flops\": " << result.flops
+        << ", \"bytes\": " << result.bytes;
+    std::map<string, double>::const_iterator base =
+        baseline_ms.find(result.name);
+    if (base != baseline_ms.end()) {
+      json << ", \"baseline_median_ms\": " << base->second;
+    }
+    json << "}";
+  }
+  json << "\n]}\n";
+  CHECK(json) << "Failed to write " << filename;
+  LOG(INFO) << "Wrote " << results.size() << " results to " << filename;
+}
+
+int main(int argc, char** argv) {
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Times the kernels, layers and pruning routines "
+      "of caffe.\nUsage:\n"
+      "    microbenchmark [--filter=gemm] [--iterations=20] [--json=out.json]"
+      "\n        [--baseline=earlier.json]");
+  caffe::GlobalInit(&argc, &argv);
+  CHECK_GT(FLAGS_iterations, 0);
+  if (FLAGS_gpu >= 0) {
+    Caffe::SetDevice(FLAGS_gpu);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    Caffe::set_mode(Caffe::CPU);
+  }
+  Caffe::set_random_seed(1701);
+  if (FLAGS_baseline.size()) {
+    ReadBaseline(FLAGS_baseline);
+  }
+#ifndef CPU_ONLY
+  // First, for its convolution to be the first one the SSL state indexes
+  BenchmarkSSL();
+#endif
+  BenchmarkGemm();
+  BenchmarkIm2col();
+  BenchmarkElementwise();
+  BenchmarkTransform();
+  BenchmarkLayers();
+  BenchmarkPruning();
+  if (FLAGS_json.size()) {
+    WriteResults(FLAGS_json);
+  }
+  return 0;
+}